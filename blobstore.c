@@ -0,0 +1,276 @@
+/*
+  Blob stores (see BLOB STORE in format.txt): directories that keep big
+  blobs outside of dumps, each in a file named by its SHA-256, so that
+  successive dumps of a database share the blobs that didn't change.
+
+  A file only ever appears whole, renamed into place from a temporary
+  file, so any number of stores may add to the same directory at once,
+  and a file that is already there with the right size is left alone.
+  Loading checks the hash anyway.
+*/
+
+#define BLOB_STORE_MIN	65536
+
+static char *blobstore_path(
+    context_t *context,
+    char const *dir,
+    unsigned char const hash[SHA256_SIZE],
+    int subdir)
+{
+    static char const hexdigit[16]="0123456789abcdef";
+    char name[2*SHA256_SIZE+1];
+    char *path;
+    int ix;
+
+    for (ix=0; ix<SHA256_SIZE; ix++) {
+        name[2*ix]=hexdigit[hash[ix]>>4];
+        name[2*ix+1]=hexdigit[hash[ix]&15];
+    }
+    name[2*SHA256_SIZE]=0;
+    if (subdir)
+        path=sqlite3_mprintf("%s/%.2s",dir,name);
+    else
+        path=sqlite3_mprintf("%s/%.2s/%s",dir,name,name+2);
+    if (!path)
+        context->status=SQLITE_NOMEM;
+    return path;
+}
+
+/*
+  A blob on its way into a blob store, in a temporary file in the store
+  directory until its hash is known.  The file is named after the
+  context, which is unique to the thread, and the process; one left over
+  from a crashed process that had the same ID is fair game.
+*/
+
+typedef struct blobstore_file_t {
+    char *tmp;
+    int fd;
+} blobstore_file_t;
+
+static int blobstore_begin(
+    context_t *context,
+    char const *dir,
+    blobstore_file_t *file)
+{
+    file->fd=-1;
+    file->tmp=sqlite3_mprintf(
+        "%s/tmp%ld.%p",dir,(long)getpid(),(void *)context);
+    if (!file->tmp) {
+        context->status=SQLITE_NOMEM;
+        return -1;
+    }
+    file->fd=open(file->tmp,O_WRONLY|O_CREAT|O_EXCL,0666);
+    if (file->fd<0 && errno==EEXIST && !unlink(file->tmp))
+        file->fd=open(file->tmp,O_WRONLY|O_CREAT|O_EXCL,0666);
+    if (file->fd<0) {
+        errf(
+            context,SQLITE_CANTOPEN,
+            "Blob store: %s: %s",file->tmp,strerror(errno));
+        sqlite3_free(file->tmp);
+        file->tmp=NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int blobstore_write(
+    context_t *context,
+    blobstore_file_t *file,
+    void const *data,
+    size_t size)
+{
+    unsigned char const *src=data;
+
+    while (size>0) {
+        ssize_t done;
+
+        done=write(file->fd,src,size);
+        if (done<0) {
+            if (errno==EINTR)
+                continue;
+            errf(
+                context,SQLITE_IOERR_WRITE,
+                "Blob store: %s: %s",file->tmp,strerror(errno));
+            return -1;
+        }
+        src+=done;
+        size-=done;
+    }
+    return 0;
+}
+
+/*
+  Give up on a file, if it is still there.
+*/
+
+static void blobstore_abort(
+    blobstore_file_t *file)
+{
+    if (file->fd>=0)
+        close(file->fd);
+    file->fd=-1;
+    if (file->tmp)
+        unlink(file->tmp);
+    sqlite3_free(file->tmp);
+    file->tmp=NULL;
+}
+
+/*
+  Rename a file that got size bytes with the given hash into place,
+  unless the store has that blob already.  The file is gone either way.
+*/
+
+static int blobstore_end(
+    context_t *context,
+    char const *dir,
+    blobstore_file_t *file,
+    unsigned char const hash[SHA256_SIZE],
+    size_t size)
+{
+    char *path=NULL;
+    char *sub=NULL;
+    struct stat st;
+    int status=-1;
+
+    path=blobstore_path(context,dir,hash,0);
+    sub=blobstore_path(context,dir,hash,1);
+    if (!path || !sub)
+        goto cleanup;
+    status=close(file->fd);
+    file->fd=-1;
+    if (status) {
+        errf(
+            context,SQLITE_IOERR_WRITE,
+            "Blob store: %s: %s",file->tmp,strerror(errno));
+        goto cleanup;
+    }
+    status=-1;
+    if (!stat(path,&st) && (sqlite3_uint64)st.st_size==size) {
+        status=0;
+        goto cleanup;
+    }
+    if (mkdir(sub,0777) && errno!=EEXIST) {
+        errf(
+            context,SQLITE_CANTOPEN,
+            "Blob store: %s: %s",sub,strerror(errno));
+        goto cleanup;
+    }
+    if (rename(file->tmp,path)) {
+        errf(
+            context,SQLITE_IOERR_WRITE,
+            "Blob store: %s: %s",path,strerror(errno));
+        goto cleanup;
+    }
+    sqlite3_free(file->tmp);
+    file->tmp=NULL;
+    status=0;
+
+cleanup:
+    blobstore_abort(file);
+    sqlite3_free(sub);
+    sqlite3_free(path);
+    return status;
+}
+
+/*
+  Make sure the blob store in dir has size bytes of data with the given
+  hash.
+*/
+
+static int blobstore_put(
+    context_t *context,
+    char const *dir,
+    void const *data,
+    size_t size,
+    unsigned char const hash[SHA256_SIZE])
+{
+    blobstore_file_t file;
+    char *path;
+    struct stat st;
+    int there;
+
+    path=blobstore_path(context,dir,hash,0);
+    if (!path)
+        return -1;
+    there=!stat(path,&st) && (sqlite3_uint64)st.st_size==size;
+    sqlite3_free(path);
+    if (there)
+        return 0;
+    if (blobstore_begin(context,dir,&file))
+        return -1;
+    if (blobstore_write(context,&file,data,size)) {
+        blobstore_abort(&file);
+        return -1;
+    }
+    return blobstore_end(context,dir,&file,hash,size);
+}
+
+/*
+  Read the blob with the given size and hash from the blob store in dir.
+  Returns a copy, with a spare byte, or NULL on errors.
+*/
+
+static void *blobstore_get(
+    context_t *context,
+    char const *dir,
+    unsigned char const hash[SHA256_SIZE],
+    size_t size)
+{
+    unsigned char check[SHA256_SIZE];
+    unsigned char *data=NULL;
+    char *path;
+    struct stat st;
+    size_t got;
+    int fd=-1;
+
+    path=blobstore_path(context,dir,hash,0);
+    if (!path)
+        return NULL;
+    fd=open(path,O_RDONLY);
+    if (fd<0 || fstat(fd,&st)) {
+        errf(
+            context,SQLITE_CANTOPEN,
+            "Blob store: %s: %s",path,strerror(errno));
+        goto cleanup;
+    }
+    if ((sqlite3_uint64)st.st_size!=size)
+        goto corrupt;
+    data=cmalloc(context,size+1);
+    if (!data)
+        goto cleanup;
+    for (got=0; got<size; ) {
+        ssize_t done;
+
+        done=read(fd,data+got,size-got);
+        if (done<0) {
+            if (errno==EINTR)
+                continue;
+            errf(
+                context,SQLITE_IOERR_READ,
+                "Blob store: %s: %s",path,strerror(errno));
+            goto cleanup;
+        }
+        if (!done)
+            goto corrupt;
+        got+=done;
+    }
+    sha256(data,size,check);
+    if (memcmp(check,hash,SHA256_SIZE))
+        goto corrupt;
+    close(fd);
+    sqlite3_free(path);
+    return data;
+
+corrupt:
+    errf(
+        context,SQLITE_CORRUPT,
+        "Blob store: %s doesn't match its name",path);
+
+cleanup:
+    if (fd>=0)
+        close(fd);
+    sqlite3_free(data);
+    sqlite3_free(path);
+    return NULL;
+}
@@ -0,0 +1,382 @@
+/*
+  Block compression for the compressed container (see format.txt).
+
+  The codecs are optional at build time; codec_check tells whether
+  one is available.  zpool_t is the store side: the caller fills raw
+  blocks, worker threads compress them, and the caller's thread emits
+  the finished blocks in order through a callback, so the output
+  itself is never touched by more than one thread.
+*/
+
+#define ZBLOCK_SIZE	1048576
+#define ZBLOCK_MAX	67108864
+
+static int codec_check(
+    context_t *context,
+    unsigned int codec)
+{
+    switch (codec) {
+#ifdef S3BD_ZSTD
+    case ZCODEC_ZSTD:
+        return 0;
+#endif
+#ifdef S3BD_LZ4
+    case ZCODEC_LZ4:
+        return 0;
+#endif
+    default:
+        errf(
+            context,SQLITE_ERROR,
+            "Unsupported compression codec %u",codec);
+        return -1;
+    }
+}
+
+static size_t codec_bound(
+    unsigned int codec,
+    size_t size)
+{
+    switch (codec) {
+#ifdef S3BD_ZSTD
+    case ZCODEC_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+#ifdef S3BD_LZ4
+    case ZCODEC_LZ4:
+        return LZ4_compressBound(size);
+#endif
+    default:
+        return size;
+    }
+}
+
+/*
+  Returns the compressed size, or 0 if compression failed or didn't help;
+  the block is then stored as is.
+*/
+
+static size_t codec_compress(
+    unsigned int codec,
+    int level,
+    void *dst,
+    size_t dstcap,
+    void const *src,
+    size_t size)
+{
+    size_t packed=0;
+
+    switch (codec) {
+#ifdef S3BD_ZSTD
+    case ZCODEC_ZSTD:
+        packed=ZSTD_compress(dst,dstcap,src,size,level);
+        if (ZSTD_isError(packed))
+            packed=0;
+        break;
+#endif
+#ifdef S3BD_LZ4
+    case ZCODEC_LZ4:
+        if (level>=LZ4HC_CLEVEL_MIN)
+            packed=LZ4_compress_HC(src,dst,size,dstcap,level);
+        else
+            packed=LZ4_compress_default(src,dst,size,dstcap);
+        break;
+#endif
+    default:
+        (void)level;
+        (void)dst;
+        (void)dstcap;
+        (void)src;
+        break;
+    }
+    return packed<size ? packed : 0;
+}
+
+static int codec_decompress(
+    context_t *context,
+    unsigned int codec,
+    void *dst,
+    size_t size,
+    void const *src,
+    size_t packed)
+{
+    int ok=0;
+
+    switch (codec) {
+#ifdef S3BD_ZSTD
+    case ZCODEC_ZSTD:
+        ok=ZSTD_decompress(dst,size,src,packed)==size;
+        break;
+#endif
+#ifdef S3BD_LZ4
+    case ZCODEC_LZ4:
+        ok=LZ4_decompress_safe(src,dst,packed,size)==(int)size;
+        break;
+#endif
+    default:
+        (void)dst;
+        (void)size;
+        (void)src;
+        (void)packed;
+        break;
+    }
+    if (!ok) {
+        errf(
+            context,SQLITE_CORRUPT,
+            "Corrupt compressed block");
+        return -1;
+    }
+    return 0;
+}
+
+#define ZSLOT_FREE	0
+#define ZSLOT_QUEUED	1
+#define ZSLOT_DONE	2
+
+typedef struct zslot_t {
+    unsigned char *raw;
+    size_t rawsize;
+    unsigned char *packed;
+    size_t packedsize;
+    int state;
+} zslot_t;
+
+typedef int (*zemit_cb)(
+    void *arg,
+    void const *data,
+    size_t size);
+
+typedef struct zpool_t {
+    unsigned int codec;
+    int level;
+    zemit_cb emit;
+    void *emitarg;
+    zslot_t *slots;
+    unsigned int slotcnt;
+    unsigned int threadcnt;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    sqlite3_uint64 filled;
+    sqlite3_uint64 taken;
+    sqlite3_uint64 emitted;
+    unsigned char stop;
+} zpool_t;
+
+/*
+  Turn a raw block into a block header and (maybe) compressed data.
+*/
+
+static void zslot_pack(
+    zpool_t *pool,
+    zslot_t *slot)
+{
+    size_t packed;
+
+    packed=codec_compress(
+        pool->codec,pool->level,
+        slot->packed+8,codec_bound(pool->codec,ZBLOCK_SIZE),
+        slot->raw,slot->rawsize);
+    if (!packed) {
+        memcpy(slot->packed+8,slot->raw,slot->rawsize);
+        packed=slot->rawsize;
+    }
+    put_u32(slot->packed,slot->rawsize);
+    put_u32(slot->packed+4,packed);
+    slot->packedsize=8+packed;
+}
+
+static void *zpool_worker(
+    void *arg)
+{
+    zpool_t *pool=arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        zslot_t *slot;
+
+        while (!pool->stop && pool->taken>=pool->filled)
+            pthread_cond_wait(&pool->changed,&pool->lock);
+        if (pool->stop)
+            break;
+        slot=&pool->slots[pool->taken++%pool->slotcnt];
+        pthread_mutex_unlock(&pool->lock);
+        zslot_pack(pool,slot);
+        pthread_mutex_lock(&pool->lock);
+        slot->state=ZSLOT_DONE;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+  Emit finished blocks in order; with wait set, keep going until
+  at most keep blocks are still outstanding.
+*/
+
+static int zpool_emit(
+    zpool_t *pool,
+    int wait,
+    sqlite3_uint64 keep)
+{
+    while (pool->filled-pool->emitted>keep) {
+        zslot_t *slot=&pool->slots[pool->emitted%pool->slotcnt];
+
+        if (pool->threadcnt) {
+            pthread_mutex_lock(&pool->lock);
+            if (slot->state!=ZSLOT_DONE && !wait) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            while (slot->state!=ZSLOT_DONE)
+                pthread_cond_wait(&pool->changed,&pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        if ((*pool->emit)(pool->emitarg,slot->packed,slot->packedsize))
+            return -1;
+        slot->state=ZSLOT_FREE;
+        pool->emitted++;
+    }
+    return 0;
+}
+
+static void zpool_close(
+    zpool_t *pool)
+{
+    unsigned int ix;
+
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop=1;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        for (ix=0; ix<pool->threadcnt; ix++)
+            pthread_join(pool->threads[ix],NULL);
+        sqlite3_free(pool->threads);
+    }
+    if (pool->slots) {
+        for (ix=0; ix<pool->slotcnt; ix++) {
+            sqlite3_free(pool->slots[ix].raw);
+            sqlite3_free(pool->slots[ix].packed);
+        }
+        sqlite3_free(pool->slots);
+    }
+    pthread_cond_destroy(&pool->changed);
+    pthread_mutex_destroy(&pool->lock);
+    sqlite3_free(pool);
+}
+
+/*
+  threads is the number of compression threads; with fewer than two,
+  blocks are compressed on the calling thread as they are submitted.
+*/
+
+static zpool_t *zpool_open(
+    context_t *context,
+    unsigned int codec,
+    int level,
+    unsigned int threads,
+    zemit_cb emit,
+    void *emitarg)
+{
+    zpool_t *pool;
+    unsigned int ix;
+
+    if (codec_check(context,codec))
+        return NULL;
+    pool=cmalloc(context,sizeof *pool);
+    if (!pool)
+        return NULL;
+    memset(pool,0,sizeof *pool);
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->changed,NULL);
+    pool->codec=codec;
+    pool->level=level;
+    pool->emit=emit;
+    pool->emitarg=emitarg;
+    pool->slotcnt=threads>1 ? 2*threads : 1;
+    pool->slots=cmalloc(context,pool->slotcnt*sizeof *pool->slots);
+    if (!pool->slots)
+        goto cleanup;
+    memset(pool->slots,0,pool->slotcnt*sizeof *pool->slots);
+    for (ix=0; ix<pool->slotcnt; ix++) {
+        zslot_t *slot=&pool->slots[ix];
+
+        slot->raw=cmalloc(context,ZBLOCK_SIZE);
+        slot->packed=cmalloc(context,8+codec_bound(codec,ZBLOCK_SIZE));
+        if (!slot->raw || !slot->packed)
+            goto cleanup;
+    }
+    if (threads>1) {
+        pool->threads=cmalloc(context,threads*sizeof *pool->threads);
+        if (!pool->threads)
+            goto cleanup;
+        for (ix=0; ix<threads; ix++) {
+            if (pthread_create(&pool->threads[ix],NULL,zpool_worker,pool)) {
+                errf(
+                    context,SQLITE_ERROR,
+                    "Failed to start compression thread");
+                goto cleanup;
+            }
+            pool->threadcnt++;
+        }
+    }
+    return pool;
+
+cleanup:
+    zpool_close(pool);
+    return NULL;
+}
+
+/*
+  Get the raw block to fill next; its size is ZBLOCK_SIZE.
+*/
+
+static unsigned char *zpool_buf(
+    zpool_t *pool)
+{
+    if (zpool_emit(pool,1,pool->slotcnt-1))
+        return NULL;
+    return pool->slots[pool->filled%pool->slotcnt].raw;
+}
+
+/*
+  Submit the first size bytes of the block last returned by zpool_buf.
+*/
+
+static int zpool_put(
+    zpool_t *pool,
+    size_t size)
+{
+    zslot_t *slot=&pool->slots[pool->filled%pool->slotcnt];
+
+    if (!size)
+        return 0;
+    slot->rawsize=size;
+    if (pool->threadcnt) {
+        pthread_mutex_lock(&pool->lock);
+        slot->state=ZSLOT_QUEUED;
+        pool->filled++;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        zslot_pack(pool,slot);
+        slot->state=ZSLOT_DONE;
+        pool->filled++;
+    }
+    return zpool_emit(pool,0,0);
+}
+
+/*
+  Emit everything that's left, followed by the end marker.
+*/
+
+static int zpool_finish(
+    zpool_t *pool)
+{
+    static unsigned char const end[8];
+
+    if (zpool_emit(pool,1,0))
+        return -1;
+    return (*pool->emit)(pool->emitarg,end,sizeof end);
+}
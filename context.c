@@ -43,13 +43,29 @@ static void errf(
     va_end(args);
 }
 
+/*
+  Hand the error status and message of a finished helper context over
+  to another one, unless that one has already failed on its own.
+*/
+
+static void move_error(
+    context_t *context,
+    context_t *from)
+{
+    if (context->status==SQLITE_OK) {
+        context->status=from->status;
+        context->errmsg=from->errmsg;
+        from->errmsg=NULL;
+    }
+}
+
 static void *cmalloc(
     context_t *context,
     size_t size)
 {
     void *data;
 
-    data=sqlite3_malloc(size);
+    data=sqlite3_malloc64(size);
     if (size>0 && !data)
         context->status=SQLITE_NOMEM;
     return data;
@@ -60,12 +76,88 @@ static void *crealloc(
     void *data,
     size_t size)
 {
-    data=sqlite3_realloc(data,size);
+    data=sqlite3_realloc64(data,size);
     if (size>0 && !data)
         context->status=SQLITE_NOMEM;
     return data;
 }
 
+/*
+  A memory budget (see mem_budget in s3bd.h) caps the SQLite heap,
+  which this library allocates from too, for the duration of a call:
+  allocations past it fail with SQLITE_NOMEM, and SQLite starts giving
+  back cache memory at three quarters of it.  The process-wide limits
+  that were in place before are put back at the end.  Since the limits
+  are shared, only one call at a time may have a budget.
+*/
+
+typedef struct budget_t {
+    sqlite3_uint64 bytes;
+    sqlite3_int64 soft;
+    sqlite3_int64 hard;
+} budget_t;
+
+static pthread_mutex_t budget_lock=PTHREAD_MUTEX_INITIALIZER;
+static int budget_active;
+
+static int budget_begin(
+    context_t *context,
+    budget_t *budget,
+    sqlite3_uint64 bytes)
+{
+    budget->bytes=0;
+    if (!bytes)
+        return 0;
+    pthread_mutex_lock(&budget_lock);
+    if (budget_active) {
+        pthread_mutex_unlock(&budget_lock);
+        errf(
+            context,SQLITE_MISUSE,
+            "Another call with a memory budget is in progress");
+        return -1;
+    }
+    budget_active=1;
+    pthread_mutex_unlock(&budget_lock);
+    budget->bytes=bytes;
+    budget->hard=sqlite3_hard_heap_limit64(-1);
+    budget->soft=sqlite3_soft_heap_limit64(-1);
+    sqlite3_hard_heap_limit64(bytes);
+    sqlite3_soft_heap_limit64(bytes/4*3);
+    return 0;
+}
+
+/*
+  Put the old limits back, and say what ran out if something did.
+*/
+
+static void budget_end(
+    context_t *context,
+    budget_t *budget)
+{
+    sqlite3_uint64 bytes=budget->bytes;
+    char *errmsg;
+
+    if (!bytes)
+        return;
+    sqlite3_hard_heap_limit64(budget->hard);
+    sqlite3_soft_heap_limit64(budget->soft);
+    budget->bytes=0;
+    pthread_mutex_lock(&budget_lock);
+    budget_active=0;
+    pthread_mutex_unlock(&budget_lock);
+    if (context->status!=SQLITE_NOMEM)
+        return;
+    errmsg=sqlite3_mprintf(
+        "%s (memory budget of %llu bytes)",
+        context->errmsg
+            ? context->errmsg : sqlite3_errstr(SQLITE_NOMEM),
+        (unsigned long long)bytes);
+    if (errmsg) {
+        sqlite3_free(context->errmsg);
+        context->errmsg=errmsg;
+    }
+}
+
 static char const pragma_override_sql[] =
     "update temp.pragmas "
     "  set value=?2 "
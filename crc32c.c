@@ -0,0 +1,128 @@
+/*
+  CRC-32C (Castagnoli), which guards the blocks of a rowset.
+
+  Uses the crc32 instruction where the CPU has one (SSE 4.2 on x86-64,
+  checked at run time; the CRC extension on AArch64, if the compiler
+  was told it's there) and slicing-by-8 tables otherwise.
+*/
+
+#define CRC32C_POLY	0x82F63B78u
+
+static unsigned int crc32c_table[8][256];
+
+static pthread_once_t crc32c_once=PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void)
+{
+    unsigned int n,k,crc;
+
+    for (n=0; n<256; n++) {
+        crc=n;
+        for (k=0; k<8; k++)
+            crc=crc&1 ? crc>>1^CRC32C_POLY : crc>>1;
+        crc32c_table[0][n]=crc;
+    }
+    for (n=0; n<256; n++) {
+        crc=crc32c_table[0][n];
+        for (k=1; k<8; k++) {
+            crc=crc32c_table[0][crc&0xFF]^crc>>8;
+            crc32c_table[k][n]=crc;
+        }
+    }
+}
+
+static unsigned int crc32c_sw(
+    unsigned int crc,
+    unsigned char const *data,
+    size_t size)
+{
+    pthread_once(&crc32c_once,crc32c_init_table);
+    for (; size>0 && ((size_t)data&7); size--)
+        crc=crc32c_table[0][(crc^*data++)&0xFF]^crc>>8;
+    for (; size>=8; size-=8, data+=8) {
+        unsigned int lo,hi;
+
+        lo=crc^(data[0] | data[1]<<8 | data[2]<<16 | (unsigned int)data[3]<<24);
+        hi=data[4] | data[5]<<8 | data[6]<<16 | (unsigned int)data[7]<<24;
+        crc=crc32c_table[7][lo&0xFF]
+            ^crc32c_table[6][lo>>8&0xFF]
+            ^crc32c_table[5][lo>>16&0xFF]
+            ^crc32c_table[4][lo>>24]
+            ^crc32c_table[3][hi&0xFF]
+            ^crc32c_table[2][hi>>8&0xFF]
+            ^crc32c_table[1][hi>>16&0xFF]
+            ^crc32c_table[0][hi>>24];
+    }
+    for (; size>0; size--)
+        crc=crc32c_table[0][(crc^*data++)&0xFF]^crc>>8;
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(
+    unsigned int crc,
+    unsigned char const *data,
+    size_t size)
+{
+    unsigned long long crc64;
+
+    for (; size>0 && ((size_t)data&7); size--)
+        crc=__builtin_ia32_crc32qi(crc,*data++);
+    crc64=crc;
+    for (; size>=8; size-=8, data+=8) {
+        unsigned long long word;
+
+        memcpy(&word,data,8);
+        crc64=__builtin_ia32_crc32di(crc64,word);
+    }
+    crc=crc64;
+    for (; size>0; size--)
+        crc=__builtin_ia32_crc32qi(crc,*data++);
+    return crc;
+}
+
+#define crc32c_have_hw()	__builtin_cpu_supports("sse4.2")
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static unsigned int crc32c_hw(
+    unsigned int crc,
+    unsigned char const *data,
+    size_t size)
+{
+    for (; size>0 && ((size_t)data&7); size--)
+        crc=__crc32cb(crc,*data++);
+    for (; size>=8; size-=8, data+=8) {
+        unsigned long long word;
+
+        memcpy(&word,data,8);
+        crc=__crc32cd(crc,word);
+    }
+    for (; size>0; size--)
+        crc=__crc32cb(crc,*data++);
+    return crc;
+}
+
+#define crc32c_have_hw()	1
+
+#else
+
+#define crc32c_hw	crc32c_sw
+#define crc32c_have_hw()	0
+
+#endif
+
+static unsigned int crc32c(
+    void const *data,
+    size_t size)
+{
+    unsigned int crc=0xFFFFFFFFu;
+
+    if (crc32c_have_hw())
+        crc=crc32c_hw(crc,data,size);
+    else
+        crc=crc32c_sw(crc,data,size);
+    return crc^0xFFFFFFFFu;
+}
@@ -30,6 +30,50 @@ static int endian_double(void)
     return 0;
 }
 
+/*
+  The IEEE 754 bit pattern of a double as an integer and back,
+  for endian as found by endian_double.  NaN payloads survive.
+*/
+
+static sqlite3_uint64 double_bits(
+    double f,
+    int endian)
+{
+    unsigned char c[sizeof (double)];
+    sqlite3_uint64 u=0;
+    int ix;
+
+    memcpy(c,&f,sizeof c);
+    for (ix=0; ix<8; ix++) {
+        u=u<<8 | c[endian==2 ? ix : 7-ix];
+    }
+    return u;
+}
+
+static double bits_double(
+    sqlite3_uint64 u,
+    int endian)
+{
+    unsigned char c[sizeof (double)];
+    double f;
+    int ix;
+
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    if (endian==1) {
+#else
+    if (endian==2) {
+#endif
+        memcpy(&f,&u,sizeof f);
+        return f;
+    }
+    for (ix=7; ix>=0; ix--) {
+        c[endian==2 ? ix : 7-ix]=u;
+        u>>=8;
+    }
+    memcpy(&f,c,sizeof c);
+    return f;
+}
+
 static unsigned char const big_short[sizeof (unsigned short)] =
 {
     0x36, 0x9C
@@ -55,3 +99,121 @@ static int endian_short(void)
     return 0;
 }
 
+
+/*
+  Fixed-width big-endian fields of block headers and such.  The gets
+  are single unaligned loads on the hosts that matter.
+*/
+
+static void put_u32(
+    unsigned char *buf,
+    size_t u)
+{
+    buf[0]=u>>24;
+    buf[1]=u>>16;
+    buf[2]=u>>8;
+    buf[3]=u;
+}
+
+static unsigned int get_u16(
+    unsigned char const *buf)
+{
+    unsigned short u;
+
+    memcpy(&u,buf,2);
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    u=__builtin_bswap16(u);
+#endif
+    return u;
+}
+
+static size_t get_u32(
+    unsigned char const *buf)
+{
+    unsigned int u;
+
+    memcpy(&u,buf,4);
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    u=__builtin_bswap32(u);
+#endif
+    return u;
+}
+
+static void put_u64(
+    unsigned char *buf,
+    sqlite3_uint64 u)
+{
+    put_u32(buf,u>>32);
+    put_u32(buf+4,u&0xFFFFFFFF);
+}
+
+static sqlite3_uint64 get_u64(
+    unsigned char const *buf)
+{
+    sqlite3_uint64 u;
+
+    memcpy(&u,buf,8);
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    u=__builtin_bswap64(u);
+#endif
+    return u;
+}
+
+/*
+  A big-endian unsigned integer of width bytes (at most 8), put together
+  from as few loads as the width allows.
+*/
+
+static sqlite3_uint64 get_uw(
+    unsigned char const *buf,
+    unsigned int width)
+{
+    switch (width) {
+    case 0:
+        return 0;
+    case 1:
+        return buf[0];
+    case 2:
+        return get_u16(buf);
+    case 3:
+        return (sqlite3_uint64)get_u16(buf)<<8 | buf[2];
+    case 4:
+        return get_u32(buf);
+    case 5:
+        return (sqlite3_uint64)get_u32(buf)<<8 | buf[4];
+    case 6:
+        return (sqlite3_uint64)get_u32(buf)<<16 | get_u16(buf+4);
+    case 7:
+        return (sqlite3_uint64)get_u32(buf)<<24
+            | (sqlite3_uint64)get_u16(buf+4)<<8 | buf[6];
+    default:
+        return get_u64(buf);
+    }
+}
+
+/*
+  Little-endian words of packed bit fields.  These take the fast path
+  on the hosts that matter.
+*/
+
+static void put_u64le(
+    unsigned char *buf,
+    sqlite3_uint64 u)
+{
+#if __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+    u=__builtin_bswap64(u);
+#endif
+    memcpy(buf,&u,8);
+}
+
+static sqlite3_uint64 get_u64le(
+    unsigned char const *buf)
+{
+    sqlite3_uint64 u;
+
+    memcpy(&u,buf,8);
+#if __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+    u=__builtin_bswap64(u);
+#endif
+    return u;
+}
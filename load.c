@@ -1,4 +1,6 @@
 typedef struct load_context_t load_context_t;
+typedef struct load_pool_t load_pool_t;
+typedef struct textcol_t textcol_t;
 
 /*
   Factored-out differences between the UTF-8 and UTF-16 modes of operation.
@@ -37,24 +39,139 @@ typedef struct load_vt {
         str_t *str,
         void const *data,
         size_t size);
-    int (*read_text)(
-        load_context_t *context,
-        void *data,
-        size_t size);
     conststr_t pragmas_id;
     conststr_t schema_id;
     conststr_t sqlite_sequence_id;
     conststr_t sqlite_stat_id;
 } load_vt;
 
+typedef struct shared_t {
+    void const *data;
+    size_t size;
+    int owned;
+} shared_t;
+
+typedef struct stream_t {
+    sqlite3_int64 rowid;
+    size_t colix;
+    sqlite3_uint64 size;
+} stream_t;
+
+typedef struct arena_t {
+    unsigned char *buf;
+    size_t used;
+    size_t cap;
+    size_t want;
+    void **extra;
+    size_t extracnt;
+    size_t extracap;
+} arena_t;
+
 /*
   Extend the common context with load-specific parts.
+
+  Input is read into a large buffer with read(2) on the file descriptor
+  underneath infile (or with fread if there isn't one), or comes in
+  the read-ahead buffers of an io_uring ring.  With caller-supplied I/O,
+  its read callback fills the buffer instead.  When loading from memory,
+  the whole dump is the buffer, and text and blob values are bound
+  straight from it.  A dump file that is mapped into memory is read
+  the same way; map is then the mapping, and mapoff where in the file
+  the dump starts.  Pages up to mapdropped have been let go of, and
+  mapkeep bytes behind the reading position are kept.
+
+  A compressed container adds a second tier: what's read as described
+  above goes into the z* buffer, and the input buffer proper gets the
+  unpacked blocks.
+
+  The rows of a rowset block are decoded from the block payload, which
+  temporarily stands in for the input buffer once its checksum is known
+  to be good.  With decoders set, blocks are decoded on the threads
+  of pool instead, and with pipelined, the blocks of tables are read
+  on a thread of their own too (see parload.c).  Columnar blocks are
+  decoded whole, with integer sequences unpacked into ints first.
+
+  Streamed blobs wait in streams for their data (see load_stream).
+
+  With a memory budget, the connection's own cache settings are kept
+  in cache_size and cache_spill until they are put back.
+
+  Values inside a block are taken straight from its payload where they
+  can be; those that must be copied (see load_text_data) go in arena,
+  which is arenaown except on decoder threads.
+
+  How text is taken depends only on the encodings of the dump and the
+  host, so textmode settles it once for the whole load.
 */
 
 struct load_context_t {
     context_t c;
     FILE *infile;
+    int infd;
+    s3bd_load_io_t const *io;
+    unsigned char inmem;
+    void *map;
+    size_t mapsize;
+    off_t mapoff;
+    size_t mapdropped;
+    size_t mapkeep;
+    unsigned char *inbuf;
+    unsigned char *inown;
+    size_t inpos;
+    size_t infill;
+    size_t incap;
+    uring_t *ring;
+    unsigned int zcodec;
+    unsigned char zdone;
+    unsigned char *zbuf;
+    unsigned char *zown;
+    size_t zpos;
+    size_t zfill;
+    size_t zcap;
+    unsigned char *zblock;
+    size_t zblockcap;
+    unsigned char framed;
+    unsigned char inblock;
+    arena_t *arena;
+    arena_t arenaown;
+    unsigned char *outerbuf;
+    size_t outerpos;
+    size_t outerfill;
+    unsigned char *blockbuf;
+    size_t blockcap;
+    sqlite3_uint64 *ints;
+    size_t intcap;
+    textcol_t *dict;
+    size_t dictcnt;
+    symtab_t const *symtab;
+    symtab_t *symown;
+    unsigned char *types;
+    shared_t *shared;
+    sqlite3_uint64 sharedcnt;
+    sqlite3_uint64 sharedold;
+    sqlite3_uint64 sharedbase;
+    size_t sharedbytes;
+    void **sharedgone;
+    size_t sharedgonecnt;
+    size_t sharedgonecap;
+    char const *blobstore;
+    stream_t *streams;
+    size_t streamcnt;
+    size_t streamcap;
+    size_t streamnext;
+    sqlite3_uint64 streamdone;
+    sqlite3_blob *streamblob;
+    conststr_t streamset;
+    unsigned int decoders;
+    unsigned char pipelined;
+    load_pool_t *pool;
+    s3bd_load_stats_t stats;
+    budget_t budget;
+    sqlite3_int64 cache_size;
+    sqlite3_int64 cache_spill;
+    unsigned char cached;
     load_vt const *vt;
+    unsigned char textmode;
     sqlite3_stmt *store_pragma;
     sqlite3_stmt *count_pragmas;
     sqlite3_stmt *list_pragmas;
@@ -69,445 +186,2690 @@ struct load_context_t {
     unsigned char want_virtuals;
 };
 
-static int rc(
-    load_context_t *context)
+#define TEXTMODE_UTF8		0
+#define TEXTMODE_UTF16		1
+#define TEXTMODE_SWAPPED	2
+
+#define INBUF_SIZE	262144
+#define INBUF_MIN	4096
+
+/*
+  A bump allocator for the copies a block's values need, emptied
+  for each block.  What doesn't fit gets allocated on its own, and
+  the buffer is grown to the total at the next reset, so that once
+  it's big enough, decoding blocks allocates nothing at all.
+*/
+
+#define ARENA_MIN	4096
+
+static void *arena_alloc(
+    context_t *context,
+    arena_t *arena,
+    size_t size)
 {
-    int c;
+    void *data;
+
+    size=(size+7) & ~(size_t)7;
+    arena->want+=size;
+    if (size<=arena->cap-arena->used) {
+        data=arena->buf+arena->used;
+        arena->used+=size;
+        return data;
+    }
+    if (arena->extracnt>=arena->extracap) {
+        size_t cap=arena->extracap ? arena->extracap*2 : 16;
+        void **grown;
+
+        grown=crealloc(context,arena->extra,cap*sizeof *grown);
+        if (!grown)
+            return NULL;
+        arena->extra=grown;
+        arena->extracap=cap;
+    }
+    data=cmalloc(context,size);
+    if (!data)
+        return NULL;
+    arena->extra[arena->extracnt++]=data;
+    return data;
+}
 
-    c=getc(context->infile);
-    if (c==EOF) {
-        if (ferror(context->infile)) {
-            errf(
-                &context->c,SQLITE_IOERR_READ,
-                "Read error: %s",strerror(errno));
-        } else {
-            errf(
-                &context->c,SQLITE_IOERR_SHORT_READ,
-                "Unexpected EOF");
-        }
+static void arena_reset(
+    arena_t *arena)
+{
+    while (arena->extracnt>0)
+        sqlite3_free(arena->extra[--arena->extracnt]);
+    if (arena->want>arena->cap) {
+        size_t cap=arena->cap ? arena->cap : ARENA_MIN;
+
+        while (cap<arena->want)
+            cap*=2;
+        sqlite3_free(arena->buf);
+        arena->buf=sqlite3_malloc64(cap);
+        arena->cap=arena->buf ? cap : 0;
     }
-    return c;
+    arena->used=0;
+    arena->want=0;
 }
 
-static int rd(
+static void arena_free(
+    arena_t *arena)
+{
+    arena_reset(arena);
+    sqlite3_free(arena->buf);
+    sqlite3_free(arena->extra);
+    memset(arena,0,sizeof *arena);
+}
+
+static int in_alloc(
     load_context_t *context,
-    void *data,
     size_t size)
 {
-    if (size>0 && !fread(data,size,1,context->infile)) {
-        if (ferror(context->infile)) {
-            errf(
-                &context->c,SQLITE_IOERR_READ,
-                "Read error: %s",strerror(errno));
-        } else {
-            errf(
-                &context->c,SQLITE_IOERR_SHORT_READ,
-                "Unexpected EOF");
-        }
+    if (!size)
+        size=INBUF_SIZE;
+    else if (size<INBUF_MIN)
+        size=INBUF_MIN;
+    context->inown=cmalloc(&context->c,size);
+    if (!context->inown)
         return -1;
-    }
+    context->inbuf=context->inown;
+    context->incap=size;
+    context->inpos=0;
+    context->infill=0;
     return 0;
 }
 
-static int read_text16(
+/*
+  Start reading from infile.  A seekable file is read with read(2) in
+  large pieces, after stdio's buffer is dropped and the file position
+  moved back to match; what's read beyond the end of the dump is given
+  back by seeking.  Anything else is read through stdio, no more at
+  a time than is needed, so that what stdio has buffered is seen and
+  what follows the dump is left in the stream.
+*/
+
+static int in_attach(
     load_context_t *context,
-    void *data,
+    FILE *infile,
     size_t size)
 {
-    if (context->c.db_enc==context->c.native_enc) {
-        return rd(context,data,size);
-    } else {
-        FILE *infile=context->infile;
-        unsigned char *dst=data;
-
-        while (size>=2) {
-            int c0,c1;
-
-            if ((c0=getc(infile))==EOF
-                    || (c1=getc(infile))==EOF) {
-                if (ferror(infile)) {
-                    errf(
-                        &context->c,SQLITE_IOERR_READ,
-                        "Read error: %s",strerror(errno));
-                } else {
-                    errf(
-                        &context->c,SQLITE_IOERR_SHORT_READ,
-                        "Unexpected EOF");
-                }
-                return -1;
-            }
-            *dst++=c1;
-            *dst++=c0;
-            size-=2;
-        }
+    int fd=fileno(infile);
+
+    if (in_alloc(context,size))
+        return -1;
+    context->infile=infile;
+    context->infd=-1;
+    if (fd<0 || lseek(fd,0,SEEK_CUR)<0)
         return 0;
+    if (fflush(infile)) {
+        errf(
+            &context->c,SQLITE_IOERR_READ,
+            "Read error: %s",strerror(errno));
+        return -1;
     }
+    context->infd=fd;
+    return 0;
 }
 
-static unsigned char const sqlite_sequence_id8[15] =
-    "sqlite_sequence";
+static int in_attach_io(
+    load_context_t *context,
+    s3bd_load_io_t const *io,
+    size_t size)
+{
+    if (in_alloc(context,size))
+        return -1;
+    context->infile=NULL;
+    context->infd=-1;
+    context->io=io;
+    return 0;
+}
 
-static unsigned short const sqlite_sequence_id16[15] =
+static void in_attach_mem(
+    load_context_t *context,
+    void const *dump,
+    size_t size)
 {
-    's','q','l','i','t','e','_','s','e','q','u','e','n','c','e'
-};
+    context->inbuf=(unsigned char *)dump;
+    context->incap=size;
+    context->inpos=0;
+    context->infill=size;
+    context->infile=NULL;
+    context->infd=-1;
+    context->inmem=1;
+}
 
-static unsigned char const sqlite_stat_id8[11] =
-    "sqlite_stat";
+/*
+  Map infile into memory from its current position on and read it as
+  a memory dump, if it's a regular file.  The pages are only touched
+  front to back, so the kernel is told to read ahead eagerly, and
+  in_map_drop lets go of them again behind the decoder, keeping
+  MAP_KEEP bytes or an eighth of the memory budget.  If the file can't
+  be mapped, context->map stays NULL and it's read as usual.
+*/
 
-static unsigned short const sqlite_stat_id16[11] =
+#define MAP_KEEP	33554432
+
+static int in_map(
+    load_context_t *context,
+    FILE *infile)
 {
-    's','q','l','i','t','e','_','s','t','a','t'
-};
+    struct stat st;
+    off_t pos;
+    void *map;
+    int fd;
+
+    fd=fileno(infile);
+    if (fd<0 || fstat(fd,&st) || !S_ISREG(st.st_mode))
+        return 0;
+    if (fflush(infile)) {
+        errf(
+            &context->c,SQLITE_IOERR_READ,
+            "Read error: %s",strerror(errno));
+        return -1;
+    }
+    pos=lseek(fd,0,SEEK_CUR);
+    if (pos<0 || pos>=st.st_size
+            || (sqlite3_uint64)st.st_size>(size_t)-1)
+        return 0;
+    map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    if (map==MAP_FAILED)
+        return 0;
+    madvise(map,st.st_size,MADV_SEQUENTIAL);
+    posix_fadvise(fd,pos,0,POSIX_FADV_SEQUENTIAL);
+    in_attach_mem(context,(unsigned char *)map+pos,st.st_size-pos);
+    context->infd=fd;
+    context->map=map;
+    context->mapsize=st.st_size;
+    context->mapoff=pos;
+    context->mapkeep=MAP_KEEP;
+    if (context->budget.bytes && context->budget.bytes/8<MAP_KEEP)
+        context->mapkeep=context->budget.bytes/8;
+    return 0;
+}
 
+/*
+  Switch the input over to io_uring, if it's usable for the file.
+*/
 
-static load_vt const load_vt8 =
+static int in_uring(
+    load_context_t *context)
 {
-    prepare8,
-    column_text8,
-    str8app_7,
-    str8app_int,
-    str8app_float,
-    str8app_str,
-    str8app_id,
-    str8app_blob,
-    rd,
-    CONSTSTR(s3bd_id8_pragmas),
-    CONSTSTR(s3bd_id8_schema),
-    CONSTSTR(sqlite_sequence_id8),
-    CONSTSTR(sqlite_stat_id8)
-};
+    if (context->infd<0)
+        return 0;
+    return uring_open(&context->c,&context->ring,context->infd,0);
+}
 
-static load_vt const load_vt16 =
+/*
+  Stop reading.  Give back what was read beyond the end of the dump
+  if the file is seekable, so the caller can continue after it.
+*/
+
+static void in_block_restore(
+    load_context_t *context);
+
+static void in_detach(
+    load_context_t *context)
 {
-    prepare16,
-    column_text16,
-    str16app_7,
-    str16app_int,
-    str16app_float,
-    str16app_str,
-    str16app_id,
-    str16app_blob,
-    read_text16,
-    CONSTSTR(s3bd_id16_pragmas),
-    CONSTSTR(s3bd_id16_schema),
-    CONSTSTR(sqlite_sequence_id16),
-    CONSTSTR(sqlite_stat_id16)
-};
+    size_t pos,fill;
 
-static int load_uint(
+    if (context->inblock)
+        in_block_restore(context);
+    if (context->zcodec) {
+        pos=context->zpos;
+        fill=context->zfill;
+    } else {
+        pos=context->inpos;
+        fill=context->infill;
+    }
+    if (context->map) {
+        munmap(context->map,context->mapsize);
+        context->map=NULL;
+        lseek(context->infd,context->mapoff+pos,SEEK_SET);
+    } else if (context->ring) {
+        off_t tell=uring_tell(context->ring)+pos;
+
+        uring_close(context->ring);
+        context->ring=NULL;
+        lseek(context->infd,tell,SEEK_SET);
+    } else if (fill>pos && context->infd>=0 && !context->inmem) {
+        lseek(context->infd,-(off_t)(fill-pos),SEEK_CUR);
+    }
+    sqlite3_free(context->inown);
+    context->inown=NULL;
+    context->inbuf=NULL;
+    context->inpos=0;
+    context->infill=0;
+    sqlite3_free(context->zown);
+    context->zown=NULL;
+    sqlite3_free(context->zblock);
+    context->zblock=NULL;
+    sqlite3_free(context->blockbuf);
+    context->blockbuf=NULL;
+    context->blockcap=0;
+}
+
+/*
+  Get the next piece of raw input, of which want bytes are needed.
+  Reads go into room, except that an io_uring ring hands out its own
+  buffers.  Reads through stdio stop at want, the others may fill all
+  of cap.  *got is 0 at EOF.
+*/
+
+static int in_source(
     load_context_t *context,
-    unsigned int width,
-    sqlite3_uint64 *result)
+    unsigned char *room,
+    size_t cap,
+    size_t want,
+    unsigned char **data,
+    size_t *got)
 {
-    unsigned char buf[8];
-    sqlite3_uint64 u;
-    unsigned int ix;
+    *data=room;
+    *got=0;
+    if (context->inmem) {
+        return 0;
+    } else if (context->ring) {
+        if (uring_read(&context->c,context->ring,data,got))
+            return -1;
+    } else if (context->io) {
+        int status;
 
-    if (width>8) {
-        errf(
-            &context->c,SQLITE_INTERNAL,
-            "Internal error: integer width");
-        return -1;
+        status=(*context->io->read)(context->io->arg,room,cap,got);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "Read error: %s",sqlite3_errstr(status));
+            return -1;
+        }
+    } else if (context->infd>=0) {
+        ssize_t done;
+
+        do {
+            done=read(context->infd,room,cap);
+        } while (done<0 && errno==EINTR);
+        if (done<0) {
+            errf(
+                &context->c,SQLITE_IOERR_READ,
+                "Read error: %s",strerror(errno));
+            return -1;
+        }
+        *got=done;
+    } else {
+        *got=fread(room,1,want<cap ? want : cap,context->infile);
+        if (!*got && ferror(context->infile)) {
+            errf(
+                &context->c,SQLITE_IOERR_READ,
+                "Read error: %s",strerror(errno));
+            return -1;
+        }
     }
-    if (rd(context,buf,width))
+    return 0;
+}
+
+static int unexpected_eof(
+    load_context_t *context)
+{
+    errf(
+        &context->c,SQLITE_IOERR_SHORT_READ,
+        "Unexpected EOF");
+    return -1;
+}
+
+static int z_fill(
+    load_context_t *context,
+    size_t want)
+{
+    if (in_source(
+            context,context->zown,context->zcap,want,
+            &context->zbuf,&context->zfill))
         return -1;
-    u=0;
-    for (ix=0; ix<width; ix++) {
-        u=u<<8 | buf[ix];
-    }
-    *result=u+s3bd_uint_bias[width];
+    context->zpos=0;
+    if (!context->zfill)
+        return unexpected_eof(context);
     return 0;
 }
 
-static int load_sint(
+/*
+  Get the next size bytes of the raw input, in place if they happen
+  to be contiguous and otherwise copied together into zblock.
+*/
+
+static unsigned char const *z_take(
     load_context_t *context,
-    unsigned int width,
-    sqlite3_int64 *result)
+    size_t size)
 {
-    unsigned char buf[8];
-    sqlite3_uint64 u;
-    unsigned int ix,flip;
+    size_t have;
 
-    if (width>8) {
-        errf(
-            &context->c,SQLITE_INTERNAL,
-            "Internal error: integer width");
-        return -1;
-    }
-    if (rd(context,buf,width))
-        return -1;
-    if (width>0 && buf[0]&0x80) {
-        flip=0xFF;
-    } else {
-        flip=0x00;
+    if (context->zfill-context->zpos>=size) {
+        context->zpos+=size;
+        return context->zbuf+context->zpos-size;
     }
-    u=0;
-    for (ix=0; ix<width; ix++) {
-        u=u<<8 | (buf[ix]^flip);
+    if (context->zblockcap<size) {
+        sqlite3_free(context->zblock);
+        context->zblock=cmalloc(&context->c,size);
+        if (!context->zblock) {
+            context->zblockcap=0;
+            return NULL;
+        }
+        context->zblockcap=size;
     }
-    u+=s3bd_sint_bias[width];
-    if (flip) {
-        *result=-(sqlite3_int64)u;
-    } else {
-        *result=u;
+    have=0;
+    while (have<size) {
+        size_t chunk;
+
+        if (context->zpos>=context->zfill && z_fill(context,size-have))
+            return NULL;
+        chunk=context->zfill-context->zpos;
+        if (chunk>size-have)
+            chunk=size-have;
+        memcpy(context->zblock+have,context->zbuf+context->zpos,chunk);
+        context->zpos+=chunk;
+        have+=chunk;
     }
-    return 0;
+    return context->zblock;
 }
 
-static int load_float(
-    load_context_t *context,
-    unsigned int width,
-    double *result)
+/*
+  Unpack the next block of a compressed container.  Stored blocks
+  are used in place when possible.
+*/
+
+static int in_zfill(
+    load_context_t *context)
 {
-    unsigned char buf[8];
-    int ix,step,end;
-    unsigned int bix;
-    union {
-        double f;
-        unsigned char c[sizeof (double)];
-    } convert;
+    unsigned char const *head,*src;
+    size_t size,packed;
 
-    if (width>8) {
-        errf(
-            &context->c,SQLITE_INTERNAL,
-            "Internal error: float width");
+    if (context->zdone)
+        return unexpected_eof(context);
+    head=z_take(context,8);
+    if (!head)
         return -1;
+    size=get_u32(head);
+    packed=get_u32(head+4);
+    if (!size) {
+        context->zdone=1;
+        if (packed)
+            goto corrupt;
+        return unexpected_eof(context);
     }
-    if (rd(context,buf,width))
+    if (size>ZBLOCK_MAX || !packed || packed>size)
+        goto corrupt;
+    src=z_take(context,packed);
+    if (!src)
         return -1;
-    if (context->c.double_end==2) {
-        ix=0;
-        step=1;
-        end=8;
+    if (packed==size) {
+        context->inbuf=(unsigned char *)src;
     } else {
-        ix=7;
-        step=-1;
-        end=-1;
-    }
-    for (bix=0; bix<width; bix++) {
-        convert.c[ix]=buf[bix];
-        ix+=step;
-    }
-    while (ix!=end) {
-        convert.c[ix]=0;
-        ix+=step;
+        if (context->incap<size) {
+            sqlite3_free(context->inown);
+            context->inown=cmalloc(&context->c,size);
+            if (!context->inown) {
+                context->incap=0;
+                return -1;
+            }
+            context->incap=size;
+        }
+        if (codec_decompress(
+                &context->c,context->zcodec,context->inown,size,src,packed))
+            return -1;
+        context->inbuf=context->inown;
     }
-    *result=convert.f;
+    context->inpos=0;
+    context->infill=size;
     return 0;
+
+corrupt:
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Corrupt compressed block header");
+    return -1;
 }
 
-static int load_text(
-    load_context_t *context,
-    unsigned int width,
-    conststr_t *result)
+/*
+  Step over the end marker of a compressed container once the dump in
+  it is done, so that the input is left just after the container.
+*/
+
+static int in_zend(
+    load_context_t *context)
 {
-    sqlite3_uint64 size,u;
-    void *data=NULL;
+    unsigned char const *head;
 
-    if (width>8) {
+    if (!context->zcodec || context->zdone
+            || context->inpos<context->infill)
+        return 0;
+    head=z_take(context,8);
+    if (!head)
+        return -1;
+    if (get_u32(head) || get_u32(head+4)) {
         errf(
-            &context->c,SQLITE_INTERNAL,
-            "Internal error: text size width");
-        goto cleanup;
+            &context->c,SQLITE_CORRUPT,
+            "Missing end of compressed container");
+        return -1;
     }
-    if (load_uint(context,width,&u))
-        goto cleanup;
-    size=u;
-    data=cmalloc(&context->c,size+1);
-    if (!data)
-        goto cleanup;
-    if ((*context->vt->read_text)(context,data,size))
-        goto cleanup;
-    result->text=data;
-    result->size=size;
+    context->zdone=1;
     return 0;
+}
 
-cleanup:
-    if (data)
-        sqlite3_free(data);
-    return -1;
+static int in_fill(
+    load_context_t *context,
+    size_t want)
+{
+    if (context->inblock) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unexpected end of block");
+        return -1;
+    }
+    if (context->zcodec)
+        return in_zfill(context);
+    if (in_source(
+            context,context->inown,context->incap,want,
+            &context->inbuf,&context->infill))
+        return -1;
+    context->inpos=0;
+    if (!context->infill)
+        return unexpected_eof(context);
+    return 0;
 }
 
 /*
-  SQLite offers no way to creats an sqlite3_value from scratch,
-  so this will have to do instead.
+  Check for a compressed container and switch to unpacking it if so.
+  What has been read so far becomes the raw tier.
 */
 
-typedef struct intcol_t {
-    int type;
-    sqlite3_int64 val;
-} intcol_t;
+static int in_detect(
+    load_context_t *context)
+{
+    s3bd_zheader_t header;
+    size_t have;
+
+    if (context->inpos>=context->infill) {
+        if (in_source(
+                context,context->inown,context->incap,sizeof header,
+                &context->inbuf,&context->infill))
+            return -1;
+        context->inpos=0;
+    }
+    for (;;) {
+        size_t got;
+        unsigned char *data;
+
+        /* Short reads can only come from the plain file and I/O paths. */
+        have=context->infill-context->inpos;
+        if (have>=sizeof header || context->ring || context->inmem)
+            break;
+        memmove(context->inown,context->inbuf+context->inpos,have);
+        context->inpos=0;
+        context->infill=have;
+        if (in_source(
+                context,context->inown+have,context->incap-have,
+                sizeof header-have,&data,&got))
+            return -1;
+        if (!got)
+            break;
+        context->infill+=got;
+    }
+    if (have<sizeof header
+            || memcmp(
+                context->inbuf+context->inpos,
+                s3bd_zheader_magic,sizeof header.magic))
+        return 0;
+    memcpy(&header,context->inbuf+context->inpos,sizeof header);
+    if (header.ver_major!=ZCURVER_MAJOR || header.ver_minor>ZCURVER_MINOR) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unsupported compressed container version %u.%u",
+            header.ver_major,header.ver_minor);
+        return -1;
+    }
+    if (codec_check(&context->c,header.codec))
+        return -1;
+    context->zcodec=header.codec;
+    context->zbuf=context->inbuf;
+    context->zown=context->inown;
+    context->zpos=context->inpos+sizeof header;
+    context->zfill=context->infill;
+    context->zcap=context->incap;
+    context->inown=cmalloc(&context->c,ZBLOCK_SIZE);
+    if (!context->inown)
+        return -1;
+    context->inbuf=context->inown;
+    context->incap=ZBLOCK_SIZE;
+    context->inpos=0;
+    context->infill=0;
+    return 0;
+}
+
+static int rc(
+    load_context_t *context)
+{
+    if (context->inpos>=context->infill && in_fill(context,1))
+        return EOF;
+    return context->inbuf[context->inpos++];
+}
+
+static int rd(
+    load_context_t *context,
+    void *data,
+    size_t size)
+{
+    unsigned char *dst=data;
+
+    while (context->infill-context->inpos<size) {
+        size_t chunk=context->infill-context->inpos;
+
+        memcpy(dst,context->inbuf+context->inpos,chunk);
+        context->inpos+=chunk;
+        dst+=chunk;
+        size-=chunk;
+        if (in_fill(context,size))
+            return -1;
+    }
+    memcpy(dst,context->inbuf+context->inpos,size);
+    context->inpos+=size;
+    return 0;
+}
+
+/*
+  Let go of the pages of a mapped dump file that lie well behind the
+  reading position, so that they stop counting against the process.
+  They stay in the page cache, and values that still point there,
+  such as those of blocks on decoder threads, fault them back in.
+*/
+
+static void in_map_drop(
+    load_context_t *context)
+{
+    size_t pos,page,upto;
+
+    if (context->zcodec)
+        pos=context->zbuf+context->zpos-(unsigned char *)context->map;
+    else
+        pos=context->inbuf+context->inpos-(unsigned char *)context->map;
+    if (pos-context->mapdropped<2*context->mapkeep)
+        return;
+    page=sysconf(_SC_PAGESIZE);
+    upto=(pos-context->mapkeep)/page*page;
+    madvise(
+        (unsigned char *)context->map+context->mapdropped,
+        upto-context->mapdropped,MADV_DONTNEED);
+    context->mapdropped=upto;
+}
+
+/*
+  Get the next size bytes of input in one piece: in place if they're
+  all buffered already, and otherwise copied together into blockbuf.
+  Big pieces are read straight into blockbuf when the source allows it.
+*/
+
+static unsigned char const *in_fetch(
+    load_context_t *context,
+    size_t size)
+{
+    size_t have;
+
+    if (context->map && !context->inblock)
+        in_map_drop(context);
+    if (context->infill-context->inpos>=size) {
+        context->inpos+=size;
+        return context->inbuf+context->inpos-size;
+    }
+    if (context->inmem && !context->zcodec) {
+        unexpected_eof(context);
+        return NULL;
+    }
+    if (context->blockcap<size) {
+        sqlite3_free(context->blockbuf);
+        context->blockbuf=cmalloc(&context->c,size);
+        if (!context->blockbuf) {
+            context->blockcap=0;
+            return NULL;
+        }
+        context->blockcap=size;
+    }
+    have=context->infill-context->inpos;
+    memcpy(context->blockbuf,context->inbuf+context->inpos,have);
+    context->inpos=context->infill;
+    while (have<size) {
+        unsigned char *data;
+        size_t got;
+
+        if (context->ring || context->zcodec || size-have<context->incap) {
+            if (in_fill(context,size-have))
+                return NULL;
+            got=context->infill;
+            if (got>size-have)
+                got=size-have;
+            memcpy(context->blockbuf+have,context->inbuf,got);
+            context->inpos=got;
+        } else {
+            if (in_source(
+                    context,context->blockbuf+have,size-have,size-have,
+                    &data,&got))
+                return NULL;
+            if (!got) {
+                unexpected_eof(context);
+                return NULL;
+            }
+        }
+        have+=got;
+    }
+    return context->blockbuf;
+}
+
+/*
+  Read a block header and switch the input over to the block payload.
+*/
+
+static int in_block_enter(
+    load_context_t *context,
+    size_t *rows)
+{
+    unsigned char head[BLOCK_HEADER_SIZE];
+    unsigned char const *payload;
+    size_t size;
+
+    if (rd(context,head,sizeof head))
+        return -1;
+    size=get_u32(head);
+    *rows=get_u32(head+4);
+    payload=in_fetch(context,size);
+    if (!payload)
+        return -1;
+    if (crc32c(payload,size)!=get_u32(head+8)) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Block checksum mismatch");
+        return -1;
+    }
+    context->outerbuf=context->inbuf;
+    context->outerpos=context->inpos;
+    context->outerfill=context->infill;
+    context->inbuf=(unsigned char *)payload;
+    context->inpos=0;
+    context->infill=size;
+    context->inblock=1;
+    arena_reset(context->arena);
+    return 0;
+}
+
+static void in_block_restore(
+    load_context_t *context)
+{
+    context->inbuf=context->outerbuf;
+    context->inpos=context->outerpos;
+    context->infill=context->outerfill;
+    context->inblock=0;
+}
+
+/*
+  Switch back from a block payload, which must have been used up.
+*/
+
+static int in_block_leave(
+    load_context_t *context)
+{
+    int leftover=context->inpos<context->infill;
+
+    in_block_restore(context);
+    if (leftover) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unexpected input at end of block");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Whether values can be taken straight from the input buffer: in
+  a block, whose payload stays put until all of its rows are in,
+  or from a memory dump.
+*/
+
+static int in_stable(
+    load_context_t *context)
+{
+    return context->inblock || (context->inmem && !context->zcodec);
+}
+
+/*
+  Get a pointer to the next size bytes of a memory dump and skip them.
+*/
+
+static void const *in_take(
+    load_context_t *context,
+    size_t size)
+{
+    void const *data;
+
+    if (context->infill-context->inpos<size) {
+        context->inpos=context->infill;
+        errf(
+            &context->c,SQLITE_IOERR_SHORT_READ,
+            "Unexpected EOF");
+        return NULL;
+    }
+    data=context->inbuf+context->inpos;
+    context->inpos+=size;
+    return data;
+}
+
+/*
+  Put UTF-16 text read in the other byte order into native byte order.
+*/
+
+static void swap_text16(
+    void *data,
+    size_t size)
+{
+    unsigned char *p=data;
+
+    for (; size>=2; p+=2, size-=2) {
+        unsigned char c=p[0];
+
+        p[0]=p[1];
+        p[1]=c;
+    }
+}
+
+static unsigned char const sqlite_sequence_id8[15] =
+    "sqlite_sequence";
+
+static unsigned short const sqlite_sequence_id16[15] =
+{
+    's','q','l','i','t','e','_','s','e','q','u','e','n','c','e'
+};
+
+static unsigned char const sqlite_stat_id8[11] =
+    "sqlite_stat";
+
+static unsigned short const sqlite_stat_id16[11] =
+{
+    's','q','l','i','t','e','_','s','t','a','t'
+};
+
+
+static load_vt const load_vt8 =
+{
+    prepare8,
+    column_text8,
+    str8app_7,
+    str8app_int,
+    str8app_float,
+    str8app_str,
+    str8app_id,
+    str8app_blob,
+    CONSTSTR(s3bd_id8_pragmas),
+    CONSTSTR(s3bd_id8_schema),
+    CONSTSTR(sqlite_sequence_id8),
+    CONSTSTR(sqlite_stat_id8)
+};
+
+static load_vt const load_vt16 =
+{
+    prepare16,
+    column_text16,
+    str16app_7,
+    str16app_int,
+    str16app_float,
+    str16app_str,
+    str16app_id,
+    str16app_blob,
+    CONSTSTR(s3bd_id16_pragmas),
+    CONSTSTR(s3bd_id16_schema),
+    CONSTSTR(sqlite_sequence_id16),
+    CONSTSTR(sqlite_stat_id16)
+};
+
+/*
+  Values of width bytes (at most 8) at buf.  Integers are the field
+  plus the bias for its width, with the bits of negative ones flipped
+  first; floats are the leading bytes of the bit pattern.
+*/
+
+static sqlite3_uint64 decode_uint(
+    unsigned char const *buf,
+    unsigned int width)
+{
+    return get_uw(buf,width)+s3bd_uint_bias[width];
+}
+
+static sqlite3_int64 decode_sint(
+    unsigned char const *buf,
+    unsigned int width)
+{
+    sqlite3_uint64 u;
+
+    u=get_uw(buf,width);
+    if (width>0 && u>>(width*8-1)) {
+        u=(u^~(sqlite3_uint64)0>>(64-width*8))+s3bd_sint_bias[width];
+        return (sqlite3_int64)-u;
+    }
+    return u+s3bd_sint_bias[width];
+}
+
+static double decode_float(
+    load_context_t *context,
+    unsigned char const *buf,
+    unsigned int width)
+{
+    sqlite3_uint64 u;
+
+    u=width>0 ? get_uw(buf,width)<<(64-width*8) : 0;
+    return bits_double(u,context->c.double_end);
+}
+
+/*
+  Get the next width bytes (at most 8) of input for a field: in place
+  if they're buffered, as they nearly always are, and otherwise read
+  into buf.
+*/
+
+static unsigned char const *in_field(
+    load_context_t *context,
+    unsigned int width,
+    unsigned char *buf)
+{
+    if (width>8) {
+        errf(
+            &context->c,SQLITE_INTERNAL,
+            "Internal error: field width");
+        return NULL;
+    }
+    if (context->infill-context->inpos>=width) {
+        context->inpos+=width;
+        return context->inbuf+context->inpos-width;
+    }
+    if (rd(context,buf,width))
+        return NULL;
+    return buf;
+}
+
+static int load_uint(
+    load_context_t *context,
+    unsigned int width,
+    sqlite3_uint64 *result)
+{
+    unsigned char buf[8];
+    unsigned char const *field;
+
+    field=in_field(context,width,buf);
+    if (!field)
+        return -1;
+    *result=decode_uint(field,width);
+    return 0;
+}
+
+static int load_sint(
+    load_context_t *context,
+    unsigned int width,
+    sqlite3_int64 *result)
+{
+    unsigned char buf[8];
+    unsigned char const *field;
+
+    field=in_field(context,width,buf);
+    if (!field)
+        return -1;
+    *result=decode_sint(field,width);
+    return 0;
+}
+
+static int load_float(
+    load_context_t *context,
+    unsigned int width,
+    double *result)
+{
+    unsigned char buf[8];
+    unsigned char const *field;
+
+    field=in_field(context,width,buf);
+    if (!field)
+        return -1;
+    *result=decode_float(context,field,width);
+    return 0;
+}
+
+/*
+  A value can be no bigger than the rest of its block or, outside
+  blocks, than SQLite would take, so a bogus size fails before anything
+  gets allocated.  (Decoder threads only ever read blocks, and neither
+  they nor s3bd_read_toc have a connection.)
+*/
+
+static int value_size_check(
+    load_context_t *context,
+    sqlite3_uint64 size)
+{
+    if (context->inblock && size>context->infill-context->inpos) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Value overruns its block");
+        return -1;
+    }
+    if (!context->inblock && context->c.connection
+            && size>(sqlite3_uint64)sqlite3_limit(
+                context->c.connection,SQLITE_LIMIT_LENGTH,-1)) {
+        errf(
+            &context->c,SQLITE_TOOBIG,
+            "Value of %llu bytes is too big",
+            (unsigned long long)size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Text comes straight from the input buffer when it's usable as is,
+  that is, when the buffer is stable (stays put as long as the value
+  is needed, as a memory dump does) and the text needs no byte swapping
+  or realignment.  Otherwise it's a copy: in the arena inside a block,
+  and one that the caller must free outside; *owned tells which.
+*/
+
+static int load_text_data(
+    load_context_t *context,
+    sqlite3_uint64 size,
+    int stable,
+    conststr_t *result,
+    int *owned)
+{
+    void *data;
+
+    if (stable
+            && (context->textmode==TEXTMODE_UTF8
+                || (context->textmode==TEXTMODE_UTF16
+                    && !((size_t)(context->inbuf+context->inpos) & 1)))) {
+        result->text=in_take(context,size);
+        if (!result->text)
+            return -1;
+        result->size=size;
+        *owned=0;
+        return 0;
+    }
+    if (value_size_check(context,size))
+        return -1;
+    if (context->inblock) {
+        data=arena_alloc(&context->c,context->arena,size+1);
+        *owned=0;
+    } else {
+        data=cmalloc(&context->c,size+1);
+        *owned=1;
+    }
+    if (!data)
+        return -1;
+    if (rd(context,data,size)) {
+        if (*owned)
+            sqlite3_free(data);
+        return -1;
+    }
+    if (context->textmode==TEXTMODE_SWAPPED)
+        swap_text16(data,size);
+    result->text=data;
+    result->size=size;
+    return 0;
+}
+
+static int load_text(
+    load_context_t *context,
+    unsigned int width,
+    conststr_t *result,
+    int *owned)
+{
+    sqlite3_uint64 u;
+
+    if (load_uint(context,width,&u))
+        return -1;
+    return load_text_data(context,u,in_stable(context),result,owned);
+}
+
+/*
+  SQLite offers no way to creats an sqlite3_value from scratch,
+  so this will have to do instead.
+*/
+
+typedef struct intcol_t {
+    int type;
+    sqlite3_int64 val;
+} intcol_t;
 
 typedef struct floatcol_t {
     int type;
     double val;
 } floatcol_t;
 
-typedef struct textcol_t {
-    int type;
-    conststr_t text;
-} textcol_t;
+struct textcol_t {
+    int type;
+    conststr_t text;
+    int owned;
+};
+
+/*
+  A blob value may also be a shared blob, a reference to one without
+  data yet (see shared_row), or a streamed blob, whose data comes later
+  (see load_stream).
+*/
+
+#define BLOBCOL_SHARED	1
+#define BLOBCOL_REF	2
+#define BLOBCOL_STREAM	3
+
+typedef struct blobcol_t {
+    int type;
+    void const *data;
+    size_t size;
+    int owned;
+    int shared;
+    sqlite3_int64 ref;
+} blobcol_t;
+
+typedef union col_t {
+    int type;
+    intcol_t intcol;
+    floatcol_t floatcol;
+    textcol_t textcol;
+    blobcol_t blobcol;
+} col_t;
+
+static void col_free(
+    col_t *col)
+{
+    switch (col->type) {
+    case SQLITE_TEXT:
+        if (col->textcol.owned)
+            sqlite3_free((void *)col->textcol.text.text);
+        break;
+    case SQLITE_BLOB:
+        if (col->blobcol.owned)
+            sqlite3_free((void *)col->blobcol.data);
+        break;
+    }
+    col->type=SQLITE_NULL;
+}
+
+static int bind_col(
+    load_context_t *context,
+    sqlite3_stmt *stmt,
+    int colix,
+    col_t const *col)
+{
+    int status;
+
+    switch (col->type) {
+    case SQLITE_NULL:
+        status=sqlite3_bind_null(stmt,colix);
+        break;
+    case SQLITE_INTEGER:
+        status=sqlite3_bind_int64(stmt,colix,col->intcol.val);
+        break;
+    case SQLITE_FLOAT:
+        status=sqlite3_bind_double(stmt,colix,col->floatcol.val);
+        break;
+    case SQLITE_TEXT:
+        status=sqlite3_bind_text64(
+            stmt,
+            colix,
+            col->textcol.text.text,col->textcol.text.size,
+            SQLITE_STATIC,
+            context->c.native_enc);
+        break;
+    case SQLITE_BLOB:
+        if (col->blobcol.shared==BLOBCOL_STREAM)
+            status=sqlite3_bind_zeroblob64(stmt,colix,col->blobcol.size);
+        else
+            status=sqlite3_bind_blob64(
+                stmt,
+                colix,
+                col->blobcol.data,col->blobcol.size,
+                SQLITE_STATIC);
+        break;
+    default:
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unknown column data type %d",col->type);
+        return -1;
+    }
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "sqlite_bind: %s",
+            sqlite3_errmsg(context->c.connection));
+        return -1;
+    }
+    return 0;
+}
+
+static int load_intcol(
+    load_context_t *context,
+    int marker,
+    intcol_t *col)
+{
+    if (load_sint(context,INTCOL_iw(marker),&col->val))
+        goto cleanup;
+    col->type=SQLITE_INTEGER;
+    return 0;
+
+cleanup:
+    col->type=SQLITE_NULL;
+    return -1;
+}
+
+static int load_floatcol(
+    load_context_t *context,
+    int marker,
+    floatcol_t *col)
+{
+    if (load_float(context,FLOATCOL_fw(marker),&col->val))
+        goto cleanup;
+    col->type=SQLITE_FLOAT;
+    return 0;
+
+cleanup:
+    col->type=SQLITE_NULL;
+    return -1;
+}
+
+static int load_textcol(
+    load_context_t *context,
+    int marker,
+    textcol_t *col)
+{
+    if (load_text(context,TEXTCOL_tsw(marker),&col->text,&col->owned))
+        goto cleanup;
+    col->type=SQLITE_TEXT;
+    return 0;
+
+cleanup:
+    col->type=SQLITE_NULL;
+    return -1;
+}
+
+static int load_blob_data(
+    load_context_t *context,
+    sqlite3_uint64 size,
+    int stable,
+    blobcol_t *col)
+{
+    void *data=NULL;
+
+    if (stable) {
+        col->data=in_take(context,size);
+        if (!col->data)
+            goto cleanup;
+        col->size=size;
+        col->owned=0;
+        col->shared=0;
+        col->type=SQLITE_BLOB;
+        return 0;
+    }
+    if (value_size_check(context,size))
+        goto cleanup;
+    data=cmalloc(&context->c,size+1);
+    if (!data)
+        goto cleanup;
+    if (rd(context,data,size))
+        goto cleanup;
+    col->data=data;
+    col->size=size;
+    col->owned=1;
+    col->shared=0;
+    col->type=SQLITE_BLOB;
+    return 0;
+
+cleanup:
+    if (data)
+        sqlite3_free(data);
+    col->type=SQLITE_NULL;
+    return -1;
+}
+
+static int load_blobcol(
+    load_context_t *context,
+    int marker,
+    blobcol_t *col)
+{
+    sqlite3_uint64 u;
+
+    if (load_uint(context,BLOBCOL_bsw(marker),&u)) {
+        col->type=SQLITE_NULL;
+        return -1;
+    }
+    return load_blob_data(context,u,in_stable(context),col);
+}
+
+/*
+  A blob from the blob store, given its size and, next in the input,
+  its hash.
+*/
+
+static int load_hash_data(
+    load_context_t *context,
+    sqlite3_uint64 size,
+    blobcol_t *col)
+{
+    unsigned char hash[SHA256_SIZE];
+    void *data;
+
+    if (!context->blobstore) {
+        errf(
+            &context->c,SQLITE_ERROR,
+            "Dump has blobs in a blob store, but none was given");
+        return -1;
+    }
+    if (rd(context,hash,sizeof hash))
+        return -1;
+    data=blobstore_get(&context->c,context->blobstore,hash,size);
+    if (!data)
+        return -1;
+    col->data=data;
+    col->size=size;
+    col->owned=1;
+    col->shared=0;
+    col->type=SQLITE_BLOB;
+    return 0;
+}
+
+static int load_hashcol(
+    load_context_t *context,
+    int marker,
+    blobcol_t *col)
+{
+    sqlite3_uint64 u;
+
+    if (load_uint(context,HASHCOL_bsw(marker),&u)
+            || load_hash_data(context,u,col)) {
+        col->type=SQLITE_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int load_streamcol(
+    load_context_t *context,
+    int marker,
+    blobcol_t *col)
+{
+    sqlite3_uint64 u;
+
+    if (load_uint(context,STREAMCOL_bsw(marker),&u)) {
+        col->type=SQLITE_NULL;
+        return -1;
+    }
+    col->data=NULL;
+    col->size=u;
+    col->owned=0;
+    col->shared=BLOBCOL_STREAM;
+    col->type=SQLITE_BLOB;
+    return 0;
+}
+
+/*
+  The dictionary of the current rowset.  Its entries stay put until the
+  rowset ends, so values refer to them instead of having copies, and
+  the table is never reallocated, so decoder threads can use the entries
+  they know about while more are added.
+*/
+
+static int load_dict(
+    load_context_t *context,
+    int marker)
+{
+    sqlite3_uint64 u;
+    int c;
+
+    if (load_uint(context,DICT_cw(marker),&u))
+        return -1;
+    if (u>=DICT_ENTRIES-context->dictcnt) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Dictionary too big");
+        return -1;
+    }
+    if (!context->dict) {
+        context->dict=cmalloc(
+            &context->c,DICT_ENTRIES*sizeof *context->dict);
+        if (!context->dict)
+            return -1;
+    }
+    for (u++; u>0; u--) {
+        c=rc(context);
+        if (c==EOF)
+            return -1;
+        if (!is_TEXTCOL(c)) {
+            errf(
+                &context->c,SQLITE_CORRUPT,
+                "Unexpected input");
+            return -1;
+        }
+        if (load_textcol(context,c,&context->dict[context->dictcnt]))
+            return -1;
+        context->dictcnt++;
+    }
+    return 0;
+}
+
+static void dict_clear(
+    load_context_t *context)
+{
+    size_t ix;
+
+    for (ix=0; ix<context->dictcnt; ix++) {
+        if (context->dict[ix].owned)
+            sqlite3_free((void *)context->dict[ix].text.text);
+    }
+    context->dictcnt=0;
+}
+
+static int dict_ref(
+    load_context_t *context,
+    sqlite3_uint64 u,
+    textcol_t *col)
+{
+    if (u>=context->dictcnt) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unknown dictionary entry");
+        return -1;
+    }
+    *col=context->dict[u];
+    col->owned=0;
+    return 0;
+}
+
+/*
+  The symbol table of the current rowset, if it has one.  It comes ahead
+  of the blocks that use it and stays put until the rowset ends, so
+  decoder threads can share it.
+*/
+
+static int load_symtab(
+    load_context_t *context)
+{
+    symtab_t *symtab;
+    unsigned char buf[8];
+    unsigned int code;
+    int c;
+
+    if (context->symtab) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Second symbol table in rowset");
+        return -1;
+    }
+    if (!context->symown) {
+        context->symown=cmalloc(&context->c,sizeof *context->symown);
+        if (!context->symown)
+            return -1;
+    }
+    symtab=context->symown;
+    c=rc(context);
+    if (c==EOF)
+        return -1;
+    if (c==0 || c>SYMTAB_SYMBOLS)
+        goto corrupt;
+    symtab->cnt=c;
+    for (code=0; code<symtab->cnt; code++) {
+        c=rc(context);
+        if (c==EOF)
+            return -1;
+        if (c==0 || c>8)
+            goto corrupt;
+        memset(buf,0,sizeof buf);
+        if (rd(context,buf,c))
+            return -1;
+        symtab->sym[code]=get_u64le(buf);
+        symtab->len[code]=c;
+    }
+    context->symtab=symtab;
+    return 0;
+
+corrupt:
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Corrupt symbol table");
+    return -1;
+}
+
+/*
+  The column types of the current rowset, if it declares them.  Like
+  the symbol table, they stay put until the rowset ends.
+*/
+
+static int load_types(
+    load_context_t *context,
+    int marker,
+    size_t colcnt)
+{
+    sqlite3_uint64 u;
+    size_t colix;
+
+    if (context->types) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Second column types record in rowset");
+        return -1;
+    }
+    if (load_uint(context,TYPES_cw(marker),&u))
+        return -1;
+    if (u!=colcnt-1) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Column types don't match the rowset");
+        return -1;
+    }
+    context->types=cmalloc(&context->c,colcnt);
+    if (!context->types)
+        return -1;
+    if (rd(context,context->types,colcnt))
+        return -1;
+    for (colix=0; colix<colcnt; colix++) {
+        if (context->types[colix]>SQLITE_BLOB) {
+            errf(
+                &context->c,SQLITE_CORRUPT,
+                "Unknown column type %d",context->types[colix]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+  Decode size bytes of text coded with the symbol table into a copy
+  in the arena.
+*/
+
+static int load_symbols_data(
+    load_context_t *context,
+    sqlite3_uint64 size,
+    textcol_t *col)
+{
+    unsigned char *data;
+    size_t used;
+
+    if (!context->symtab || !context->inblock) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Coded text without a symbol table");
+        return -1;
+    }
+    if (size/8>context->infill-context->inpos) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unexpected end of block");
+        return -1;
+    }
+    data=arena_alloc(&context->c,context->arena,size+8);
+    if (!data)
+        return -1;
+    used=symtab_decode(
+        context->symtab,context->inbuf+context->inpos,
+        context->infill-context->inpos,data,size);
+    if (used==(size_t)-1) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt coded text");
+        return -1;
+    }
+    context->inpos+=used;
+    if (context->textmode==TEXTMODE_SWAPPED)
+        swap_text16(data,size);
+    col->text.text=data;
+    col->text.size=size;
+    col->owned=0;
+    col->type=SQLITE_TEXT;
+    return 0;
+}
+
+static int load_symcol(
+    load_context_t *context,
+    int marker,
+    textcol_t *col)
+{
+    sqlite3_uint64 u;
+
+    if (load_uint(context,SYMCOL_csw(marker),&u)
+            || load_symbols_data(context,u,col)) {
+        col->type=SQLITE_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Shared blobs (see SHARED BLOBS in format.txt).  Decoding only flags
+  the shared blobs and takes down the references; shared_row deals with
+  them as the rows are handed on, which is in dump order, the order the
+  numbering follows, so decoder threads never need to look at the ring
+  the shared blobs are kept in.  Blobs that values own are taken over,
+  those in a memory dump stay where they are, and others are copied.
+
+  A blob that falls out of the ring may still be bound for a column
+  that doesn't change in the rows after it, so it is only freed by
+  shared_flush once the block is done.
+*/
+
+static int load_sharecol(
+    load_context_t *context,
+    int marker,
+    blobcol_t *col)
+{
+    if (load_blobcol(context,marker,col))
+        return -1;
+    col->shared=BLOBCOL_SHARED;
+    return 0;
+}
+
+static int load_blobref(
+    load_context_t *context,
+    int marker,
+    blobcol_t *col)
+{
+    if (load_sint(context,BLOBREF_iw(marker),&col->ref)) {
+        col->type=SQLITE_NULL;
+        return -1;
+    }
+    col->data=NULL;
+    col->size=0;
+    col->owned=0;
+    col->shared=BLOBCOL_REF;
+    col->type=SQLITE_BLOB;
+    return 0;
+}
+
+static int shared_drop(
+    load_context_t *context)
+{
+    shared_t *entry=&context->shared[context->sharedold%SHARED_ENTRIES];
+
+    if (entry->owned) {
+        if (context->sharedgonecnt>=context->sharedgonecap) {
+            size_t cap=context->sharedgonecap ? 2*context->sharedgonecap : 64;
+            void **grown;
+
+            grown=crealloc(&context->c,context->sharedgone,cap*sizeof *grown);
+            if (!grown)
+                return -1;
+            context->sharedgone=grown;
+            context->sharedgonecap=cap;
+        }
+        context->sharedgone[context->sharedgonecnt++]=(void *)entry->data;
+    }
+    context->sharedbytes-=entry->size;
+    context->sharedold++;
+    return 0;
+}
+
+static void shared_flush(
+    load_context_t *context)
+{
+    size_t ix;
+
+    for (ix=0; ix<context->sharedgonecnt; ix++) {
+        sqlite3_free(context->sharedgone[ix]);
+    }
+    context->sharedgonecnt=0;
+}
+
+static void shared_clear(
+    load_context_t *context)
+{
+    shared_flush(context);
+    for (; context->sharedold<context->sharedcnt; context->sharedold++) {
+        shared_t *entry=&context->shared[context->sharedold%SHARED_ENTRIES];
+
+        if (entry->owned)
+            sqlite3_free((void *)entry->data);
+    }
+    sqlite3_free(context->shared);
+    context->shared=NULL;
+    sqlite3_free(context->sharedgone);
+    context->sharedgone=NULL;
+    context->sharedgonecap=0;
+    context->sharedbytes=0;
+}
 
-typedef struct blobcol_t {
-    int type;
-    void const *data;
+static int shared_add(
+    load_context_t *context,
+    blobcol_t *col)
+{
+    shared_t *entry;
+
+    if (col->size>SHARED_WINDOW) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Shared blob too big");
+        return -1;
+    }
+    if (!context->shared) {
+        context->shared=cmalloc(
+            &context->c,SHARED_ENTRIES*sizeof *context->shared);
+        if (!context->shared)
+            return -1;
+    }
+    while (context->sharedcnt-context->sharedold>=SHARED_ENTRIES
+            || context->sharedbytes+col->size>SHARED_WINDOW) {
+        if (shared_drop(context))
+            return -1;
+    }
+    entry=&context->shared[context->sharedcnt%SHARED_ENTRIES];
+    if (col->owned || (context->inmem && !context->zcodec)) {
+        entry->data=col->data;
+        entry->owned=col->owned;
+        col->owned=0;
+    } else {
+        void *copy=cmalloc(&context->c,col->size+1);
+
+        if (!copy)
+            return -1;
+        memcpy(copy,col->data,col->size);
+        entry->data=copy;
+        entry->owned=1;
+    }
+    entry->size=col->size;
+    context->sharedcnt++;
+    context->sharedbytes+=col->size;
+    return 0;
+}
+
+static int shared_ref(
+    load_context_t *context,
+    blobcol_t *col)
+{
+    sqlite3_uint64 num=context->sharedbase+(sqlite3_uint64)col->ref;
+    shared_t const *entry;
+
+    if (num<context->sharedold || num>=context->sharedcnt) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unknown shared blob");
+        return -1;
+    }
+    entry=&context->shared[num%SHARED_ENTRIES];
+    col->data=entry->data;
+    col->size=entry->size;
+    return 0;
+}
+
+/*
+  Add the shared blobs of a row and resolve its references, except
+  in values flagged in same, which are unchanged from the row before.
+*/
+
+static int shared_row(
+    load_context_t *context,
+    col_t *cols,
+    size_t colcnt,
+    unsigned char const *same)
+{
+    size_t colix;
+
+    for (colix=0; colix<colcnt; colix++) {
+        blobcol_t *col=&cols[colix].blobcol;
+
+        if (col->type!=SQLITE_BLOB || !col->shared
+                || col->shared==BLOBCOL_STREAM || (same && same[colix]))
+            continue;
+        if (col->shared==BLOBCOL_SHARED) {
+            if (shared_add(context,col))
+                return -1;
+        } else {
+            if (shared_ref(context,col))
+                return -1;
+        }
+        col->shared=0;
+    }
+    return 0;
+}
+
+/*
+  If same is not NULL, it flags the values that are unchanged from the
+  row passed to the callback before.
+*/
+
+typedef int (*row_cb)(
+    load_context_t *context,
+    size_t colcnt,
+    col_t const *values,
+    unsigned char const *same);
+
+typedef row_cb (*head_cb)(
+    load_context_t *context,
+    conststr_t setname,
+    size_t colcnt);
+
+/*
+  What each marker that starts a column is, so that load_col finds out
+  with one lookup instead of a range check after another.  A marker
+  is a single byte (see MARKER in format.txt); the ones left out here
+  start no column.
+*/
+
+#define COLMARK_NONE	0
+#define COLMARK_NULL	1
+#define COLMARK_INT	2
+#define COLMARK_FLOAT	3
+#define COLMARK_TEXT	4
+#define COLMARK_DICTREF	5
+#define COLMARK_SYM	6
+#define COLMARK_BLOB	7
+#define COLMARK_SHARE	8
+#define COLMARK_BLOBREF	9
+#define COLMARK_HASH	10
+#define COLMARK_STREAM	11
+
+#define COLMARK9(m)	m, m, m, m, m, m, m, m, m
+
+static unsigned char const colmarks[256] =
+{
+    COLMARK_NULL, 0, 0, 0, 0, 0, 0, 0, 0,
+    COLMARK9(COLMARK_DICTREF),
+    COLMARK9(COLMARK_NONE),
+    COLMARK9(COLMARK_SYM),
+    COLMARK9(COLMARK_SHARE),
+    COLMARK9(COLMARK_BLOBREF),
+    COLMARK9(COLMARK_HASH),
+    COLMARK9(COLMARK_NONE),
+    COLMARK9(COLMARK_STREAM),
+    COLMARK9(COLMARK_INT),
+    COLMARK9(COLMARK_FLOAT),
+    COLMARK9(COLMARK_TEXT),
+    COLMARK9(COLMARK_BLOB)
+};
+
+/*
+  Decode the column that starts with marker c into col, which is free.
+  Returns 1 if there was one, 0 if c is no column marker, and -1
+  on errors.
+*/
+
+static int load_col(
+    load_context_t *context,
+    int c,
+    col_t *col)
+{
+    sqlite3_uint64 u;
+
+    if (c==EOF)
+        return -1;
+    switch (colmarks[c]) {
+    case COLMARK_NULL:
+        col->type=SQLITE_NULL;
+        break;
+    case COLMARK_INT:
+        if (load_intcol(context,c,&col->intcol))
+            return -1;
+        break;
+    case COLMARK_FLOAT:
+        if (load_floatcol(context,c,&col->floatcol))
+            return -1;
+        break;
+    case COLMARK_TEXT:
+        if (load_textcol(context,c,&col->textcol))
+            return -1;
+        break;
+    case COLMARK_DICTREF:
+        if (load_uint(context,DICTREF_iw(c),&u)
+                || dict_ref(context,u,&col->textcol))
+            return -1;
+        break;
+    case COLMARK_SYM:
+        if (load_symcol(context,c,&col->textcol))
+            return -1;
+        break;
+    case COLMARK_BLOB:
+        if (load_blobcol(context,c,&col->blobcol))
+            return -1;
+        break;
+    case COLMARK_SHARE:
+        if (load_sharecol(context,c,&col->blobcol))
+            return -1;
+        break;
+    case COLMARK_BLOBREF:
+        if (load_blobref(context,c,&col->blobcol))
+            return -1;
+        break;
+    case COLMARK_HASH:
+        if (load_hashcol(context,c,&col->blobcol))
+            return -1;
+        break;
+    case COLMARK_STREAM:
+        if (!context->inblock)
+            return 0;
+        if (load_streamcol(context,c,&col->blobcol))
+            return -1;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+/*
+  Take over a value unchanged from the previous row (see load_row).
+*/
+
+static void same_col(
+    col_t *cols,
+    col_t const *prev,
+    size_t colix,
+    unsigned char *same)
+{
+    if (prev!=cols) {
+        cols[colix]=prev[colix];
+        if (cols[colix].type==SQLITE_TEXT)
+            cols[colix].textcol.owned=0;
+        else if (cols[colix].type==SQLITE_BLOB)
+            cols[colix].blobcol.owned=0;
+    }
+    if (same)
+        same[colix]=1;
+}
+
+/*
+  Decode a typed row (see COLUMN TYPES in format.txt), which is always
+  in a block, so the values of the columns' types are decoded in place
+  without going through rd, each type in its own branch.
+*/
+
+static int load_typed_row(
+    load_context_t *context,
+    col_t *cols,
+    col_t const *prev,
+    size_t colcnt,
+    unsigned char *same)
+{
+    unsigned char const *types=context->types;
+    unsigned char const *head;
+    unsigned char const *buf;
+    size_t colix;
+    unsigned int code;
+
+    head=in_take(context,(colcnt+1)/2);
+    if (!head)
+        return -1;
+    for (colix=0; colix<colcnt; colix++) {
+        col_t *col=&cols[colix];
+
+        if (same)
+            same[colix]=0;
+        code=head[colix>>1]>>(colix&1)*4 & 15;
+        if (code==TYPED_SAME && prev) {
+            same_col(cols,prev,colix,same);
+            continue;
+        }
+        col_free(col);
+        if (code<=8) {
+            buf=in_take(context,code);
+            if (!buf)
+                return -1;
+            switch (types[colix]) {
+            case SQLITE_INTEGER:
+                col->intcol.val=decode_sint(buf,code);
+                col->type=SQLITE_INTEGER;
+                break;
+            case SQLITE_FLOAT:
+                col->floatcol.val=decode_float(context,buf,code);
+                col->type=SQLITE_FLOAT;
+                break;
+            case SQLITE_TEXT:
+                if (load_text_data(
+                        context,decode_uint(buf,code),1,
+                        &col->textcol.text,&col->textcol.owned))
+                    return -1;
+                col->type=SQLITE_TEXT;
+                break;
+            case SQLITE_BLOB:
+                if (load_blob_data(
+                        context,decode_uint(buf,code),1,&col->blobcol))
+                    return -1;
+                break;
+            default:
+                goto corrupt;
+            }
+        } else if (code==TYPED_NULL) {
+            col->type=SQLITE_NULL;
+        } else if (code==TYPED_COLUMN) {
+            int got=load_col(context,rc(context),col);
+
+            if (got<0)
+                return -1;
+            if (!got)
+                goto corrupt;
+        } else {
+            goto corrupt;
+        }
+    }
+    return 1;
+
+corrupt:
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Unexpected input");
+    return -1;
+}
+
+/*
+  Decode one row into cols.  Returns 1 if there was a row, 0 if there
+  was some other marker where the row should have started instead
+  (its value is left in *marker), and -1 on errors.  The caller frees
+  the column values.
+
+  In a block, prev is the previous row of the block, if any, for SAMECOL
+  to refer to; it may be cols itself, whose values are then kept, and
+  which must not have been freed.  If same is not NULL, the values taken
+  over from prev are flagged there.
+*/
+
+static int load_row(
+    load_context_t *context,
+    col_t *cols,
+    col_t const *prev,
+    size_t colcnt,
+    unsigned char *same,
+    int *marker)
+{
+    unsigned char const *nullmap=NULL;
+    size_t colix;
+    int c,have,got;
+
+    if (context->types && context->inblock)
+        return load_typed_row(context,cols,prev,colcnt,same);
+    c=rc(context);
+    have=1;
+    if (is_NULLMAP(c) && context->inblock) {
+        nullmap=in_take(context,(colcnt+7)/8);
+        if (!nullmap)
+            return -1;
+        have=0;
+    }
+    for (colix=0; colix<colcnt; colix++) {
+        if (same)
+            same[colix]=0;
+        if (nullmap && (nullmap[colix>>3]>>(colix&7) & 1)) {
+            col_free(&cols[colix]);
+            continue;
+        }
+        if (!have)
+            c=rc(context);
+        have=0;
+        if (is_SAMECOL(c) && prev) {
+            same_col(cols,prev,colix,same);
+            continue;
+        }
+        col_free(&cols[colix]);
+        got=load_col(context,c,&cols[colix]);
+        if (got<0)
+            return -1;
+        if (!got) {
+            if (colix==0 && !nullmap) {
+                *marker=c;
+                return 0;
+            }
+            errf(
+                &context->c,SQLITE_CORRUPT,
+                "Unexpected input");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+  Columnar blocks (see COLUMNAR BLOCK in format.txt).  The whole block
+  is decoded into cols, rows times colcnt values in row order, before
+  any of it is used; text and blob values point into the payload,
+  which stays put until the block is done with.
+*/
+
+static int load_sized_sint(
+    load_context_t *context,
+    sqlite3_int64 *result)
+{
+    int c;
+
+    c=rc(context);
+    if (c==EOF)
+        return -1;
+    if (c>8) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt integer sequence");
+        return -1;
+    }
+    return load_sint(context,c,result);
+}
+
+/*
+  A reader of LSB-first bit fields from size bytes of data.
+  The caller checks that the bits are there.
+*/
+
+typedef struct bitin_t {
+    unsigned char const *data;
     size_t size;
-} blobcol_t;
+    size_t pos;
+} bitin_t;
+
+static sqlite3_uint64 bits_get(
+    bitin_t *in,
+    unsigned int bits)
+{
+    size_t pos=in->pos>>3;
+    unsigned int shift=in->pos&7;
+    sqlite3_uint64 u;
+
+    if (in->size-pos>=8) {
+        u=get_u64le(in->data+pos)>>shift;
+        if (shift+bits>64)
+            u|=(sqlite3_uint64)in->data[pos+8]<<(64-shift);
+    } else {
+        size_t k;
+
+        u=0;
+        for (k=0; pos+k<in->size; k++) {
+            u|=(sqlite3_uint64)in->data[pos+k]<<(8*k);
+        }
+        u>>=shift;
+    }
+    in->pos+=bits;
+    return bits<64 ? u&(((sqlite3_uint64)1<<bits)-1) : u;
+}
+
+/*
+  Unpack count values of bits bits each.
+*/
+
+static int load_packed(
+    load_context_t *context,
+    size_t count,
+    unsigned int bits,
+    sqlite3_uint64 *vals)
+{
+    bitin_t in;
+    size_t ix;
+
+    if (bits>64) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt integer sequence");
+        return -1;
+    }
+    in.size=(count*bits+7)/8;
+    in.data=in_take(context,in.size);
+    if (!in.data)
+        return -1;
+    if (!bits) {
+        memset(vals,0,count*sizeof *vals);
+        return 0;
+    }
+    in.pos=0;
+    for (ix=0; ix<count; ix++) {
+        vals[ix]=bits_get(&in,bits);
+    }
+    return 0;
+}
+
+/*
+  Decode an integer sequence of count values into context->ints.
+*/
+
+static int load_ints(
+    load_context_t *context,
+    size_t count)
+{
+    sqlite3_uint64 *vals;
+    sqlite3_int64 first,base;
+    size_t ix;
+    int c;
+
+    if (context->intcap<count) {
+        sqlite3_free(context->ints);
+        context->ints=cmalloc(&context->c,count*sizeof *context->ints);
+        if (!context->ints) {
+            context->intcap=0;
+            return -1;
+        }
+        context->intcap=count;
+    }
+    vals=context->ints;
+    c=rc(context);
+    switch (c) {
+    case INTSEQ_FOR:
+        if (load_sized_sint(context,&base))
+            return -1;
+        c=rc(context);
+        if (c==EOF || load_packed(context,count,c,vals))
+            return -1;
+        for (ix=0; ix<count; ix++) {
+            vals[ix]+=base;
+        }
+        return 0;
+    case INTSEQ_DELTA:
+        if (load_sized_sint(context,&first))
+            return -1;
+        if (load_sized_sint(context,&base))
+            return -1;
+        c=rc(context);
+        if (c==EOF || load_packed(context,count-1,c,vals+1))
+            return -1;
+        vals[0]=first;
+        for (ix=1; ix<count; ix++) {
+            vals[ix]+=vals[ix-1]+base;
+        }
+        return 0;
+    case EOF:
+        return -1;
+    }
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Unknown integer sequence encoding %d",c);
+    return -1;
+}
+
+/*
+  Undo store_floats.  The bit stream runs to the end of the payload
+  at most.
+*/
+
+static int load_floats(
+    load_context_t *context,
+    col_t *cols,
+    size_t stride,
+    size_t count)
+{
+    int endian=context->c.double_end;
+    sqlite3_uint64 u,xor;
+    unsigned int wlead=0,wlen=0;
+    size_t ix;
+    bitin_t in;
+
+    in.data=context->inbuf+context->inpos;
+    in.size=context->infill-context->inpos;
+    in.pos=0;
+    if (in.size<8)
+        goto eob;
+    u=bits_get(&in,64);
+    for (ix=0; ix<count; ix++) {
+        floatcol_t *col=&cols[ix*stride].floatcol;
+
+        if (ix>0) {
+            if (in.pos+1>in.size*8)
+                goto eob;
+            if (bits_get(&in,1)) {
+                if (in.pos+1>in.size*8)
+                    goto eob;
+                if (bits_get(&in,1)) {
+                    if (in.pos+12>in.size*8)
+                        goto eob;
+                    wlead=bits_get(&in,6);
+                    wlen=bits_get(&in,6)+1;
+                    if (wlead+wlen>64)
+                        goto corrupt;
+                } else if (!wlen) {
+                    goto corrupt;
+                }
+                if (in.pos+wlen>in.size*8)
+                    goto eob;
+                xor=bits_get(&in,wlen);
+                u^=xor<<(64-wlead-wlen);
+            }
+        }
+        col->type=SQLITE_FLOAT;
+        col->val=bits_double(u,endian);
+    }
+    return in_take(context,(in.pos+7)/8) ? 0 : -1;
+
+eob:
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Unexpected end of block");
+    return -1;
+
+corrupt:
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Corrupt float run");
+    return -1;
+}
+
+static int load_run(
+    load_context_t *context,
+    int marker,
+    col_t *cols,
+    size_t stride,
+    size_t count)
+{
+    sqlite3_uint64 *ints;
+    size_t ix;
+    int c;
+
+    if (is_NULLRUN(marker)) {
+        for (ix=0; ix<count; ix++) {
+            cols[ix*stride].type=SQLITE_NULL;
+        }
+        return 0;
+    }
+    if (is_INTRUN(marker)) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            intcol_t *col=&cols[ix*stride].intcol;
+
+            col->type=SQLITE_INTEGER;
+            col->val=ints[ix];
+        }
+        return 0;
+    }
+    c=rc(context);
+    if (c==EOF)
+        return -1;
+    if (is_FLOATRUN(marker) && c==FLOATRUN_XOR)
+        return load_floats(context,cols,stride,count);
+    if (is_FLOATRUN(marker) && c==FLOATRUN_PLAIN) {
+        for (ix=0; ix<count; ix++) {
+            floatcol_t *col=&cols[ix*stride].floatcol;
+
+            c=rc(context);
+            if (c==EOF)
+                return -1;
+            if (c>8) {
+                errf(
+                    &context->c,SQLITE_CORRUPT,
+                    "Corrupt float run");
+                return -1;
+            }
+            if (load_float(context,c,&col->val))
+                return -1;
+            col->type=SQLITE_FLOAT;
+        }
+        return 0;
+    }
+    if (is_TEXTRUN(marker) && c==TEXTRUN_DICT) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            if (dict_ref(context,ints[ix],&cols[ix*stride].textcol))
+                return -1;
+        }
+        return 0;
+    }
+    if (is_TEXTRUN(marker) && c==TEXTRUN_SYMBOLS) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            if (load_symbols_data(
+                    context,ints[ix],&cols[ix*stride].textcol))
+                return -1;
+        }
+        return 0;
+    }
+    if (is_BLOBRUN(marker) && c==BLOBRUN_HASH) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            if (load_hash_data(context,ints[ix],&cols[ix*stride].blobcol))
+                return -1;
+        }
+        return 0;
+    }
+    if (is_BLOBRUN(marker) && c==BLOBRUN_REF) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            blobcol_t *col=&cols[ix*stride].blobcol;
+
+            col->data=NULL;
+            col->size=0;
+            col->owned=0;
+            col->shared=BLOBCOL_REF;
+            col->ref=ints[ix];
+            col->type=SQLITE_BLOB;
+        }
+        return 0;
+    }
+    if ((is_TEXTRUN(marker) && c==TEXTRUN_PLAIN)
+            || (is_BLOBRUN(marker)
+                && (c==BLOBRUN_PLAIN || c==BLOBRUN_SHARED))) {
+        if (load_ints(context,count))
+            return -1;
+        ints=context->ints;
+        for (ix=0; ix<count; ix++) {
+            col_t *col=&cols[ix*stride];
+
+            if (ints[ix]>context->infill-context->inpos) {
+                errf(
+                    &context->c,SQLITE_CORRUPT,
+                    "Unexpected end of block");
+                return -1;
+            }
+            if (is_TEXTRUN(marker)) {
+                if (load_text_data(
+                        context,ints[ix],1,
+                        &col->textcol.text,&col->textcol.owned))
+                    return -1;
+                col->type=SQLITE_TEXT;
+            } else {
+                if (load_blob_data(context,ints[ix],1,&col->blobcol))
+                    return -1;
+                if (c==BLOBRUN_SHARED)
+                    col->blobcol.shared=BLOBCOL_SHARED;
+            }
+        }
+        return 0;
+    }
+    errf(
+        &context->c,SQLITE_CORRUPT,
+        "Unknown column run encoding %d",c);
+    return -1;
+}
 
-typedef union col_t {
-    int type;
-    intcol_t intcol;
-    floatcol_t floatcol;
-    textcol_t textcol;
-    blobcol_t blobcol;
-} col_t;
+/*
+  The caller has switched the input over to the block payload
+  and set all of cols to NULL, and frees the values afterwards.
+*/
 
-static void col_free(
-    col_t *col)
+static int load_colblock(
+    load_context_t *context,
+    col_t *cols,
+    size_t colcnt,
+    size_t rows)
 {
-    switch (col->type) {
-    case SQLITE_TEXT:
-        sqlite3_free((void *)col->textcol.text.text);
-        break;
-    case SQLITE_BLOB:
-        sqlite3_free((void *)col->blobcol.data);
-        break;
+    sqlite3_uint64 u;
+    size_t colix,rowix,count;
+    int c;
+
+    for (colix=0; colix<colcnt; colix++) {
+        for (rowix=0; rowix<rows; rowix+=count) {
+            c=rc(context);
+            if (c==EOF)
+                return -1;
+            if (!is_NULLRUN(c) && !is_INTRUN(c) && !is_FLOATRUN(c)
+                    && !is_TEXTRUN(c) && !is_BLOBRUN(c)) {
+                errf(
+                    &context->c,SQLITE_CORRUPT,
+                    "Unexpected input");
+                return -1;
+            }
+            if (load_uint(context,RUN_cw(c),&u))
+                return -1;
+            if (u>=rows-rowix) {
+                errf(
+                    &context->c,SQLITE_CORRUPT,
+                    "Column run overruns block");
+                return -1;
+            }
+            count=u+1;
+            if (load_run(context,c,cols+rowix*colcnt+colix,colcnt,count))
+                return -1;
+        }
     }
-    col->type=SQLITE_NULL;
+    return 0;
 }
 
-static int bind_col(
+/*
+  Check the row count of a columnar block and get room for its values.
+*/
+
+static col_t *colblock_cols(
     load_context_t *context,
-    sqlite3_stmt *stmt,
-    int colix,
-    col_t const *col)
+    col_t **cols,
+    size_t *cap,
+    size_t colcnt,
+    size_t rows)
 {
-    int status;
+    size_t ix;
 
-    switch (col->type) {
-    case SQLITE_NULL:
-        status=sqlite3_bind_null(stmt,colix);
-        break;
-    case SQLITE_INTEGER:
-        status=sqlite3_bind_int64(stmt,colix,col->intcol.val);
-        break;
-    case SQLITE_FLOAT:
-        status=sqlite3_bind_double(stmt,colix,col->floatcol.val);
-        break;
-    case SQLITE_TEXT:
-        status=sqlite3_bind_text64(
-            stmt,
-            colix,
-            col->textcol.text.text,col->textcol.text.size,
-            SQLITE_STATIC,
-            context->c.native_enc);
-        break;
-    case SQLITE_BLOB:
-        status=sqlite3_bind_blob64(
-            stmt,
-            colix,
-            col->blobcol.data,col->blobcol.size,
-            SQLITE_STATIC);
-        break;
-    default:
+    if (rows>COLBLOCK_VALUES/colcnt) {
         errf(
             &context->c,SQLITE_CORRUPT,
-            "Unknown column data type %d",col->type);
-        return -1;
+            "Columnar block too big");
+        return NULL;
     }
-    if (status!=SQLITE_OK) {
-        errf(
-            &context->c,status,
-            "sqlite_bind: %s",
-            sqlite3_errmsg(context->c.connection));
-        return -1;
+    if (*cap<rows*colcnt) {
+        sqlite3_free(*cols);
+        *cols=cmalloc(&context->c,rows*colcnt*sizeof **cols);
+        if (!*cols) {
+            *cap=0;
+            return NULL;
+        }
+        *cap=rows*colcnt;
     }
-    return 0;
+    for (ix=0; ix<rows*colcnt; ix++) {
+        (*cols)[ix].type=SQLITE_NULL;
+    }
+    return *cols;
 }
 
-static int load_intcol(
+/*
+  Decode a columnar block and hand its rows to dorow.
+*/
+
+static int load_colrows(
     load_context_t *context,
-    int marker,
-    intcol_t *col)
+    size_t colcnt,
+    size_t rows,
+    row_cb dorow,
+    col_t **cols,
+    size_t *cap)
 {
-    if (load_sint(context,INTCOL_iw(marker),&col->val))
-        goto cleanup;
-    col->type=SQLITE_INTEGER;
-    return 0;
+    col_t *group;
+    size_t ix;
+    int result;
 
-cleanup:
-    col->type=SQLITE_NULL;
-    return -1;
+    group=colblock_cols(context,cols,cap,colcnt,rows);
+    if (!group)
+        return -1;
+    result=load_colblock(context,group,colcnt,rows);
+    for (ix=0; !result && ix<rows; ix++) {
+        result=shared_row(context,group+ix*colcnt,colcnt,NULL);
+        if (!result)
+            result=(*dorow)(context,colcnt,group+ix*colcnt,NULL);
+    }
+    for (ix=0; ix<rows*colcnt; ix++) {
+        col_free(&group[ix]);
+    }
+    shared_flush(context);
+    return result;
 }
 
-static int load_floatcol(
+/*
+  Streamed blobs (see STREAMED BLOBS in format.txt).  A streamed value
+  goes into its row as a zeroblob of its size, and the rowid it got
+  is queued in streams along with the column, so that the chunks that
+  follow the block can be written into place with sqlite3_blob_write.
+  Rowsets that are ignored queue their streamed values too, but with
+  no streamset to write them to, which skips their chunks.
+*/
+
+static int stream_add(
     load_context_t *context,
-    int marker,
-    floatcol_t *col)
+    sqlite3_int64 rowid,
+    size_t colcnt,
+    col_t const *cols)
 {
-    if (load_float(context,FLOATCOL_fw(marker),&col->val))
-        goto cleanup;
-    col->type=SQLITE_FLOAT;
-    return 0;
+    size_t colix;
 
-cleanup:
-    col->type=SQLITE_NULL;
-    return -1;
+    for (colix=0; colix<colcnt; colix++) {
+        blobcol_t const *col=&cols[colix].blobcol;
+        stream_t *stream;
+
+        if (col->type!=SQLITE_BLOB || col->shared!=BLOBCOL_STREAM
+                || !col->size)
+            continue;
+        if (context->streamcnt>=context->streamcap) {
+            size_t cap=context->streamcap ? context->streamcap*2 : 16;
+            stream_t *grown;
+
+            grown=crealloc(&context->c,context->streams,cap*sizeof *grown);
+            if (!grown)
+                return -1;
+            context->streams=grown;
+            context->streamcap=cap;
+        }
+        stream=&context->streams[context->streamcnt++];
+        stream->rowid=rowid;
+        stream->colix=colix;
+        stream->size=col->size;
+    }
+    return 0;
 }
 
-static int load_textcol(
+static char const stream_names_sql[] =
+    "select ?1,name from pragma_table_info(?1) where cid=?2";
+
+/*
+  Open the blob that the next chunk goes into, looking up the UTF-8
+  names that sqlite3_blob_open wants.
+*/
+
+static int stream_blob_open(
     load_context_t *context,
-    int marker,
-    textcol_t *col)
+    stream_t const *stream)
 {
-    if (load_text(context,TEXTCOL_tsw(marker),&col->text))
+    sqlite3_stmt *names=NULL;
+    int status;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        stream_names_sql,sizeof stream_names_sql,
+        &names,
+        NULL);
+    if (status==SQLITE_OK)
+        status=sqlite3_bind_text64(
+            names,1,context->streamset.text,context->streamset.size,
+            SQLITE_STATIC,context->c.native_enc);
+    if (status==SQLITE_OK)
+        status=sqlite3_bind_int64(names,2,stream->colix);
+    if (status==SQLITE_OK)
+        status=sqlite3_step(names);
+    if (status==SQLITE_DONE) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Streamed value for a column not in the table");
         goto cleanup;
-    col->type=SQLITE_TEXT;
+    }
+    if (status==SQLITE_ROW)
+        status=sqlite3_blob_open(
+            context->c.connection,"main",
+            (char const *)sqlite3_column_text(names,0),
+            (char const *)sqlite3_column_text(names,1),
+            stream->rowid,1,&context->streamblob);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While storing tables: sqlite3_blob_open: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    sqlite3_finalize(names);
     return 0;
 
 cleanup:
-    col->type=SQLITE_NULL;
+    if (names)
+        sqlite3_finalize(names);
     return -1;
 }
 
-static int load_blobcol(
+/*
+  Read a stream record, whose marker is given, and write its chunk
+  into the streamed value it belongs to.
+*/
+
+static int load_stream(
     load_context_t *context,
-    int marker,
-    blobcol_t *col)
+    int marker)
 {
-    sqlite3_uint64 size,u;
-    void *data=NULL;
+    sqlite3_uint64 u;
+    unsigned char const *chunk;
+    stream_t const *stream;
+    int status;
 
-    if (load_uint(context,BLOBCOL_bsw(marker),&u))
-        goto cleanup;
-    size=u;
-    data=cmalloc(&context->c,size+1);
-    if (!data)
-        goto cleanup;
-    if (rd(context,data,size))
-        goto cleanup;
-    col->data=data;
-    col->size=size;
-    col->type=SQLITE_BLOB;
+    if (load_uint(context,STREAM_csw(marker),&u))
+        return -1;
+    if (!u || u>STREAM_CHUNK_MAX) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt stream record");
+        return -1;
+    }
+    chunk=in_fetch(context,u+4);
+    if (!chunk)
+        return -1;
+    if (crc32c(chunk,u)!=get_u32(chunk+u)) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Stream checksum mismatch");
+        return -1;
+    }
+    if (context->streamnext>=context->streamcnt
+            || u>context->streams[context->streamnext].size
+                -context->streamdone) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unexpected stream record");
+        return -1;
+    }
+    stream=&context->streams[context->streamnext];
+    if (context->streamset.text) {
+        if (!context->streamblob && stream_blob_open(context,stream))
+            return -1;
+        status=sqlite3_blob_write(
+            context->streamblob,chunk,u,context->streamdone);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While storing tables: sqlite3_blob_write: %s",
+                sqlite3_errmsg(context->c.connection));
+            return -1;
+        }
+    }
+    context->streamdone+=u;
+    if (context->streamdone<stream->size)
+        return 0;
+    if (context->streamblob) {
+        sqlite3_blob_close(context->streamblob);
+        context->streamblob=NULL;
+    }
+    context->streamdone=0;
+    if (++context->streamnext==context->streamcnt) {
+        context->streamnext=0;
+        context->streamcnt=0;
+    }
     return 0;
+}
 
-cleanup:
-    if (data)
-        sqlite3_free(data);
-    col->type=SQLITE_NULL;
-    return -1;
+static void stream_clear(
+    load_context_t *context)
+{
+    if (context->streamblob) {
+        sqlite3_blob_close(context->streamblob);
+        context->streamblob=NULL;
+    }
+    context->streamcnt=0;
+    context->streamnext=0;
+    context->streamdone=0;
+    context->streamset.text=NULL;
+    context->streamset.size=0;
 }
 
-typedef int (*row_cb)(
+/*
+  See parload.c.
+*/
+
+static int load_blocks_parallel(
     load_context_t *context,
     size_t colcnt,
-    col_t const *values);
+    row_cb dorow,
+    int *marker);
 
-typedef row_cb (*head_cb)(
-    load_context_t *context,
-    conststr_t setname,
-    size_t colcnt);
+static void load_pool_close(
+    load_context_t *context);
 
 static int load_rowset(
     load_context_t *context,
@@ -515,17 +2877,29 @@ static int load_rowset(
     head_cb dohead)
 {
     col_t *cols=NULL;
+    unsigned char *same=NULL;
+    col_t *groupcols=NULL;
+    size_t groupcap=0;
     row_cb dorow;
     conststr_t name;
+    int nameowned=0;
     sqlite3_uint64 u;
     size_t colcnt,colix;
-    int c;
+    size_t rows,rowix;
+    int c,got;
 
     name.text=NULL;
     if (load_uint(context,ROWSET_ccw(marker),&u))
         goto cleanup;
+    if (u>=(sqlite3_uint64)sqlite3_limit(
+            context->c.connection,SQLITE_LIMIT_COLUMN,-1)) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Too many columns");
+        goto cleanup;
+    }
     colcnt=u+1;
-    if (load_text(context,ROWSET_nsw(marker),&name))
+    if (load_text(context,ROWSET_nsw(marker),&name,&nameowned))
         goto cleanup;
     cols=cmalloc(&context->c,colcnt*sizeof (col_t));
     if (!cols)
@@ -533,64 +2907,129 @@ static int load_rowset(
     for (colix=0; colix<colcnt; colix++) {
         cols[colix].type=SQLITE_NULL;
     }
+    same=cmalloc(&context->c,colcnt);
+    if (!same)
+        goto cleanup;
+    context->sharedbase=context->sharedcnt;
     dorow=(*dohead)(context,name,colcnt);
     if (!dorow)
         goto cleanup;
-    for (;;) {
-        for (colix=0; colix<colcnt; colix++) {
+    if (context->framed && (context->decoders || context->pipelined)) {
+        if (load_blocks_parallel(context,colcnt,dorow,&c))
+            goto cleanup;
+    } else if (context->framed) {
+        for (;;) {
             c=rc(context);
-            if (is_NULLCOL(c)) {
-                cols[colix].type=SQLITE_NULL;
-            } else if (is_INTCOL(c)) {
-                if (load_intcol(context,c,&cols[colix].intcol))
+            if (c==EOF)
+                goto cleanup;
+            if (is_DICT(c)) {
+                if (load_dict(context,c))
                     goto cleanup;
-            } else if (is_FLOATCOL(c)) {
-                if (load_floatcol(context,c,&cols[colix].floatcol))
+                continue;
+            }
+            if (is_SYMTAB(c)) {
+                if (load_symtab(context))
                     goto cleanup;
-            } else if (is_TEXTCOL(c)) {
-                if (load_textcol(context,c,&cols[colix].textcol))
+                continue;
+            }
+            if (is_TYPES(c)) {
+                if (load_types(context,c,colcnt))
                     goto cleanup;
-            } else if (is_BLOBCOL(c)) {
-                if (load_blobcol(context,c,&cols[colix].blobcol))
+                continue;
+            }
+            if (is_STREAM(c)) {
+                if (load_stream(context,c))
                     goto cleanup;
-            } else if (c==EOF) {
+                continue;
+            }
+            if (!is_BLOCK(c) && !is_COLBLOCK(c))
+                break;
+            if (in_block_enter(context,&rows))
                 goto cleanup;
+            if (is_COLBLOCK(c)) {
+                if (load_colrows(
+                        context,colcnt,rows,dorow,&groupcols,&groupcap))
+                    goto cleanup;
             } else {
-                if (colix==0)
-                    goto no_more_rows;
-                errf(
-                    &context->c,SQLITE_CORRUPT,
-                    "Unexpected input");
-                goto cleanup;
+                for (rowix=0; rowix<rows; rowix++) {
+                    got=load_row(
+                        context,cols,rowix ? cols : NULL,colcnt,same,&c);
+                    if (got<=0) {
+                        if (!got)
+                            errf(
+                                &context->c,SQLITE_CORRUPT,
+                                "Unexpected input");
+                        goto cleanup;
+                    }
+                    if (shared_row(context,cols,colcnt,same)
+                            || (*dorow)(context,colcnt,cols,same))
+                        goto cleanup;
+                }
+                for (colix=0; colix<colcnt; colix++) {
+                    col_free(&cols[colix]);
+                }
+                shared_flush(context);
             }
+            if (in_block_leave(context))
+                goto cleanup;
         }
-        if ((*dorow)(context,colcnt,cols))
-            goto cleanup;
-        for (colix=0; colix<colcnt; colix++) {
-            col_free(&cols[colix]);
+    } else {
+        for (;;) {
+            got=load_row(context,cols,NULL,colcnt,NULL,&c);
+            if (got<0)
+                goto cleanup;
+            if (!got)
+                break;
+            if (shared_row(context,cols,colcnt,NULL)
+                    || (*dorow)(context,colcnt,cols,NULL))
+                goto cleanup;
+            for (colix=0; colix<colcnt; colix++) {
+                col_free(&cols[colix]);
+            }
+            shared_flush(context);
         }
     }
-no_more_rows:
     if (!is_ENDSET(c)) {
         errf(
             &context->c,SQLITE_CORRUPT,
             "Unexpected input");
         goto cleanup;
     }
+    if (context->streamcnt) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Missing stream records");
+        goto cleanup;
+    }
+    stream_clear(context);
     sqlite3_free(cols);
     cols=NULL;
-    sqlite3_free((void *)name.text);
+    sqlite3_free(same);
+    sqlite3_free(groupcols);
+    dict_clear(context);
+    context->symtab=NULL;
+    sqlite3_free(context->types);
+    context->types=NULL;
+    if (nameowned)
+        sqlite3_free((void *)name.text);
     name.text=NULL;
     return 0;
 
 cleanup:
+    stream_clear(context);
+    sqlite3_free(same);
+    sqlite3_free(groupcols);
+    dict_clear(context);
+    context->symtab=NULL;
+    sqlite3_free(context->types);
+    context->types=NULL;
     if (cols) {
         for (colix=0; colix<colcnt; colix++) {
             col_free(&cols[colix]);
         }
         sqlite3_free(cols);
     }
-    if (name.text)
+    if (name.text && nameowned)
         sqlite3_free((void *)name.text);
     return -1;
 }
@@ -601,36 +3040,37 @@ static char const encoding_sql_1[] =
 static char const foreign_keys_sql[] =
     "pragma foreign_keys=0";
 
-static int load_header(
-    load_context_t *context)
+/*
+  Check the dump file header and set up for its version and encoding.
+*/
+
+static int check_header(
+    load_context_t *context,
+    s3bd_header_t const *header)
 {
-    s3bd_header_t header;
     unsigned int encoding;
-    str_t sql;
-    char *errmsg=NULL;
-    int status;
 
-    str_init(&sql,&context->c);
-    if (rd(context,&header,sizeof header))
-        goto cleanup;
-    if (memcmp(header.magic,s3bd_header_magic,sizeof header.magic)) {
+    if (memcmp(header->magic,s3bd_header_magic,sizeof header->magic)) {
         errf(
             &context->c,SQLITE_CORRUPT,
             "Not an SQLite3 binary dump file");
-        goto cleanup;
+        return -1;
     }
-    if (header.ver_major!=CURVER_MAJOR || header.ver_minor!=CURVER_MINOR) {
+    if (header->ver_major!=CURVER_MAJOR
+            || header->ver_minor>CURVER_MINOR) {
         errf(
             &context->c,SQLITE_CORRUPT,
             "Unsupported dump format version %u.%u",
-            header.ver_major,header.ver_minor);
-        goto cleanup;
+            header->ver_major,header->ver_minor);
+        return -1;
     }
-    encoding=header.encoding;
+    context->framed=header->ver_minor>=1;
+    encoding=header->encoding;
     switch (encoding) {
     case SQLITE_UTF8:
         context->c.native_enc=encoding;
         context->vt=&load_vt8;
+        context->textmode=TEXTMODE_UTF8;
         break;
     case SQLITE_UTF16LE:
     case SQLITE_UTF16BE:
@@ -639,15 +3079,17 @@ static int load_header(
             errf(
                 &context->c,SQLITE_ERROR,
                 "Failed to determine short integer endianness");
-            goto cleanup;
+            return -1;
         }
         context->vt=&load_vt16;
+        context->textmode=encoding==context->c.native_enc
+            ? TEXTMODE_UTF16 : TEXTMODE_SWAPPED;
         break;
     default:
         errf(
             &context->c,SQLITE_CORRUPT,
             "Unsupported dump encoding value %u",encoding);
-        goto cleanup;
+        return -1;
     }
     context->c.db_enc=encoding;
     context->c.double_end=endian_double();
@@ -655,8 +3097,26 @@ static int load_header(
         errf(
             &context->c,SQLITE_ERROR,
             "Unsupported floating-point format");
-        goto cleanup;
+        return -1;
     }
+    return 0;
+}
+
+static int load_header(
+    load_context_t *context)
+{
+    s3bd_header_t header;
+    unsigned int encoding;
+    str_t sql;
+    char *errmsg=NULL;
+    int status;
+
+    str_init(&sql,&context->c);
+    if (rd(context,&header,sizeof header))
+        goto cleanup;
+    if (check_header(context,&header))
+        goto cleanup;
+    encoding=header.encoding;
 
     if (str8app_7(&sql,encoding_sql_1,sizeof encoding_sql_1-1))
         goto cleanup;
@@ -684,15 +3144,19 @@ cleanup:
 static int pragma_row(
     load_context_t *context,
     size_t colcnt,
-    col_t const *cols)
+    col_t const *cols,
+    unsigned char const *same)
 {
     sqlite3_stmt *store_pragma=context->store_pragma;
     size_t colix;
     int status;
 
+    (void)same;
     if (colcnt!=3
             || cols[0].type!=SQLITE_INTEGER
-            || cols[1].type!=SQLITE_TEXT) {
+            || cols[1].type!=SQLITE_TEXT
+            || (cols[2].type==SQLITE_BLOB
+                && cols[2].blobcol.shared==BLOBCOL_STREAM)) {
         errf(
             &context->c,SQLITE_CORRUPT,
             "Unexpected pragmas rowset data");
@@ -1006,6 +3470,10 @@ cleanup:
 static void load_done_pragmas(
     load_context_t *context)
 {
+    if (context->count_pragmas) {
+        sqlite3_finalize(context->count_pragmas);
+        context->count_pragmas=NULL;
+    }
     if (context->list_pragmas) {
         sqlite3_finalize(context->list_pragmas);
         context->list_pragmas=NULL;
@@ -1030,13 +3498,15 @@ static char const schema_insert_sql[] =
 static int schema_row(
     load_context_t *context,
     size_t colcnt,
-    col_t const *cols)
+    col_t const *cols,
+    unsigned char const *same)
 {
     load_vt const *vt=context->vt;
     sqlite3_stmt *store_object=context->store_object;
     int status;
     size_t colix;
 
+    (void)same;
     if (colcnt!=3
             || cols[0].type!=SQLITE_INTEGER
             || cols[1].type!=SQLITE_TEXT
@@ -1392,16 +3862,24 @@ static void load_done_schema(
     }
 }
 
+/*
+  Values that are the same as in the row before keep their bindings,
+  which still point at that row's values.
+*/
+
 static int table_row(
     load_context_t *context,
     size_t colcnt,
-    col_t const *cols)
+    col_t const *cols,
+    unsigned char const *same)
 {
     sqlite3_stmt *store_row=context->store_row;
     size_t colix;
     int status;
 
     for (colix=0; colix<colcnt; colix++) {
+        if (same && same[colix])
+            continue;
         if (bind_col(context,store_row,colix+1,&cols[colix]))
             goto cleanup;
     }
@@ -1414,8 +3892,10 @@ static int table_row(
         goto cleanup;
     }
     sqlite3_reset(store_row);
-    sqlite3_clear_bindings(store_row);
-    return 0;
+    context->stats.rows++;
+    return stream_add(
+        context,sqlite3_last_insert_rowid(context->c.connection),
+        colcnt,cols);
 
 cleanup:
     sqlite3_reset(store_row);
@@ -1426,12 +3906,11 @@ cleanup:
 static int ignore_row(
     load_context_t *context,
     size_t colcnt,
-    col_t const *cols)
+    col_t const *cols,
+    unsigned char const *same)
 {
-    (void)context;
-    (void)colcnt;
-    (void)cols;
-    return 0;
+    (void)same;
+    return stream_add(context,0,colcnt,cols);
 }
 
 static char const sequence_clear_sql[] =
@@ -1536,6 +4015,7 @@ static row_cb table_head(
         goto cleanup;
     }
     str_free(&sql);
+    context->streamset=setname;
     return table_row;
 
 cleanup:
@@ -1545,6 +4025,49 @@ cleanup:
     return (row_cb)0;
 }
 
+/*
+  Check the table of contents and step over it, and over the ENDDUMP
+  marker that must follow.
+*/
+
+static int skip_toc(
+    load_context_t *context)
+{
+    unsigned char head[4];
+    unsigned char foot[TOC_FOOTER_SIZE];
+    unsigned char const *entries;
+    unsigned int crc;
+    size_t size;
+    int c;
+
+    if (rd(context,head,sizeof head))
+        return -1;
+    size=get_u32(head);
+    entries=in_fetch(context,size);
+    if (!entries)
+        return -1;
+    crc=crc32c(entries,size);
+    if (rd(context,foot,sizeof foot))
+        return -1;
+    if (get_u32(foot+8)!=size || get_u32(foot+12)!=crc
+            || memcmp(foot+16,s3bd_toc_magic,sizeof s3bd_toc_magic)) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt table of contents");
+        return -1;
+    }
+    c=rc(context);
+    if (c==EOF)
+        return -1;
+    if (!is_ENDDUMP(c)) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Unexpected input");
+        return -1;
+    }
+    return 0;
+}
+
 static int load_tables(
     load_context_t *context)
 {
@@ -1556,6 +4079,11 @@ static int load_tables(
             goto cleanup;
         if (is_ENDDUMP(c))
             break;
+        if (is_TOC(c)) {
+            if (skip_toc(context))
+                goto cleanup;
+            break;
+        }
         if (!is_ROWSET(c)) {
             errf(
                 &context->c,SQLITE_CORRUPT,
@@ -1738,20 +4266,116 @@ cleanup:
     return -1;
 }
 
+static char const cache_get_sql[] =
+    "select cache_size,cache_spill,page_size "
+    "  from pragma_cache_size,pragma_cache_spill,pragma_page_size";
+
+/*
+  Size the page cache to a quarter of the memory budget, and make sure
+  it spills when full, so that a big load writes its dirty pages out
+  steadily instead of growing the cache.  (Only on or off is given
+  for cache_spill: SQLite reads a page count there as a boolean too,
+  modulo 256.)  The old settings are kept for cache_restore.
+*/
+
+static int cache_budget(
+    load_context_t *context)
+{
+    sqlite3_stmt *get=NULL;
+    sqlite3_int64 pages;
+    char sql[80];
+    char *errmsg=NULL;
+    int status;
+
+    if (!context->budget.bytes)
+        return 0;
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        cache_get_sql,sizeof cache_get_sql,
+        &get,
+        NULL);
+    if (status==SQLITE_OK)
+        status=sqlite3_step(get);
+    if (status!=SQLITE_ROW) {
+        errf(
+            &context->c,status,
+            "Failed to get cache settings: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    context->cache_size=sqlite3_column_int64(get,0);
+    context->cache_spill=sqlite3_column_int64(get,1);
+    pages=context->budget.bytes/4/sqlite3_column_int64(get,2);
+    sqlite3_finalize(get);
+    get=NULL;
+    if (pages<1)
+        pages=1;
+    sqlite3_snprintf(
+        sizeof sql,sql,"pragma cache_size=%lld;pragma cache_spill=on",
+        pages);
+    status=sqlite3_exec(context->c.connection,sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Failed to size the page cache: %s",
+            errmsg);
+        goto cleanup;
+    }
+    context->cached=1;
+    return 0;
+
+cleanup:
+    if (get)
+        sqlite3_finalize(get);
+    if (errmsg)
+        sqlite3_free(errmsg);
+    return -1;
+}
+
+static void cache_restore(
+    load_context_t *context)
+{
+    char sql[80];
+
+    if (!context->cached)
+        return;
+    sqlite3_snprintf(
+        sizeof sql,sql,"pragma cache_size=%lld;pragma cache_spill=%s",
+        context->cache_size,context->cache_spill ? "on" : "off");
+    sqlite3_exec(context->c.connection,sql,0,NULL,NULL);
+    context->cached=0;
+}
+
 static conststr_t const table =
     CONSTSTR0("table");
 
-int s3bd_load(
+/*
+  Where the public load functions get the dump from:
+  from io if it isn't NULL, from memory if dump isn't NULL,
+  and from infile otherwise.
+*/
+
+typedef struct load_source_t {
+    FILE *infile;
+    s3bd_load_io_t const *io;
+    void const *dump;
+    size_t size;
+} load_source_t;
+
+static int load_main(
     sqlite3 *connection,
-    FILE *infile,
+    load_source_t const *source,
     unsigned int flags,
+    s3bd_load_params_t const *params,
     char const * const *overrides,
     char **errmsg)
 {
     load_context_t context;
+    size_t bufsize=params ? params->bufsize : 0;
 
     memset(&context,0,sizeof context);
-    context.infile=infile;
+    context.arena=&context.arenaown;
+    context.blobstore=params ? params->blob_store : NULL;
     context.store_pragma=NULL;
     context.list_pragmas=NULL;
     context.store_object=NULL;
@@ -1759,6 +4383,30 @@ int s3bd_load(
     context.store_row=NULL;
     if (context_init(&context.c,connection))
         goto cleanup;
+    if (budget_begin(
+            &context.c,&context.budget,params ? params->mem_budget : 0))
+        goto cleanup;
+    if (source->io) {
+        if (in_attach_io(&context,source->io,bufsize))
+            goto cleanup;
+    } else if (source->dump) {
+        in_attach_mem(&context,source->dump,source->size);
+    } else {
+        if ((flags & S3BD_LOAD_MMAP) && in_map(&context,source->infile))
+            goto cleanup;
+        if (!context.map && in_attach(&context,source->infile,bufsize))
+            goto cleanup;
+        if (!context.map && (flags & S3BD_LOAD_URING) && in_uring(&context))
+            goto cleanup;
+    }
+    if (flags & S3BD_LOAD_PARALLEL) {
+        context.decoders=params ? params->threads : 0;
+        if (!context.decoders) {
+            long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+
+            context.decoders=cpus>0 ? cpus : 1;
+        }
+    }
 
     if (disable_defensive(&context))
         goto cleanup;
@@ -1766,6 +4414,8 @@ int s3bd_load(
         goto cleanup;
     if (disable_foreign_keys(&context))
         goto cleanup;
+    if (in_detect(&context))
+        goto cleanup;
     if (load_header(&context))
         goto cleanup;
     if (load_pragmas(&context))
@@ -1776,6 +4426,8 @@ int s3bd_load(
     }
     if (apply_pragmas(&context,PRAGMA_PHASE_PRE_TRANSACTION))
         goto cleanup;
+    if (cache_budget(&context))
+        goto cleanup;
     if (load_begin_transaction(&context))
         goto cleanup;
     if (apply_pragmas(&context,PRAGMA_PHASE_IN_TRANSACTION))
@@ -1787,7 +4439,8 @@ int s3bd_load(
     if (create_objects(&context,SCHEMA_PHASE_TABLE))
         goto cleanup;
     if (!(flags & S3BD_LOAD_SCHEMA_ONLY)) {
-        if (load_tables(&context))
+        context.pipelined=(flags & S3BD_LOAD_PIPELINE)!=0;
+        if (load_tables(&context) || in_zend(&context))
             goto cleanup;
     }
     if (create_objects(&context,SCHEMA_PHASE_INDEX))
@@ -1805,7 +4458,19 @@ int s3bd_load(
     if (apply_pragmas(&context,PRAGMA_PHASE_POST_TRANSACTION))
         goto cleanup;
     load_done_pragmas(&context);
+    cache_restore(&context);
     restore_defensive(&context);
+    load_pool_close(&context);
+    if (params && params->stats)
+        *params->stats=context.stats;
+    sqlite3_free(context.ints);
+    sqlite3_free(context.dict);
+    sqlite3_free(context.symown);
+    sqlite3_free(context.streams);
+    shared_clear(&context);
+    arena_free(&context.arenaown);
+    in_detach(&context);
+    budget_end(&context.c,&context.budget);
     context_term(&context.c,errmsg);
     return SQLITE_OK;
 
@@ -1813,7 +4478,310 @@ cleanup:
     load_done_schema(&context);
     load_done_pragmas(&context);
     rollback_transaction(&context.c);
+    cache_restore(&context);
     restore_defensive(&context);
+    load_pool_close(&context);
+    if (params && params->stats)
+        *params->stats=context.stats;
+    sqlite3_free(context.ints);
+    sqlite3_free(context.dict);
+    sqlite3_free(context.symown);
+    sqlite3_free(context.streams);
+    shared_clear(&context);
+    arena_free(&context.arenaown);
+    in_detach(&context);
+    budget_end(&context.c,&context.budget);
     return context_term(&context.c,errmsg);
 }
 
+int s3bd_load_io(
+    sqlite3 *connection,
+    s3bd_load_io_t const *io,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    load_source_t source;
+
+    memset(&source,0,sizeof source);
+    source.io=io;
+    return load_main(connection,&source,flags,params,overrides,errmsg);
+}
+
+int s3bd_load_mem(
+    sqlite3 *connection,
+    void const *dump,
+    size_t size,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    load_source_t source;
+
+    memset(&source,0,sizeof source);
+    source.dump=dump ? dump : "";
+    source.size=size;
+    return load_main(connection,&source,flags,params,overrides,errmsg);
+}
+
+int s3bd_load_ex(
+    sqlite3 *connection,
+    FILE *infile,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    load_source_t source;
+
+    memset(&source,0,sizeof source);
+    source.infile=infile;
+    return load_main(connection,&source,flags,params,overrides,errmsg);
+}
+
+int s3bd_load(
+    sqlite3 *connection,
+    FILE *infile,
+    unsigned int flags,
+    char const * const *overrides,
+    char **errmsg)
+{
+    return s3bd_load_ex(connection,infile,flags,NULL,overrides,errmsg);
+}
+
+/*
+  Read exactly size bytes at offset, leaving the file position alone.
+*/
+
+static int toc_pread(
+    load_context_t *context,
+    int fd,
+    void *data,
+    size_t size,
+    off_t offset)
+{
+    unsigned char *dst=data;
+
+    while (size>0) {
+        ssize_t done;
+
+        done=pread(fd,dst,size,offset);
+        if (done<0) {
+            if (errno==EINTR)
+                continue;
+            errf(
+                &context->c,SQLITE_IOERR_READ,
+                "Read error: %s",strerror(errno));
+            return -1;
+        }
+        if (!done)
+            return unexpected_eof(context);
+        dst+=done;
+        size-=done;
+        offset+=done;
+    }
+    return 0;
+}
+
+/*
+  Copy a rowset name for the caller, converting UTF-16 (in native
+  byte order by now) to UTF-8.  Unpaired surrogates are converted
+  like any other code unit.
+*/
+
+static char *toc_name(
+    load_context_t *context,
+    conststr_t name,
+    size_t *size)
+{
+    unsigned short const *src=name.text;
+    unsigned char *result,*dst;
+    size_t cnt,ix;
+
+    if (context->c.db_enc==SQLITE_UTF8) {
+        result=cmalloc(&context->c,name.size+1);
+        if (!result)
+            return NULL;
+        memcpy(result,name.text,name.size);
+        result[name.size]='\0';
+        *size=name.size;
+        return (char *)result;
+    }
+    cnt=name.size/2;
+    result=cmalloc(&context->c,cnt*3+1);
+    if (!result)
+        return NULL;
+    dst=result;
+    for (ix=0; ix<cnt; ix++) {
+        unsigned long u=src[ix];
+
+        if (u>=0xD800 && u<0xDC00 && ix+1<cnt
+                && src[ix+1]>=0xDC00 && src[ix+1]<0xE000) {
+            u=0x10000+((u-0xD800)<<10)+(src[ix+1]-0xDC00);
+            ix++;
+        }
+        if (u<0x80) {
+            *dst++=u;
+        } else if (u<0x800) {
+            *dst++=0xC0 | u>>6;
+            *dst++=0x80 | (u&0x3F);
+        } else if (u<0x10000) {
+            *dst++=0xE0 | u>>12;
+            *dst++=0x80 | (u>>6&0x3F);
+            *dst++=0x80 | (u&0x3F);
+        } else {
+            *dst++=0xF0 | u>>18;
+            *dst++=0x80 | (u>>12&0x3F);
+            *dst++=0x80 | (u>>6&0x3F);
+            *dst++=0x80 | (u&0x3F);
+        }
+    }
+    *dst='\0';
+    *size=dst-result;
+    return (char *)result;
+}
+
+void s3bd_free_toc(
+    s3bd_toc_t *toc)
+{
+    size_t ix;
+
+    if (!toc)
+        return;
+    for (ix=0; ix<toc->count; ix++) {
+        sqlite3_free(toc->entries[ix].name);
+    }
+    sqlite3_free(toc->entries);
+    sqlite3_free(toc);
+}
+
+/*
+  The footer is found at the end of the file and must point back
+  to where the caller says the dump starts.  The entries are decoded
+  like the rows of a memory dump.
+*/
+
+int s3bd_read_toc(
+    FILE *infile,
+    s3bd_toc_t **toc,
+    char **errmsg)
+{
+    load_context_t context;
+    s3bd_toc_t *result=NULL;
+    s3bd_header_t header;
+    unsigned char foot[TOC_FOOTER_SIZE+1];
+    unsigned char *entries=NULL;
+    col_t cols[5];
+    struct stat st;
+    off_t start,end,tocpos;
+    size_t size,cap=0;
+    size_t colix;
+    int fd,got,c;
+
+    *toc=NULL;
+    memset(&context,0,sizeof context);
+    for (colix=0; colix<5; colix++) {
+        cols[colix].type=SQLITE_NULL;
+    }
+    if (context_init(&context.c,NULL))
+        goto cleanup;
+    start=ftello(infile);
+    fd=fileno(infile);
+    if (start<0 || fd<0 || fstat(fd,&st) || !S_ISREG(st.st_mode)) {
+        errf(
+            &context.c,SQLITE_NOTFOUND,
+            "Table of contents needs a regular file");
+        goto cleanup;
+    }
+    end=st.st_size;
+    if (end-start<(off_t)(sizeof header+5+sizeof foot))
+        goto notfound;
+    if (toc_pread(&context,fd,&header,sizeof header,start))
+        goto cleanup;
+    if (!memcmp(header.magic,s3bd_zheader_magic,sizeof header.magic))
+        goto notfound;
+    if (check_header(&context,&header))
+        goto cleanup;
+    if (toc_pread(&context,fd,foot,sizeof foot,end-sizeof foot))
+        goto cleanup;
+    if (!is_ENDDUMP(foot[TOC_FOOTER_SIZE])
+            || memcmp(foot+16,s3bd_toc_magic,sizeof s3bd_toc_magic))
+        goto notfound;
+    size=get_u32(foot+8);
+    tocpos=end-(off_t)sizeof foot-(off_t)size-5;
+    if (tocpos<start+(off_t)sizeof header
+            || get_u64(foot)!=(sqlite3_uint64)(tocpos-start))
+        goto notfound;
+    entries=cmalloc(&context.c,size ? size : 1);
+    if (!entries)
+        goto cleanup;
+    if (toc_pread(&context,fd,entries,size,tocpos+5))
+        goto cleanup;
+    if (crc32c(entries,size)!=get_u32(foot+12)) {
+        errf(
+            &context.c,SQLITE_CORRUPT,
+            "Corrupt table of contents");
+        goto cleanup;
+    }
+    result=cmalloc(&context.c,sizeof *result);
+    if (!result)
+        goto cleanup;
+    memset(result,0,sizeof *result);
+    result->encoding=header.encoding;
+    in_attach_mem(&context,entries,size);
+    while (context.inpos<context.infill) {
+        s3bd_toc_entry_t *entry;
+
+        got=load_row(&context,cols,NULL,5,NULL,&c);
+        if (got<0)
+            goto cleanup;
+        if (!got || cols[0].type!=SQLITE_TEXT
+                || cols[1].type!=SQLITE_INTEGER || cols[1].intcol.val<0
+                || cols[2].type!=SQLITE_INTEGER || cols[2].intcol.val<0
+                || cols[3].type!=SQLITE_INTEGER || cols[3].intcol.val<0
+                || cols[4].type!=SQLITE_INTEGER || cols[4].intcol.val<1) {
+            errf(
+                &context.c,SQLITE_CORRUPT,
+                "Corrupt table of contents");
+            goto cleanup;
+        }
+        if (result->count>=cap) {
+            s3bd_toc_entry_t *grown;
+
+            cap=cap ? cap*2 : 64;
+            grown=crealloc(&context.c,result->entries,cap*sizeof *grown);
+            if (!grown)
+                goto cleanup;
+            result->entries=grown;
+        }
+        entry=&result->entries[result->count];
+        entry->name=toc_name(&context,cols[0].textcol.text,&entry->namesize);
+        if (!entry->name)
+            goto cleanup;
+        result->count++;
+        entry->offset=cols[1].intcol.val;
+        entry->rows=cols[2].intcol.val;
+        entry->size=cols[3].intcol.val;
+        entry->colcnt=cols[4].intcol.val;
+        for (colix=0; colix<5; colix++) {
+            col_free(&cols[colix]);
+        }
+    }
+    sqlite3_free(entries);
+    *toc=result;
+    return context_term(&context.c,errmsg);
+
+notfound:
+    errf(
+        &context.c,SQLITE_NOTFOUND,
+        "Dump has no table of contents");
+cleanup:
+    for (colix=0; colix<5; colix++) {
+        col_free(&cols[colix]);
+    }
+    sqlite3_free(entries);
+    s3bd_free_toc(result);
+    return context_term(&context.c,errmsg);
+}
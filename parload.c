@@ -0,0 +1,767 @@
+/*
+  Parallel decoding of rowset blocks, row-wise or columnar.
+
+  The main thread reads the blocks of a rowset and queues them in a ring
+  of slots.  Decoder threads check each block's CRC and decode its rows
+  into the slot, with text and blob values pointing into the payload
+  wherever possible.  The main thread takes the slots back in order
+  and only has to bind and step, so the rows are inserted in exactly
+  the order of the dump.
+
+  Payloads are copied into the slot unless the dump is in memory,
+  since the input buffer moves on while a block is being decoded.
+  Values that can't point into the payload are copied into the slot's
+  arena.
+  With a memory budget, the payloads queued at any one time are kept
+  to a quarter of it (but at least one block is always queued).
+
+  When the load is pipelined, the blocks of tables are read on a reader
+  thread instead, which also decodes them if there are no decoder
+  threads, so that the main thread does nothing but take the slots back
+  and bind and step.  The reader has the load context to itself while
+  it runs; the main thread inserts with a copy of it meanwhile, and
+  the state that inserting changes goes back when the reader stops,
+  which it does at the end of the blocks, and at each stream record
+  for the main thread to store.  How often and how long either side
+  waited for the other is counted in stats.
+*/
+
+#define DSLOT_FREE	0
+#define DSLOT_QUEUED	1
+#define DSLOT_DONE	2
+
+#define PIPE_SLOTS	4
+
+typedef struct load_slot_t {
+    unsigned char *buf;
+    size_t bufcap;
+    unsigned char const *payload;
+    size_t size;
+    size_t rows;
+    unsigned int crc;
+    unsigned char columnar;
+    textcol_t *dict;
+    size_t dictcnt;
+    symtab_t const *symtab;
+    unsigned char *types;
+    col_t *cols;
+    size_t colcap;
+    unsigned char *same;
+    size_t samecap;
+    arena_t arena;
+    int state;
+    context_t err;
+} load_slot_t;
+
+struct load_pool_t {
+    load_context_t *main;
+    size_t colcnt;
+    load_slot_t *slots;
+    unsigned int slotcnt;
+    pthread_t *threads;
+    unsigned int threadcnt;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    sqlite3_uint64 filled;
+    sqlite3_uint64 taken;
+    sqlite3_uint64 consumed;
+    size_t inflight;
+    size_t cap;
+    unsigned char stop;
+    pthread_t reader;
+    unsigned char halt;
+    unsigned char readdone;
+    unsigned char readfail;
+    int marker;
+    s3bd_load_stats_t stats;
+};
+
+static void slot_free_cols(
+    load_pool_t *pool,
+    load_slot_t *slot)
+{
+    size_t colix;
+
+    for (colix=0; colix<slot->rows*pool->colcnt; colix++) {
+        col_free(&slot->cols[colix]);
+    }
+}
+
+/*
+  Decode a slot's rows with the decoder's own context, which reads
+  the payload as if it were a memory dump.
+*/
+
+static int decode_slot(
+    load_pool_t *pool,
+    load_context_t *dec,
+    load_slot_t *slot)
+{
+    size_t colcnt=pool->colcnt;
+    size_t rowix;
+    int got,c;
+
+    if (crc32c(slot->payload,slot->size)!=slot->crc) {
+        errf(
+            &dec->c,SQLITE_CORRUPT,
+            "Block checksum mismatch");
+        return -1;
+    }
+    dec->inbuf=(unsigned char *)slot->payload;
+    dec->inpos=0;
+    dec->infill=slot->size;
+    dec->arena=&slot->arena;
+    arena_reset(dec->arena);
+    dec->dict=slot->dict;
+    dec->dictcnt=slot->dictcnt;
+    dec->symtab=slot->symtab;
+    dec->types=slot->types;
+    if (slot->columnar) {
+        if (load_colblock(dec,slot->cols,colcnt,slot->rows))
+            return -1;
+    } else {
+        for (rowix=0; rowix<slot->rows; rowix++) {
+            col_t *cols=slot->cols+rowix*colcnt;
+
+            got=load_row(
+                dec,cols,rowix ? cols-colcnt : NULL,colcnt,
+                slot->same+rowix*colcnt,&c);
+            if (got<=0) {
+                if (!got)
+                    errf(
+                        &dec->c,SQLITE_CORRUPT,
+                        "Unexpected input");
+                return -1;
+            }
+        }
+    }
+    if (dec->inpos<dec->infill) {
+        errf(
+            &dec->c,SQLITE_CORRUPT,
+            "Unexpected input at end of block");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Set up the context a thread decodes slots with.
+*/
+
+static void decoder_init(
+    load_context_t *dec,
+    load_context_t const *main)
+{
+    memset(dec,0,sizeof *dec);
+    context_init(&dec->c,NULL);
+    dec->vt=main->vt;
+    dec->textmode=main->textmode;
+    dec->c.db_enc=main->c.db_enc;
+    dec->c.native_enc=main->c.native_enc;
+    dec->c.double_end=main->c.double_end;
+    dec->blobstore=main->blobstore;
+    dec->inmem=1;
+    dec->inblock=1;
+}
+
+static void decoder_term(
+    load_context_t *dec)
+{
+    sqlite3_free(dec->ints);
+    context_term(&dec->c,NULL);
+}
+
+/*
+  Decode a slot, leaving any error in the slot.
+*/
+
+static void decode_into_slot(
+    load_pool_t *pool,
+    load_context_t *dec,
+    load_slot_t *slot)
+{
+    if (decode_slot(pool,dec,slot)) {
+        move_error(&slot->err,&dec->c);
+        sqlite3_free(dec->c.errmsg);
+        dec->c.errmsg=NULL;
+        dec->c.status=SQLITE_OK;
+    }
+}
+
+static void *load_decoder(
+    void *arg)
+{
+    load_pool_t *pool=arg;
+    load_context_t dec;
+
+    decoder_init(&dec,pool->main);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        load_slot_t *slot;
+
+        while (!pool->stop && pool->taken>=pool->filled)
+            pthread_cond_wait(&pool->changed,&pool->lock);
+        if (pool->stop)
+            break;
+        slot=&pool->slots[pool->taken++%pool->slotcnt];
+        pthread_mutex_unlock(&pool->lock);
+        decode_into_slot(pool,&dec,slot);
+        pthread_mutex_lock(&pool->lock);
+        slot->state=DSLOT_DONE;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    decoder_term(&dec);
+    return NULL;
+}
+
+static void load_pool_close(
+    load_context_t *context)
+{
+    load_pool_t *pool=context->pool;
+    unsigned int ix;
+
+    if (!pool)
+        return;
+    context->pool=NULL;
+    context->stats.full_waits+=pool->stats.full_waits;
+    context->stats.full_wait_ns+=pool->stats.full_wait_ns;
+    context->stats.empty_waits+=pool->stats.empty_waits;
+    context->stats.empty_wait_ns+=pool->stats.empty_wait_ns;
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop=1;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        for (ix=0; ix<pool->threadcnt; ix++)
+            pthread_join(pool->threads[ix],NULL);
+        sqlite3_free(pool->threads);
+    }
+    if (pool->slots) {
+        for (ix=0; ix<pool->slotcnt; ix++) {
+            load_slot_t *slot=&pool->slots[ix];
+
+            slot_free_cols(pool,slot);
+            sqlite3_free(slot->cols);
+            sqlite3_free(slot->same);
+            sqlite3_free(slot->buf);
+            arena_free(&slot->arena);
+            context_term(&slot->err,NULL);
+        }
+        sqlite3_free(pool->slots);
+    }
+    pthread_cond_destroy(&pool->changed);
+    pthread_mutex_destroy(&pool->lock);
+    sqlite3_free(pool);
+}
+
+/*
+  Two slots per decoder, so that every decoder has the next block
+  waiting while the main thread inserts rows.  A pipelined load without
+  decoders has PIPE_SLOTS blocks of decoded rows in flight.
+*/
+
+static int load_pool_open(
+    load_context_t *context)
+{
+    load_pool_t *pool;
+    unsigned int threads=context->decoders;
+    unsigned int ix;
+
+    pool=cmalloc(&context->c,sizeof *pool);
+    if (!pool)
+        return -1;
+    memset(pool,0,sizeof *pool);
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->changed,NULL);
+    pool->main=context;
+    context->pool=pool;
+    pool->cap=context->budget.bytes/4;
+    pool->slotcnt=threads ? 2*threads : PIPE_SLOTS;
+    pool->slots=cmalloc(&context->c,pool->slotcnt*sizeof *pool->slots);
+    if (!pool->slots)
+        return -1;
+    memset(pool->slots,0,pool->slotcnt*sizeof *pool->slots);
+    for (ix=0; ix<pool->slotcnt; ix++) {
+        if (context_init(&pool->slots[ix].err,NULL)) {
+            context->c.status=SQLITE_NOMEM;
+            return -1;
+        }
+    }
+    if (!threads)
+        return 0;
+    pool->threads=cmalloc(&context->c,threads*sizeof *pool->threads);
+    if (!pool->threads)
+        return -1;
+    for (ix=0; ix<threads; ix++) {
+        if (pthread_create(&pool->threads[ix],NULL,load_decoder,pool)) {
+            errf(
+                &context->c,SQLITE_ERROR,
+                "Failed to start decoder thread");
+            return -1;
+        }
+        pool->threadcnt++;
+    }
+    return 0;
+}
+
+/*
+  Read the next block into a slot.  A payload that in_fetch had to
+  put together in blockbuf is taken over by swapping buffers.
+*/
+
+static int read_slot(
+    load_context_t *context,
+    load_slot_t *slot,
+    size_t colcnt,
+    int columnar)
+{
+    unsigned char head[BLOCK_HEADER_SIZE];
+    unsigned char const *payload;
+    size_t size,rows,minrow,ix;
+
+    if (rd(context,head,sizeof head))
+        return -1;
+    size=get_u32(head);
+    rows=get_u32(head+4);
+    /* A row has at least a byte per column, or a NULLMAP. */
+    minrow=1+(colcnt+7)/8;
+    if (colcnt<minrow)
+        minrow=colcnt;
+    if (!columnar && rows>size/minrow) {
+        errf(
+            &context->c,SQLITE_CORRUPT,
+            "Corrupt block header");
+        return -1;
+    }
+    payload=in_fetch(context,size);
+    if (!payload)
+        return -1;
+    if (payload==context->blockbuf) {
+        unsigned char *buf=slot->buf;
+        size_t bufcap=slot->bufcap;
+
+        slot->buf=context->blockbuf;
+        slot->bufcap=context->blockcap;
+        context->blockbuf=buf;
+        context->blockcap=bufcap;
+    } else if (!context->inmem || context->zcodec) {
+        if (slot->bufcap<size) {
+            sqlite3_free(slot->buf);
+            slot->buf=cmalloc(&context->c,size);
+            if (!slot->buf) {
+                slot->bufcap=0;
+                return -1;
+            }
+            slot->bufcap=size;
+        }
+        memcpy(slot->buf,payload,size);
+        payload=slot->buf;
+    }
+    if (columnar) {
+        if (!colblock_cols(context,&slot->cols,&slot->colcap,colcnt,rows))
+            return -1;
+    } else {
+        if (slot->colcap<rows*colcnt) {
+            sqlite3_free(slot->cols);
+            slot->cols=cmalloc(&context->c,rows*colcnt*sizeof *slot->cols);
+            if (!slot->cols) {
+                slot->colcap=0;
+                return -1;
+            }
+            slot->colcap=rows*colcnt;
+        }
+        if (slot->samecap<rows*colcnt) {
+            sqlite3_free(slot->same);
+            slot->same=cmalloc(&context->c,rows*colcnt);
+            if (!slot->same) {
+                slot->samecap=0;
+                return -1;
+            }
+            slot->samecap=rows*colcnt;
+        }
+        for (ix=0; ix<rows*colcnt; ix++) {
+            slot->cols[ix].type=SQLITE_NULL;
+        }
+    }
+    slot->payload=payload;
+    slot->size=size;
+    slot->rows=rows;
+    slot->crc=get_u32(head+8);
+    slot->columnar=columnar;
+    slot->dict=context->dict;
+    slot->dictcnt=context->dictcnt;
+    slot->symtab=context->symtab;
+    slot->types=context->types;
+    return 0;
+}
+
+/*
+  Give a decoded slot back, along with its payload buffer if that is
+  more than its share of the budget.  The counters are shared with
+  the reader of a pipelined load.
+*/
+
+static void release_slot(
+    load_pool_t *pool,
+    load_slot_t *slot)
+{
+    slot_free_cols(pool,slot);
+    slot->rows=0;
+    if (pool->cap && slot->bufcap>pool->cap/pool->slotcnt) {
+        sqlite3_free(slot->buf);
+        slot->buf=NULL;
+        slot->bufcap=0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    slot->state=DSLOT_FREE;
+    pool->inflight-=slot->size;
+    pool->consumed++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+  Wait for the decoders to finish with everything queued and empty
+  the ring.
+*/
+
+static void load_pool_drain(
+    load_pool_t *pool)
+{
+    while (pool->consumed<pool->filled) {
+        load_slot_t *slot=&pool->slots[pool->consumed%pool->slotcnt];
+
+        pthread_mutex_lock(&pool->lock);
+        while (slot->state!=DSLOT_DONE)
+            pthread_cond_wait(&pool->changed,&pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        release_slot(pool,slot);
+    }
+}
+
+/*
+  Whether another block may be queued: there's a free slot, and the
+  payloads in flight leave room in the budget.
+*/
+
+static int slot_room(
+    load_pool_t const *pool)
+{
+    return pool->filled-pool->consumed<pool->slotcnt
+        && (!pool->cap || pool->inflight<pool->cap
+            || pool->filled==pool->consumed);
+}
+
+/*
+  Read up to the next block and queue it, for the decoders or, if dec
+  is given, decoded with it right away.  Returns 1 if a block was
+  queued, 0 if some other marker came first (left in *marker), and -1
+  on errors.
+*/
+
+static int read_block(
+    load_context_t *context,
+    load_pool_t *pool,
+    load_context_t *dec,
+    int *marker)
+{
+    load_slot_t *slot;
+    int c;
+
+    for (;;) {
+        c=rc(context);
+        if (c==EOF)
+            return -1;
+        if (is_DICT(c)) {
+            if (load_dict(context,c))
+                return -1;
+            continue;
+        }
+        if (is_SYMTAB(c)) {
+            if (load_symtab(context))
+                return -1;
+            continue;
+        }
+        if (is_TYPES(c)) {
+            if (load_types(context,c,pool->colcnt))
+                return -1;
+            continue;
+        }
+        if (!is_BLOCK(c) && !is_COLBLOCK(c)) {
+            *marker=c;
+            return 0;
+        }
+        break;
+    }
+    slot=&pool->slots[pool->filled%pool->slotcnt];
+    if (read_slot(context,slot,pool->colcnt,is_COLBLOCK(c)))
+        return -1;
+    if (dec)
+        decode_into_slot(pool,dec,slot);
+    pthread_mutex_lock(&pool->lock);
+    pool->inflight+=slot->size;
+    slot->state=dec ? DSLOT_DONE : DSLOT_QUEUED;
+    pool->filled++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/*
+  Wait until the next slot is decoded, or, in a pipelined load, until
+  the reader has stopped with nothing more queued.  Returns the slot,
+  or NULL if there is none.
+*/
+
+static load_slot_t *next_slot(
+    load_pool_t *pool,
+    int piped)
+{
+    load_slot_t *slot=&pool->slots[pool->consumed%pool->slotcnt];
+    sqlite3_uint64 started;
+
+    pthread_mutex_lock(&pool->lock);
+    if (slot->state!=DSLOT_DONE
+            && !(piped && pool->readdone && pool->consumed>=pool->filled)) {
+        pool->stats.empty_waits++;
+        started=pipe_clock();
+        do {
+            pthread_cond_wait(&pool->changed,&pool->lock);
+        } while (slot->state!=DSLOT_DONE
+                && !(piped && pool->readdone
+                    && pool->consumed>=pool->filled));
+        pool->stats.empty_wait_ns+=pipe_clock()-started;
+    }
+    if (slot->state!=DSLOT_DONE)
+        slot=NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+/*
+  Insert the rows of a decoded slot and give it back.
+*/
+
+static int insert_slot(
+    load_context_t *context,
+    load_pool_t *pool,
+    load_slot_t *slot,
+    row_cb dorow)
+{
+    size_t colcnt=pool->colcnt;
+    size_t rowix;
+
+    if (slot->err.status!=SQLITE_OK) {
+        move_error(&context->c,&slot->err);
+        return -1;
+    }
+    for (rowix=0; rowix<slot->rows; rowix++) {
+        col_t *cols=slot->cols+rowix*colcnt;
+        unsigned char const *same=
+            slot->columnar ? NULL : slot->same+rowix*colcnt;
+
+        if (shared_row(context,cols,colcnt,same)
+                || (*dorow)(context,colcnt,cols,same))
+            return -1;
+    }
+    release_slot(pool,slot);
+    shared_flush(context);
+    return 0;
+}
+
+/*
+  The reader thread of a pipelined load: queues blocks until it runs
+  into some other marker, which it leaves in pool->marker, or is told
+  to halt.
+*/
+
+static void *load_reader(
+    void *arg)
+{
+    load_pool_t *pool=arg;
+    load_context_t *context=pool->main;
+    load_context_t dec;
+    sqlite3_uint64 started;
+    int got=1;
+
+    if (!pool->threadcnt)
+        decoder_init(&dec,context);
+    for (;;) {
+        int halt;
+
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->halt && !slot_room(pool)) {
+            pool->stats.full_waits++;
+            started=pipe_clock();
+            do {
+                pthread_cond_wait(&pool->changed,&pool->lock);
+            } while (!pool->halt && !slot_room(pool));
+            pool->stats.full_wait_ns+=pipe_clock()-started;
+        }
+        halt=pool->halt;
+        pthread_mutex_unlock(&pool->lock);
+        if (halt)
+            break;
+        got=read_block(
+            context,pool,pool->threadcnt ? NULL : &dec,&pool->marker);
+        if (got<=0)
+            break;
+    }
+    if (!pool->threadcnt)
+        decoder_term(&dec);
+    pthread_mutex_lock(&pool->lock);
+    pool->readdone=1;
+    pool->readfail=got<0;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+  Hand what inserting rows changes in the context back from the copy
+  the main thread inserted with.
+*/
+
+static void insert_state_back(
+    load_context_t *context,
+    load_context_t *ins)
+{
+    context->shared=ins->shared;
+    context->sharedcnt=ins->sharedcnt;
+    context->sharedold=ins->sharedold;
+    context->sharedbytes=ins->sharedbytes;
+    context->sharedgone=ins->sharedgone;
+    context->sharedgonecnt=ins->sharedgonecnt;
+    context->sharedgonecap=ins->sharedgonecap;
+    context->streams=ins->streams;
+    context->streamcnt=ins->streamcnt;
+    context->streamcap=ins->streamcap;
+    context->stats.rows=ins->stats.rows;
+    move_error(&context->c,&ins->c);
+    context_term(&ins->c,NULL);
+}
+
+/*
+  The pipelined counterpart of the block loop in load_rowset.  Runs the
+  reader until it stops at a marker other than a block, and stores
+  the record if it's a stream record, in which case the reader carries
+  on after it.
+*/
+
+static int load_blocks_piped(
+    load_context_t *context,
+    row_cb dorow,
+    int *marker)
+{
+    load_pool_t *pool=context->pool;
+    load_context_t ins;
+    load_slot_t *slot;
+    int failed;
+
+    for (;;) {
+        ins=*context;
+        if (context_init(&ins.c,context->c.connection)) {
+            context->c.status=SQLITE_NOMEM;
+            return -1;
+        }
+        ins.c.db_enc=context->c.db_enc;
+        ins.c.native_enc=context->c.native_enc;
+        ins.c.double_end=context->c.double_end;
+        ins.c.in_transaction=context->c.in_transaction;
+        pool->halt=0;
+        pool->readdone=0;
+        pool->readfail=0;
+        pool->marker=EOF;
+        if (pthread_create(&pool->reader,NULL,load_reader,pool)) {
+            context_term(&ins.c,NULL);
+            errf(
+                &context->c,SQLITE_ERROR,
+                "Failed to start reader thread");
+            return -1;
+        }
+        failed=0;
+        while ((slot=next_slot(pool,1))) {
+            if (insert_slot(&ins,pool,slot,dorow)) {
+                failed=1;
+                break;
+            }
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->halt=1;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_join(pool->reader,NULL);
+        insert_state_back(context,&ins);
+        if (failed || pool->readfail) {
+            load_pool_drain(pool);
+            return -1;
+        }
+        if (!is_STREAM(pool->marker)) {
+            *marker=pool->marker;
+            return 0;
+        }
+        if (load_stream(context,pool->marker))
+            return -1;
+    }
+}
+
+/*
+  The parallel counterpart of the block loop in load_rowset.
+  Stops at the first marker that isn't a block and leaves it in *marker.
+  A stream record waits until the rows before it are all in.
+*/
+
+static int load_blocks_parallel(
+    load_context_t *context,
+    size_t colcnt,
+    row_cb dorow,
+    int *marker)
+{
+    load_pool_t *pool;
+    int eos=0;
+    int stream=0;
+
+    if (!context->pool && load_pool_open(context))
+        return -1;
+    pool=context->pool;
+    pool->colcnt=colcnt;
+    if (context->pipelined)
+        return load_blocks_piped(context,dorow,marker);
+    for (;;) {
+        load_slot_t *slot;
+
+        while (!eos && !stream && slot_room(pool)) {
+            int c,got;
+
+            got=read_block(context,pool,NULL,&c);
+            if (got<0)
+                goto cleanup;
+            if (!got) {
+                if (is_STREAM(c))
+                    stream=c;
+                else {
+                    *marker=c;
+                    eos=1;
+                }
+                break;
+            }
+        }
+        if (pool->consumed>=pool->filled) {
+            if (!stream)
+                break;
+            if (load_stream(context,stream))
+                goto cleanup;
+            stream=0;
+            continue;
+        }
+        slot=next_slot(pool,0);
+        if (insert_slot(context,pool,slot,dorow))
+            goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    load_pool_drain(pool);
+    return -1;
+}
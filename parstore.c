@@ -0,0 +1,898 @@
+/*
+  Parallel extraction of table contents.
+
+  The main thread lists the tables.  Worker threads, each with a private
+  read-only connection that sees the same database state as the main one,
+  encode whole rowsets.  One job at a time writes straight to the real
+  output through the main context: the next in order, or with unordered
+  output, whichever the main thread claims when nothing else is ready.
+  The others go into spool files, which the main thread copies to the
+  output once they're finished, so rowsets never interleave.  A job
+  claimed while it is running copies what it spooled so far itself and
+  carries on writing to the output.  Workers don't start new jobs while
+  as many finished spools as there are threads are waiting, which keeps
+  the temporary space to about two jobs per thread.
+
+  Big rowid tables are split into rowid ranges, each one a separate job
+  and a separate rowset.  The span of rowids is an imperfect measure
+  of the row count, but it's available in O(log n) time.
+
+  The sqlite_sequence table is left for the main thread to do at the end,
+  since the loader must see it after all the other tables.
+
+  Table of contents entries are made by the workers with offsets
+  into their spools, and moved to the real output position when
+  the spool is copied.
+*/
+
+#define JOB_PENDING	0
+#define JOB_DONE	1
+#define JOB_WRITTEN	2
+
+typedef struct store_pool_t store_pool_t;
+
+typedef struct store_job_t {
+    str_t name;
+    store_range_t range;
+    unsigned char ranged;
+    store_pool_t *pool;
+    s3bd_store_io_t io;
+    FILE *spool;
+    int spoolerr;
+    int state;
+    unsigned char claimed;
+    unsigned char live;
+    sqlite3_uint64 offset;
+    int colcnt;
+    sqlite3_uint64 rows;
+    sqlite3_uint64 size;
+} store_job_t;
+
+struct store_pool_t {
+    store_context_t *main;
+    char const *filename;
+#ifdef S3BD_SNAPSHOT
+    sqlite3_snapshot *snapshot;
+#endif
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    store_job_t *jobs;
+    size_t jobcnt;
+    size_t jobcap;
+    size_t nextjob;
+    size_t spooled;
+    unsigned int threadcnt;
+    unsigned int running;
+    unsigned char abort;
+    context_t error;
+};
+
+static char const worker_begin_sql[] =
+    "begin transaction";
+static char const worker_lock_sql[] =
+    "select count(*) from sqlite_schema";
+
+/*
+  How long a worker waits for its read lock.  With a rollback journal,
+  a writer waiting for the main connection's lock to go away keeps new
+  readers out, and that won't happen before the store is done.
+*/
+
+#define WORKER_BUSY_MS	10000
+
+static int worker_open(
+    store_pool_t *pool,
+    store_context_t *context)
+{
+    char *errmsg=NULL;
+    int status;
+
+    status=sqlite3_open_v2(
+        pool->filename,
+        &context->c.connection,
+        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Worker failed to open database: %s",
+            context->c.connection
+                ? sqlite3_errmsg(context->c.connection)
+                : sqlite3_errstr(status));
+        goto cleanup;
+    }
+    sqlite3_busy_timeout(context->c.connection,WORKER_BUSY_MS);
+    status=sqlite3_exec(
+        context->c.connection,worker_begin_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Worker failed to start transaction: %s",errmsg);
+        goto cleanup;
+    }
+    context->c.in_transaction=1;
+#ifdef S3BD_SNAPSHOT
+    if (pool->snapshot) {
+        status=sqlite3_snapshot_open(
+            context->c.connection,"main",pool->snapshot);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "Worker failed to open snapshot: %s",
+                sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+    }
+#endif
+    status=sqlite3_exec(
+        context->c.connection,worker_lock_sql,0,NULL,&errmsg);
+    if (status==SQLITE_BUSY) {
+        errf(
+            &context->c,status,
+            "Worker got no read lock within %d seconds: another"
+            " connection is waiting to write to the database",
+            WORKER_BUSY_MS/1000);
+        goto cleanup;
+    }
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Worker failed to read the schema: %s",errmsg);
+        goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    if (errmsg)
+        sqlite3_free(errmsg);
+    return -1;
+}
+
+static int copy_spool(
+    store_context_t *context,
+    FILE *spool);
+
+/*
+  Where a job's output goes: into its spool until the main thread
+  claims the job, and from then on to the real output, after what
+  was spooled.  Called on the worker (or its writer thread).
+*/
+
+static int job_write(
+    void *arg,
+    void const *data,
+    size_t size)
+{
+    store_job_t *job=arg;
+    store_pool_t *pool=job->pool;
+    store_context_t *main=pool->main;
+
+    if (!job->live) {
+        int claimed;
+
+        pthread_mutex_lock(&pool->lock);
+        claimed=job->claimed;
+        pthread_mutex_unlock(&pool->lock);
+        if (claimed) {
+            if (job->spool) {
+                if (copy_spool(main,job->spool))
+                    return main->c.status;
+                fclose(job->spool);
+                job->spool=NULL;
+            }
+            job->live=1;
+        }
+    }
+    if (job->live)
+        return wd(main,data,size) ? main->c.status : SQLITE_OK;
+    if (!job->spool) {
+        job->spool=tmpfile();
+        if (!job->spool) {
+            job->spoolerr=errno;
+            return SQLITE_CANTOPEN;
+        }
+    }
+    if (!fwrite(data,size,1,job->spool)) {
+        job->spoolerr=errno;
+        return SQLITE_IOERR_WRITE;
+    }
+    return SQLITE_OK;
+}
+
+static int worker_job(
+    store_context_t *context,
+    store_job_t *job)
+{
+    conststr_t tablename;
+    str_t sql;
+
+    str_init(&sql,&context->c);
+    job->io.write=job_write;
+    job->io.arg=job;
+    if (out_attach_io(context,&job->io))
+        goto cleanup;
+    tablename.text=job->name.text;
+    tablename.size=job->name.size;
+    if (store_table(
+            context,tablename,job->ranged ? &job->range : NULL,&sql))
+        goto cleanup;
+    if (context->toccnt>0) {
+        toc_entry_t const *entry=&context->toc[context->toccnt-1];
+
+        job->colcnt=entry->colcnt;
+        job->rows=entry->rows;
+        job->size=entry->size;
+        toc_clear(context);
+    }
+    if (out_flush(context))
+        goto cleanup;
+    if (job->spool && fflush(job->spool)) {
+        errf(
+            &context->c,SQLITE_IOERR_WRITE,
+            "Write error: %s",strerror(errno));
+        goto cleanup;
+    }
+    str_free(&sql);
+    return 0;
+
+cleanup:
+    str_free(&sql);
+    if (job->spoolerr) {
+        sqlite3_free(context->c.errmsg);
+        context->c.errmsg=NULL;
+        errf(
+            &context->c,SQLITE_IOERR_WRITE,
+            "Spool write error: %s",strerror(job->spoolerr));
+    }
+    return -1;
+}
+
+static void *store_worker(
+    void *arg)
+{
+    store_pool_t *pool=arg;
+    store_context_t *main=pool->main;
+    store_context_t context;
+    int failed=1;
+
+    memset(&context,0,sizeof context);
+    context.vt=main->vt;
+    context.flags=main->flags;
+    context.params=main->params;
+    if (context_init(&context.c,NULL))
+        goto done;
+    context.c.db_enc=main->c.db_enc;
+    context.c.native_enc=main->c.native_enc;
+    context.c.double_end=main->c.double_end;
+    if (worker_open(pool,&context))
+        goto done;
+    for (;;) {
+        store_job_t *job;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->abort && pool->nextjob<pool->jobcnt
+                && pool->spooled>=pool->threadcnt)
+            pthread_cond_wait(&pool->done,&pool->lock);
+        if (pool->abort || pool->nextjob>=pool->jobcnt) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job=&pool->jobs[pool->nextjob++];
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (worker_job(&context,job))
+            goto done;
+        pthread_mutex_lock(&pool->lock);
+        job->state=JOB_DONE;
+        if (!job->live)
+            pool->spooled++;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    failed=0;
+
+done:
+    rollback_transaction(&context.c);
+    if (context.c.connection)
+        sqlite3_close(context.c.connection);
+    pthread_mutex_lock(&pool->lock);
+    add_stats(&main->stats,&context.stats);
+    if (failed) {
+        move_error(&pool->error,&context.c);
+        pool->abort=1;
+    }
+    pool->running--;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+    out_free(&context);
+    context_term(&context.c,NULL);
+    return NULL;
+}
+
+static int copy_spool(
+    store_context_t *context,
+    FILE *spool)
+{
+    unsigned char *buf;
+    size_t const bufsize=65536;
+    size_t size;
+
+    if (!spool)
+        return 0;
+    buf=cmalloc(&context->c,bufsize);
+    if (!buf)
+        return -1;
+    rewind(spool);
+    while ((size=fread(buf,1,bufsize,spool))>0) {
+        if (wd(context,buf,size))
+            goto cleanup;
+    }
+    if (ferror(spool)) {
+        errf(
+            &context->c,SQLITE_IOERR_READ,
+            "Spool read error: %s",strerror(errno));
+        goto cleanup;
+    }
+    sqlite3_free(buf);
+    return 0;
+
+cleanup:
+    sqlite3_free(buf);
+    return -1;
+}
+
+static char const journal_mode_sql[] =
+    "pragma main.journal_mode";
+
+static int store_is_wal(
+    store_context_t *context)
+{
+    sqlite3_stmt *get=NULL;
+    int status;
+    int wal=0;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        journal_mode_sql,sizeof journal_mode_sql,
+        &get,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While getting journal mode: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    for (;;) {
+        conststr_t mode;
+
+        status=sqlite3_step(get);
+        if (status!=SQLITE_ROW)
+            break;
+        if (column_text8(&context->c,get,0,&mode))
+            goto cleanup;
+        wal=mode.size==3 && !sqlite3_strnicmp(mode.text,"wal",3);
+    }
+    if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While getting journal mode: sqlite3_step: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    sqlite3_finalize(get);
+    get=NULL;
+    return wal;
+
+cleanup:
+    if (get)
+        sqlite3_finalize(get);
+    return -1;
+}
+
+static int pool_pin(
+    store_pool_t *pool)
+{
+    store_context_t *context=pool->main;
+    int wal;
+
+    if (!sqlite3_threadsafe()) {
+        errf(
+            &context->c,SQLITE_MISUSE,
+            "Parallel store needs a thread-safe SQLite library");
+        return -1;
+    }
+    pool->filename=sqlite3_db_filename(context->c.connection,"main");
+    if (!pool->filename || !*pool->filename) {
+        errf(
+            &context->c,SQLITE_MISUSE,
+            "Parallel store needs an on-disk database");
+        return -1;
+    }
+    wal=store_is_wal(context);
+    if (wal<0)
+        return -1;
+    if (wal) {
+#ifdef S3BD_SNAPSHOT
+        int status;
+
+        status=sqlite3_snapshot_get(
+            context->c.connection,"main",&pool->snapshot);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "Failed to get snapshot: %s",
+                sqlite3_errmsg(context->c.connection));
+            return -1;
+        }
+#else
+        errf(
+            &context->c,SQLITE_MISUSE,
+            "Parallel store of a WAL database needs snapshot support");
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+static char const rowid_span_sql_1[] =
+    "select min(";
+static char const rowid_span_sql_2[] =
+    "),max(";
+static char const rowid_span_sql_3[] =
+    ") from ";
+
+/*
+  Find an unshadowed rowid alias and the lowest and highest rowids
+  of a table.  Returns 1 if found, 0 for empty tables and wherever
+  table_rowid finds no alias.
+*/
+
+static int table_span(
+    store_context_t *context,
+    conststr_t tablename,
+    store_range_t *range)
+{
+    store_vt const *vt=context->vt;
+    sqlite3_stmt *get=NULL;
+    str_t sql;
+    int status;
+    int found=0;
+
+    switch (table_rowid(context,tablename,&range->rowid,NULL)) {
+    case -1:
+        return -1;
+    case 0:
+        return 0;
+    }
+    str_init(&sql,&context->c);
+    if ((*vt->str_app_7)(&sql,rowid_span_sql_1,sizeof rowid_span_sql_1-1))
+        goto cleanup;
+    if ((*vt->str_app_7)(&sql,range->rowid.text,range->rowid.size))
+        goto cleanup;
+    if ((*vt->str_app_7)(&sql,rowid_span_sql_2,sizeof rowid_span_sql_2-1))
+        goto cleanup;
+    if ((*vt->str_app_7)(&sql,range->rowid.text,range->rowid.size))
+        goto cleanup;
+    if ((*vt->str_app_7)(&sql,rowid_span_sql_3,sizeof rowid_span_sql_3-1))
+        goto cleanup;
+    if ((*vt->str_app_id)(&sql,tablename.text,tablename.size))
+        goto cleanup;
+    status=(*vt->prepare)(&context->c,sql.text,sql.size,&get);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While splitting tables: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    str_free(&sql);
+    for (;;) {
+        status=sqlite3_step(get);
+        if (status!=SQLITE_ROW)
+            break;
+        if (sqlite3_column_type(get,0)==SQLITE_INTEGER
+                && sqlite3_column_type(get,1)==SQLITE_INTEGER) {
+            range->first=sqlite3_column_int64(get,0);
+            range->last=sqlite3_column_int64(get,1);
+            found=1;
+        }
+    }
+    if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While splitting tables: sqlite3_step: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    sqlite3_finalize(get);
+    get=NULL;
+    return found;
+
+cleanup:
+    str_free(&sql);
+    if (get)
+        sqlite3_finalize(get);
+    return -1;
+}
+
+static store_job_t *add_job(
+    store_pool_t *pool,
+    conststr_t tablename)
+{
+    store_context_t *context=pool->main;
+    store_job_t *job;
+
+    if (pool->jobcnt>=pool->jobcap) {
+        size_t jobcap=pool->jobcap ? pool->jobcap*2 : 16;
+
+        job=crealloc(&context->c,pool->jobs,jobcap*sizeof *job);
+        if (!job)
+            return NULL;
+        pool->jobs=job;
+        pool->jobcap=jobcap;
+    }
+    job=&pool->jobs[pool->jobcnt++];
+    str_init(&job->name,&context->c);
+    job->ranged=0;
+    job->pool=pool;
+    job->spool=NULL;
+    job->spoolerr=0;
+    job->state=JOB_PENDING;
+    job->claimed=0;
+    job->live=0;
+    job->colcnt=0;
+    if (str8app(&job->name,tablename.text,tablename.size))
+        return NULL;
+    return job;
+}
+
+/*
+  Make one job for a table, or several if it's worth splitting.
+  The number of ranges is capped at a few per thread, so a sparse
+  rowid space doesn't give zillions of tiny jobs.
+*/
+
+static int add_table_jobs(
+    store_pool_t *pool,
+    conststr_t tablename)
+{
+    store_context_t *context=pool->main;
+    sqlite3_int64 split=context->params.split_rows;
+    store_range_t range;
+    sqlite3_uint64 span,step,rangecnt,rangeix;
+    store_job_t *job;
+    int found;
+
+    range.first=range.last=0;
+    if (split<0) {
+        found=0;
+    } else {
+        if (!split)
+            split=1048576;
+        found=table_span(context,tablename,&range);
+        if (found<0)
+            return -1;
+    }
+    if (found) {
+        span=(sqlite3_uint64)range.last-(sqlite3_uint64)range.first;
+        found=span>=(sqlite3_uint64)split;
+    }
+    if (!found) {
+        if (!add_job(pool,tablename))
+            return -1;
+        return 0;
+    }
+    rangecnt=span/split+1;
+    if (rangecnt>pool->threadcnt*4)
+        rangecnt=pool->threadcnt*4;
+    step=span/rangecnt+1;
+    rangecnt=span/step+1;
+    for (rangeix=0; rangeix<rangecnt; rangeix++) {
+        job=add_job(pool,tablename);
+        if (!job)
+            return -1;
+        job->ranged=1;
+        job->range.rowid=range.rowid;
+        job->range.first=(sqlite3_uint64)range.first+rangeix*step;
+        if (rangeix+1<rangecnt) {
+            job->range.last=(sqlite3_uint64)job->range.first+(step-1);
+        } else {
+            job->range.last=range.last;
+        }
+    }
+    return 0;
+}
+
+static int list_jobs(
+    store_pool_t *pool,
+    str_t *sequence)
+{
+    store_context_t *context=pool->main;
+    sqlite3_stmt *list_tables=NULL;
+    int status;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        table_names_sql, sizeof table_names_sql,
+        &list_tables,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While extracting schema: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    for (;;) {
+        conststr_t tablename;
+
+        status=sqlite3_step(list_tables);
+        if (status!=SQLITE_ROW)
+            break;
+        if ((*context->vt->column_text)(
+                &context->c,list_tables,0,&tablename))
+            goto cleanup;
+        if (sqlite3_column_int(list_tables,1)) {
+            if (str8app(sequence,tablename.text,tablename.size))
+                goto cleanup;
+            continue;
+        }
+        if (add_table_jobs(pool,tablename))
+            goto cleanup;
+    }
+    if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While extracting tables: sqlite3_step: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    sqlite3_finalize(list_tables);
+    list_tables=NULL;
+    return 0;
+
+cleanup:
+    if (list_tables)
+        sqlite3_finalize(list_tables);
+    return -1;
+}
+
+/*
+  The job to write next, if any is running or done: in ordered mode
+  the next in order, otherwise the claimed job until it's written,
+  then any finished one, then the first one running.  Called with the
+  pool lock held.
+*/
+
+static store_job_t *pick_job(
+    store_pool_t *pool,
+    size_t written)
+{
+    store_context_t *context=pool->main;
+    size_t jobix;
+
+    if (context->flags & S3BD_STORE_ORDERED)
+        return written<pool->nextjob ? &pool->jobs[written] : NULL;
+    for (jobix=0; jobix<pool->nextjob; jobix++) {
+        store_job_t *job=&pool->jobs[jobix];
+
+        if (job->claimed && job->state!=JOB_WRITTEN)
+            return job;
+    }
+    for (jobix=0; jobix<pool->nextjob; jobix++) {
+        if (pool->jobs[jobix].state==JOB_DONE)
+            return &pool->jobs[jobix];
+    }
+    for (jobix=0; jobix<pool->nextjob; jobix++) {
+        if (pool->jobs[jobix].state==JOB_PENDING)
+            return &pool->jobs[jobix];
+    }
+    return NULL;
+}
+
+/*
+  Write the jobs out until all are written or something fails: claim
+  the one to write next while it runs, and copy its spool once it's
+  finished if it didn't get to write to the output itself.  Nothing
+  else is written while a claimed job runs.  Runs with the pool lock
+  held except while writing.
+*/
+
+static int write_jobs(
+    store_pool_t *pool)
+{
+    store_context_t *context=pool->main;
+    size_t written=0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (written<pool->jobcnt) {
+        store_job_t *job=NULL;
+
+        while (!pool->abort) {
+            job=pick_job(pool,written);
+            if (job && job->state==JOB_DONE)
+                break;
+            if (job && !job->claimed) {
+                job->claimed=1;
+                job->offset=out_tell(context);
+            }
+            job=NULL;
+            if (!pool->running)
+                break;
+            pthread_cond_wait(&pool->done,&pool->lock);
+        }
+        if (!job)
+            break;
+        pthread_mutex_unlock(&pool->lock);
+        if (!job->live)
+            job->offset=out_tell(context);
+        if (job->colcnt>0) {
+            conststr_t name;
+
+            name.text=job->name.text;
+            name.size=job->name.size;
+            if (toc_add(
+                    context,name,job->colcnt,job->offset,
+                    job->rows,job->size)) {
+                pthread_mutex_lock(&pool->lock);
+                pool->abort=1;
+                break;
+            }
+        }
+        if (!job->live) {
+            if (copy_spool(context,job->spool)) {
+                pthread_mutex_lock(&pool->lock);
+                pool->abort=1;
+                break;
+            }
+            if (job->spool)
+                fclose(job->spool);
+            job->spool=NULL;
+        }
+        pthread_mutex_lock(&pool->lock);
+        if (!job->live)
+            pool->spooled--;
+        job->state=JOB_WRITTEN;
+        written++;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+    if (written<pool->jobcnt) {
+        if (context->c.status==SQLITE_OK
+                && pool->error.status==SQLITE_OK) {
+            errf(
+                &context->c,SQLITE_INTERNAL,
+                "Internal error: store workers quit early");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int run_pool(
+    store_pool_t *pool)
+{
+    store_context_t *context=pool->main;
+    pthread_t *threads;
+    unsigned int threadcnt,threadix;
+    int failed;
+
+    threadcnt=pool->threadcnt;
+    if (threadcnt>pool->jobcnt)
+        threadcnt=pool->jobcnt;
+    threads=cmalloc(&context->c,threadcnt*sizeof *threads);
+    if (!threads)
+        return -1;
+    if (pthread_mutex_init(&pool->lock,NULL)) {
+        sqlite3_free(threads);
+        context->c.status=SQLITE_NOMEM;
+        return -1;
+    }
+    if (pthread_cond_init(&pool->done,NULL)) {
+        pthread_mutex_destroy(&pool->lock);
+        sqlite3_free(threads);
+        context->c.status=SQLITE_NOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (threadix=0; threadix<threadcnt; threadix++) {
+        if (pthread_create(&threads[threadix],NULL,store_worker,pool))
+            break;
+        pool->running++;
+    }
+    threadcnt=threadix;
+    pthread_mutex_unlock(&pool->lock);
+    if (threadcnt>0) {
+        failed=write_jobs(pool);
+    } else {
+        errf(
+            &context->c,SQLITE_ERROR,
+            "Failed to start worker threads");
+        failed=-1;
+    }
+    for (threadix=0; threadix<threadcnt; threadix++) {
+        pthread_join(threads[threadix],NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    sqlite3_free(threads);
+    move_error(&context->c,&pool->error);
+    if (failed || context->c.status!=SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+static void pool_free(
+    store_pool_t *pool)
+{
+    size_t jobix;
+
+    for (jobix=0; jobix<pool->jobcnt; jobix++) {
+        store_job_t *job=&pool->jobs[jobix];
+
+        str_free(&job->name);
+        if (job->spool)
+            fclose(job->spool);
+    }
+    if (pool->jobs)
+        sqlite3_free(pool->jobs);
+    pool->jobs=NULL;
+    pool->jobcnt=0;
+#ifdef S3BD_SNAPSHOT
+    if (pool->snapshot) {
+        sqlite3_snapshot_free(pool->snapshot);
+        pool->snapshot=NULL;
+    }
+#endif
+    context_term(&pool->error,NULL);
+}
+
+static int store_tables_parallel(
+    store_context_t *context)
+{
+    store_pool_t pool;
+    str_t sequence;
+    str_t sql;
+
+    memset(&pool,0,sizeof pool);
+    pool.main=context;
+    str_init(&sequence,&context->c);
+    str_init(&sql,&context->c);
+    if (context_init(&pool.error,NULL)) {
+        context->c.status=SQLITE_NOMEM;
+        return -1;
+    }
+    pool.threadcnt=context->params.threads;
+    if (!pool.threadcnt) {
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+
+        pool.threadcnt=cpus>0 ? cpus : 1;
+    }
+    if (pool_pin(&pool))
+        goto cleanup;
+    if (list_jobs(&pool,&sequence))
+        goto cleanup;
+    if (pool.jobcnt>0 && run_pool(&pool))
+        goto cleanup;
+    if (sequence.size>0) {
+        conststr_t tablename;
+
+        tablename.text=sequence.text;
+        tablename.size=sequence.size;
+        if (store_table(context,tablename,NULL,&sql))
+            goto cleanup;
+    }
+    str_free(&sql);
+    str_free(&sequence);
+    pool_free(&pool);
+    return 0;
+
+cleanup:
+    str_free(&sql);
+    str_free(&sequence);
+    pool_free(&pool);
+    return -1;
+}
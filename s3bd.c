@@ -1,6 +1,35 @@
+#ifdef S3BD_URING
+/* For O_DIRECT */
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#ifdef S3BD_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef S3BD_ZSTD
+#include <zstd.h>
+#endif
+#ifdef S3BD_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #include "s3bd.h"
 #include "s3bdformat.h"
@@ -15,6 +44,14 @@
 #include "context.c"
 #include "str.c"
 #include "endian.c"
+#include "crc32c.c"
+#include "sha256.c"
+#include "blobstore.c"
+#include "uring.c"
+#include "codec.c"
+#include "symtab.c"
 #include "store.c"
+#include "parstore.c"
 #include "load.c"
+#include "parload.c"
 
@@ -36,13 +36,267 @@ extern int s3bd_store(
     char **errmsg);
 
 
+/*
+  s3bd_store_ex is s3bd_store with tuning parameters.  Passing NULL
+  for params is the same as calling s3bd_store.  Otherwise, zero-fill
+  the structure and set the fields you care about; zero means "default".
+
+  S3BD_STORE_PARALLEL means to extract table contents on worker threads,
+  each using its own read-only connection to the database file.
+  The workers see exactly what the main connection sees: in WAL mode
+  through sqlite3_snapshot_open (which needs an SQLite built with
+  SQLITE_ENABLE_SNAPSHOT and this code built with S3BD_SNAPSHOT),
+  otherwise because the main connection's read lock keeps writers out.
+  Can't be combined with S3BD_STORE_IN_TRANSACTION, since the workers
+  can't see uncommitted changes.
+
+  A parallel store also splits big rowid tables into rowid ranges
+  that are extracted separately, giving several rowsets with the same
+  table name.
+
+  One rowset at a time goes straight to the output.  Those finished
+  meanwhile wait in temporary files (from tmpfile, so usually in
+  $TMPDIR or /tmp) and are copied over in turn, which writes and reads
+  them once more.  Workers don't start new rowsets while as many are
+  waiting as there are threads, so the temporary space needed is up
+  to about two rowsets per thread; a table that isn't split, such as
+  a WITHOUT ROWID table, is a single rowset however big it is.
+
+  The workers wait up to 10 seconds for their read locks.  With
+  a rollback journal, another connection waiting to write keeps them
+  out, and the store then fails with SQLITE_BUSY.
+
+  S3BD_STORE_ORDERED means to write the rowsets of a parallel store
+  in catalog and rowid order rather than in the order the workers
+  finish them.
+
+  S3BD_STORE_PIPELINE means to step each table's statement on one
+  thread while another encodes and writes the rows, with a few batches
+  of rows in flight between them.  Combines with S3BD_STORE_PARALLEL
+  (every worker then gets its own writer thread).
+
+  S3BD_STORE_URING means to write the dump through io_uring, keeping
+  several large writes in flight.  It needs a build with S3BD_URING
+  and an output file that is a regular file or a block device; otherwise
+  the flag is ignored.  Output files opened with O_DIRECT work too.
+
+  S3BD_STORE_TOC means to end the dump with a table of contents
+  listing every rowset; see s3bd_read_toc.
+
+  S3BD_STORE_COLUMNAR means to lay out the blocks of each rowset column
+  by column, with integers delta or frame-of-reference encoded and
+  bit-packed, and floats XORed with their predecessor.  This is usually
+  smaller and faster to load, especially for ids, timestamps and other
+  integers that are close to each other, and for slowly changing
+  measurements.
+
+  S3BD_STORE_SYMBOLS means to code text values with a symbol
+  table learned from each rowset's first text values, which shrinks
+  text with recurring fragments (URLs, paths, log lines, names) without
+  a compressed container, and keeps every value decodable on its own.
+
+  S3BD_STORE_DEDUP means to store blobs of 256 bytes or more that
+  occur again in the dump, in any table, only the first time, and
+  refer back to them after that.  Storing keeps up to 64 MiB of recent
+  blobs in memory to find the repeats, and so does loading to resolve
+  the references.  With S3BD_STORE_PARALLEL, only repeats within the
+  same rowset are found.
+
+  S3BD_STORE_TYPED means to declare the column types of STRICT tables
+  in their rowsets, so that values of the declared type go in rows
+  without a marker, with only their width in a 4-bit code.  Rows come
+  out smaller and load faster, particularly with narrow numbers.
+  Columnar blocks don't need this and are unaffected.
+
+  threads       number of worker threads (default: online CPUs)
+  split_rows    rowid span per range when splitting a table
+                (default 1048576; negative means never split)
+  stats         if not NULL, receives counters when the store returns
+  codec         if not 0, write a compressed container using this codec
+                (S3BD_CODEC_ZSTD or S3BD_CODEC_LZ4; the code must be built
+                with S3BD_ZSTD or S3BD_LZ4 respectively)
+  level         compression level (default: the codec's default)
+  zthreads      number of compression threads (default: online CPUs;
+                1 means to compress on the thread that writes)
+  blob_store    if not NULL, the directory of a blob store to put big blobs
+                in, named by their SHA-256, instead of in the dump, which
+                then only has their sizes and hashes (see BLOB STORE
+                in format.txt); the directory must exist
+  blob_store_min  size from which blobs go in the blob store
+                (default 65536)
+  stream_min    size from which blobs are streamed: read from the database
+                with sqlite3_blob_read and written to the dump in chunks
+                of 1 MiB, so that they are never in memory whole
+                (default 16777216; see STREAMED BLOBS in format.txt).
+                Only columns of rowid tables declared BLOB (or ANY
+                in STRICT tables) are streamed.  With a blob store,
+                streamed blobs of blob_store_min bytes or more still go
+                in it: they are written to it in the same chunks and
+                hashed on the way.
+                Streaming takes precedence over deduplication: streamed
+                blobs are never deduplicated
+  mem_budget    if not 0, the most memory in bytes that SQLite, and this
+                library, which allocates through SQLite, may have in use
+                during the call; see below
+
+  A memory budget sets a hard heap limit of that size, and a soft one
+  at three quarters of it, with sqlite3_hard_heap_limit64 and
+  sqlite3_soft_heap_limit64.  These are process-wide, so everything
+  else the process allocates from SQLite in the meantime counts too,
+  and they are put back as they were when the call returns.  For the
+  same reason, only one call at a time may have a budget; while one is
+  in progress, others with a budget fail with SQLITE_MISUSE.  A store
+  also streams blobs from a sixteenth of the budget if that is less
+  than stream_min.  Those of blob_store_min bytes or more still go in
+  a blob store, if there is one, but like all streamed blobs they are
+  no longer deduplicated.  Going over the budget fails the call cleanly
+  with SQLITE_NOMEM rather than paging or getting the process killed.
+  Memory that SQLite doesn't allocate, such as the state of compression
+  codecs and io_uring buffers, isn't counted.  Budgets under 16 MiB
+  leave little room for the buffers of pipelining and deduplication.
+  S3BD_STORE_URING is ignored for compressed containers.
+
+  The counters: rows is the number of rows stored.  full_waits and
+  full_wait_ns count how often and how long the stepping side of a
+  pipelined store waited for the writer (the output is the bottleneck);
+  empty_waits and empty_wait_ns count the reverse (SQLite is).
+*/
+
+#define S3BD_STORE_PARALLEL		0x4
+#define S3BD_STORE_ORDERED		0x8
+#define S3BD_STORE_PIPELINE		0x10
+#define S3BD_STORE_URING		0x20
+#define S3BD_STORE_TOC			0x40
+#define S3BD_STORE_COLUMNAR		0x80
+#define S3BD_STORE_SYMBOLS		0x100
+#define S3BD_STORE_DEDUP		0x200
+#define S3BD_STORE_TYPED		0x400
+
+typedef struct s3bd_store_stats_t {
+    sqlite3_uint64 rows;
+    sqlite3_uint64 full_waits;
+    sqlite3_uint64 full_wait_ns;
+    sqlite3_uint64 empty_waits;
+    sqlite3_uint64 empty_wait_ns;
+} s3bd_store_stats_t;
+
+#define S3BD_CODEC_ZSTD			1
+#define S3BD_CODEC_LZ4			2
+
+typedef struct s3bd_store_params_t {
+    unsigned int threads;
+    sqlite3_int64 split_rows;
+    s3bd_store_stats_t *stats;
+    unsigned int codec;
+    int level;
+    unsigned int zthreads;
+    char const *blob_store;
+    size_t blob_store_min;
+    size_t stream_min;
+    size_t mem_budget;
+} s3bd_store_params_t;
+
+extern int s3bd_store_ex(
+    sqlite3 *connection,
+    FILE *outfile,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
+/*
+  s3bd_store_io is s3bd_store_ex with the output going to a callback
+  instead of a file.  The write callback gets the dump in order, mostly
+  as whole buffers; values of 64 KiB or more come straight from SQLite
+  as separate pieces.  The data pointer is only valid during the call.
+  Return SQLITE_OK, or an error code to abort the store.
+  S3BD_STORE_URING is ignored.
+*/
+
+typedef struct s3bd_store_io_t {
+    int (*write)(
+        void *arg,
+        void const *data,
+        size_t size);
+    void *arg;
+} s3bd_store_io_t;
+
+extern int s3bd_store_io(
+    sqlite3 *connection,
+    s3bd_store_io_t const *io,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
+/*
+  s3bd_store_mem is s3bd_store_ex with the dump going into memory.
+  On success, *dump points to it (caller must sqlite3_free) and *size
+  is its length; on failure, they are NULL and 0.
+  S3BD_STORE_URING is ignored.
+*/
+
+extern int s3bd_store_mem(
+    sqlite3 *connection,
+    void **dump,
+    size_t *size,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
 /*
   s3bd_load reads a dump file and returns an SQLite3 status code.
   Optionally returns an error message string (caller must sqlite3_free).
   The destination database must be freshly created and untouched.
+  Compressed containers are recognized and unpacked automatically.
 
   S3BD_LOAD_SCHEMA_ONLY means to omit the actual table contents.
 
+  S3BD_LOAD_URING means to read the dump through io_uring, keeping
+  several large reads in flight ahead of the decoder.  The same
+  conditions as for S3BD_STORE_URING apply, and infile must be
+  seekable; other files are read as usual.
+
+  S3BD_LOAD_PARALLEL means to check and decode the blocks of each rowset
+  on worker threads, so that the connection's thread does little else
+  than bind and step.  Rows are still inserted in dump order.  Dumps
+  older than format 0.1 have no blocks and load serially regardless.
+
+  S3BD_LOAD_PIPELINE means to read the blocks of each table on a thread
+  of their own, which also decodes them unless S3BD_LOAD_PARALLEL
+  is given, while the connection's thread only binds and steps.
+  A few blocks' worth of decoded rows are in flight between them.
+  This overlaps reading, from a pipe for instance, with inserting
+  even on a single core to spare.  With caller-supplied I/O, the read
+  callback is then called on the reader thread.
+
+  S3BD_LOAD_MMAP means to map infile into memory if it's a regular
+  file, and to load from the mapping as s3bd_load_mem does, so that text
+  and blob values go from the page cache to SQLite without a copy
+  (except byte-swapped UTF-16 text and compressed containers).  Pages
+  well behind the decoder are unmapped again, keeping 32 MiB or, if
+  less, an eighth of mem_budget (see s3bd_load_ex).  The file must not
+  shrink during the load; accessing the mapping beyond its new end
+  raises SIGBUS.  bufsize and S3BD_LOAD_URING are ignored for a mapped
+  file.  Other files are read as usual.
+
+  If infile is seekable, the dump is read from the file descriptor
+  underneath it in large pieces, and anything read past its end is
+  given back by seeking.  Other files, such as pipes, are read through
+  stdio, which takes nothing out of the stream beyond the end of the
+  dump (or of its compressed container), so the caller can go on
+  reading after it.
+
+  Streamed blobs go into the database the same way they came out, in
+  chunks, with sqlite3_blob_write.  Each goes in as a zeroblob first,
+  which SQLite only keeps from being allocated when nothing but NULLs
+  and zeroblobs follow it in the row, so memory stays flat for big
+  blobs in a table's last columns.
+
   The list of pragma overrides must be terminated by a NULL pointer.
   Each string in the list must look like either "name=value" to replace
   a pragma value or just "name" to omit it.  Unknown names are ignored;
@@ -50,6 +304,10 @@ extern int s3bd_store(
 */
 
 #define S3BD_LOAD_SCHEMA_ONLY		0x1
+#define S3BD_LOAD_URING			0x2
+#define S3BD_LOAD_PARALLEL		0x4
+#define S3BD_LOAD_MMAP			0x8
+#define S3BD_LOAD_PIPELINE		0x10
 
 extern int s3bd_load(
     sqlite3 *connection,
@@ -58,5 +316,140 @@ extern int s3bd_load(
     char const * const *overrides,
     char **errmsg);
 
-#endif
 
+/*
+  s3bd_load_ex is s3bd_load with tuning parameters.  Passing NULL
+  for params is the same as calling s3bd_load.  Otherwise, zero-fill
+  the structure and set the fields you care about; zero means "default".
+
+  bufsize       size of the input buffer, i.e. the most asked for
+                in one read (default 262144)
+  threads       number of decoder threads for S3BD_LOAD_PARALLEL
+                (default: online CPUs)
+  blob_store    the directory of the blob store that the dump's big blobs
+                were put in, if they were
+  mem_budget    if not 0, a memory budget in bytes as for s3bd_store_ex;
+                a load also sizes the page cache to a quarter of it,
+                with cache_spill on, so that dirty pages go to disk
+                steadily once the cache is full, and holds
+                no more than another quarter of it in blocks waiting
+                for the decoder threads
+  stats         if not NULL, receives counters when the load returns
+
+  The counters: rows is the number of table rows loaded.  full_waits
+  and full_wait_ns count how often and how long the reader thread of
+  a pipelined load waited for room for more blocks (inserting is the
+  bottleneck: SQLite, its B-trees and the disk behind them);
+  empty_waits and empty_wait_ns count how often and how long inserting
+  waited for decoded rows, in a pipelined or parallel load (reading
+  or decoding is).
+*/
+
+typedef struct s3bd_load_stats_t {
+    sqlite3_uint64 rows;
+    sqlite3_uint64 full_waits;
+    sqlite3_uint64 full_wait_ns;
+    sqlite3_uint64 empty_waits;
+    sqlite3_uint64 empty_wait_ns;
+} s3bd_load_stats_t;
+
+typedef struct s3bd_load_params_t {
+    size_t bufsize;
+    unsigned int threads;
+    char const *blob_store;
+    size_t mem_budget;
+    s3bd_load_stats_t *stats;
+} s3bd_load_params_t;
+
+extern int s3bd_load_ex(
+    sqlite3 *connection,
+    FILE *infile,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
+/*
+  s3bd_load_io is s3bd_load_ex with the input coming from a callback
+  instead of a file.  The read callback fills the library's input buffer
+  directly: it gets up to size bytes of room at data, stores the number
+  of bytes it produced in *got (0 only at EOF) and returns SQLITE_OK,
+  or returns an error code to abort the load.  Whatever it delivers
+  past the end of the dump is dropped.  S3BD_LOAD_URING is ignored.
+*/
+
+typedef struct s3bd_load_io_t {
+    int (*read)(
+        void *arg,
+        void *data,
+        size_t size,
+        size_t *got);
+    void *arg;
+} s3bd_load_io_t;
+
+extern int s3bd_load_io(
+    sqlite3 *connection,
+    s3bd_load_io_t const *io,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
+/*
+  s3bd_load_mem is s3bd_load_ex with the dump coming from memory.
+  Text and blob values are bound directly from the dump instead of
+  being copied, so it must stay put until the load returns.
+  bufsize and S3BD_LOAD_URING are ignored.
+*/
+
+extern int s3bd_load_mem(
+    sqlite3 *connection,
+    void const *dump,
+    size_t size,
+    unsigned int flags,
+    s3bd_load_params_t const *params,
+    char const * const *overrides,
+    char **errmsg);
+
+
+
+/*
+  s3bd_read_toc reads the table of contents of a dump stored with
+  S3BD_STORE_TOC.  infile must be positioned at the start of the dump,
+  which must be the last thing in the file, and the file must be
+  seekable; the position is left alone.  Returns SQLITE_NOTFOUND if
+  there is no table of contents (or it's in a compressed container).
+  On success, *toc must be freed with s3bd_free_toc.
+
+  There is one entry per rowset, in dump order, starting with the
+  "pragmas" and "schema" pseudo-tables.  Names are converted to UTF-8
+  from UTF-16 dumps.  offset is counted from the start of the dump
+  and size includes the rowset's markers.
+*/
+
+typedef struct s3bd_toc_entry_t {
+    char *name;
+    size_t namesize;
+    sqlite3_uint64 offset;
+    sqlite3_uint64 rows;
+    sqlite3_uint64 size;
+    unsigned int colcnt;
+} s3bd_toc_entry_t;
+
+typedef struct s3bd_toc_t {
+    s3bd_toc_entry_t *entries;
+    size_t count;
+    unsigned int encoding;
+} s3bd_toc_t;
+
+extern int s3bd_read_toc(
+    FILE *infile,
+    s3bd_toc_t **toc,
+    char **errmsg);
+
+extern void s3bd_free_toc(
+    s3bd_toc_t *toc);
+
+#endif
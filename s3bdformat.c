@@ -3,6 +3,12 @@
 unsigned char const s3bd_header_magic[5] =
     "S3BD\x1A";
 
+unsigned char const s3bd_zheader_magic[5] =
+    "S3BZ\x1A";
+
+unsigned char const s3bd_toc_magic[4] =
+    "S3BT";
+
 unsigned char const s3bd_id8_pragmas[7] =
     "pragmas";
 
@@ -17,10 +17,25 @@ typedef struct s3bd_header_t {
 } s3bd_header_t;
 
 #define CURVER_MAJOR	0
-#define CURVER_MINOR	0
+#define CURVER_MINOR	11
 
 extern unsigned char const s3bd_header_magic[5];
 
+typedef struct s3bd_zheader_t {
+    unsigned char magic[5];
+    unsigned char ver_major;
+    unsigned char ver_minor;
+    unsigned char codec;
+} s3bd_zheader_t;
+
+#define ZCURVER_MAJOR	0
+#define ZCURVER_MINOR	0
+
+#define ZCODEC_ZSTD	1
+#define ZCODEC_LZ4	2
+
+extern unsigned char const s3bd_zheader_magic[5];
+
 extern unsigned char const s3bd_id8_pragmas[7];
 
 extern unsigned short const s3bd_id16_pragmas[7];
@@ -44,33 +59,161 @@ extern unsigned short const s3bd_id16_schema[6];
 #define NULLCOL()	BASE9(0,0,0)
 #define ENDSET()	BASE9(0,0,1)
 #define ENDDUMP()	BASE9(0,0,2)
+#define BLOCK()		BASE9(0,0,3)
+#define TOC()		BASE9(0,0,4)
+#define COLBLOCK()	BASE9(0,0,5)
+#define SAMECOL()	BASE9(0,0,6)
+#define NULLMAP()	BASE9(0,0,7)
+#define SYMTAB()	BASE9(0,0,8)
+
+#define DICTREF(iw)	BASE9(0,1,iw)
+#define DICT(cw)	BASE9(0,2,cw)
+#define SYMCOL(csw)	BASE9(0,3,csw)
+#define SHARECOL(bsw)	BASE9(0,4,bsw)
+#define BLOBREF(iw)	BASE9(0,5,iw)
+#define HASHCOL(bsw)	BASE9(0,6,bsw)
+#define TYPES(cw)	BASE9(0,7,cw)
+#define STREAMCOL(bsw)	BASE9(0,8,bsw)
 
 #define INTCOL(iw)	BASE9(1,0,iw)
 #define FLOATCOL(fw)	BASE9(1,1,fw)
 #define TEXTCOL(tsw)	BASE9(1,2,tsw)
 #define BLOBCOL(bsw)	BASE9(1,3,bsw)
 
+#define NULLRUN(cw)	BASE9(1,4,cw)
+#define INTRUN(cw)	BASE9(1,5,cw)
+#define FLOATRUN(cw)	BASE9(1,6,cw)
+#define TEXTRUN(cw)	BASE9(1,7,cw)
+#define BLOBRUN(cw)	BASE9(1,8,cw)
+
 #define ROWSET(ccw,nsw) BASE9(2,ccw,nsw)
 
+#define STREAM(csw)	BASE9(3,0,csw)
+
 #define is_NULLCOL(m)	((m)==NULLCOL())
 #define is_ENDSET(m)	((m)==ENDSET())
 #define is_ENDDUMP(m)	((m)==ENDDUMP())
+#define is_BLOCK(m)	((m)==BLOCK())
+#define is_TOC(m)	((m)==TOC())
+#define is_COLBLOCK(m)	((m)==COLBLOCK())
+#define is_SAMECOL(m)	((m)==SAMECOL())
+#define is_NULLMAP(m)	((m)==NULLMAP())
+#define is_SYMTAB(m)	((m)==SYMTAB())
+
+#define is_DICTREF(m)	((m)>=DICTREF(0) && (m)<=DICTREF(8))
+#define is_DICT(m)	((m)>=DICT(0) && (m)<=DICT(8))
+#define is_SYMCOL(m)	((m)>=SYMCOL(0) && (m)<=SYMCOL(8))
+#define is_SHARECOL(m)	((m)>=SHARECOL(0) && (m)<=SHARECOL(8))
+#define is_BLOBREF(m)	((m)>=BLOBREF(0) && (m)<=BLOBREF(8))
+#define is_HASHCOL(m)	((m)>=HASHCOL(0) && (m)<=HASHCOL(8))
+#define is_TYPES(m)	((m)>=TYPES(0) && (m)<=TYPES(8))
+#define is_STREAMCOL(m)	((m)>=STREAMCOL(0) && (m)<=STREAMCOL(8))
 
 #define is_INTCOL(m)	((m)>=INTCOL(0) && (m)<=INTCOL(8))
 #define is_FLOATCOL(m)	((m)>=FLOATCOL(0) && (m)<=FLOATCOL(8))
 #define is_TEXTCOL(m)	((m)>=TEXTCOL(0) && (m)<=TEXTCOL(8))
 #define is_BLOBCOL(m)	((m)>=BLOBCOL(0) && (m)<=BLOBCOL(8))
 
+#define is_NULLRUN(m)	((m)>=NULLRUN(0) && (m)<=NULLRUN(8))
+#define is_INTRUN(m)	((m)>=INTRUN(0) && (m)<=INTRUN(8))
+#define is_FLOATRUN(m)	((m)>=FLOATRUN(0) && (m)<=FLOATRUN(8))
+#define is_TEXTRUN(m)	((m)>=TEXTRUN(0) && (m)<=TEXTRUN(8))
+#define is_BLOBRUN(m)	((m)>=BLOBRUN(0) && (m)<=BLOBRUN(8))
+
 #define is_ROWSET(m)	((m)>=ROWSET(0,0) && (m)<=ROWSET(8,8))
 
+#define is_STREAM(m)	((m)>=STREAM(0) && (m)<=STREAM(8))
+
 #define INTCOL_iw(m)	((m)%9)
 #define FLOATCOL_fw(m)	((m)%9)
 #define TEXTCOL_tsw(m)	((m)%9)
 #define BLOBCOL_bsw(m)	((m)%9)
+#define DICTREF_iw(m)	((m)%9)
+#define DICT_cw(m)	((m)%9)
+#define SYMCOL_csw(m)	((m)%9)
+#define SHARECOL_bsw(m)	((m)%9)
+#define BLOBREF_iw(m)	((m)%9)
+#define HASHCOL_bsw(m)	((m)%9)
+#define TYPES_cw(m)	((m)%9)
+#define STREAMCOL_bsw(m) ((m)%9)
+#define STREAM_csw(m)	((m)%9)
 
 #define ROWSET_ccw(m)	((m)/9%9)
 #define ROWSET_nsw(m)	((m)%9)
 
+#define RUN_cw(m)	((m)%9)
+
+/*
+  What follows a BLOCK marker: payload size, row count and CRC-32C
+  of the payload, each a 32-bit big-endian unsigned integer.
+*/
+
+#define BLOCK_HEADER_SIZE	12
+
+/*
+  The most values (rows times columns) a columnar block may hold.
+*/
+
+#define COLBLOCK_VALUES		65536
+
+/*
+  The most entries the dictionary of a rowset may hold.
+*/
+
+#define DICT_ENTRIES		16384
+
+/*
+  How far back shared blob references may reach: the most shared blobs,
+  and the most bytes of them, from the one referred to on.
+*/
+
+#define SHARED_ENTRIES		65536
+#define SHARED_WINDOW		67108864
+
+/*
+  The codes in the header of a typed row besides value widths 0 to 8.
+*/
+
+#define TYPED_NULL		9
+#define TYPED_SAME		10
+#define TYPED_COLUMN		11
+
+/*
+  The biggest chunk a stream record may carry.
+*/
+
+#define STREAM_CHUNK_MAX	16777216
+
+/*
+  Integer sequence encodings, and the value encodings of runs
+  in a columnar block.
+*/
+
+#define INTSEQ_FOR		0
+#define INTSEQ_DELTA		1
+
+#define FLOATRUN_PLAIN		0
+#define FLOATRUN_XOR		1
+#define TEXTRUN_PLAIN		0
+#define TEXTRUN_DICT		1
+#define TEXTRUN_SYMBOLS		2
+#define BLOBRUN_PLAIN		0
+#define BLOBRUN_SHARED		1
+#define BLOBRUN_REF		2
+#define BLOBRUN_HASH		3
+
+/*
+  What follows a TOC marker: the size of the entries as a 32-bit
+  big-endian unsigned integer, the entries, and the footer.
+  The footer holds the offset of the TOC marker from the start
+  of the dump (64 bits), the size of the entries and their CRC-32C
+  (32 bits each, all big-endian), and a magic string.
+*/
+
+#define TOC_FOOTER_SIZE		20
+
+extern unsigned char const s3bd_toc_magic[4];
+
 extern sqlite3_uint64 const s3bd_uint_bias[9];
 
 extern sqlite3_uint64 const s3bd_sint_bias[9];
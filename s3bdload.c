@@ -9,9 +9,18 @@ static void usage(void)
 {
     fputs(
         "Usage: s3bdload [ options ] dbfile [ pragma_override ... ]\n"
+        "       s3bdload -l [ -i infile ]\n"
         "  options:\n"
         "    -i infile   # default is stdin\n"
         "    -s          # schema only\n"
+        "    -u          # read through io_uring\n"
+        "    -r          # read the dump file instead of mapping it\n"
+        "    -j threads  # decode blocks in parallel\n"
+        "    -p          # pipeline reading and decoding with inserting\n"
+        "    -v          # report row count and pipeline stalls\n"
+        "    -b dir      # blob store the dump's big blobs are in\n"
+        "    -M bytes    # memory budget\n"
+        "    -l          # list the table of contents instead\n"
         "  overrides:\n"
         "    name=value  # replace\n"
         "    name        # delete\n",
@@ -19,6 +28,39 @@ static void usage(void)
     exit(1);
 }
 
+static int list_toc(
+    FILE *infile)
+{
+    s3bd_toc_t *toc;
+    char *errmsg=NULL;
+    size_t ix;
+    int status;
+
+    status=s3bd_read_toc(infile,&toc,&errmsg);
+    if (status!=SQLITE_OK) {
+        if (errmsg) {
+            fprintf(stderr,"s3bd_read_toc: %s\n",errmsg);
+            sqlite3_free(errmsg);
+        } else {
+            fprintf(stderr,"s3bd_read_toc: %s\n",sqlite3_errstr(status));
+        }
+        return 1;
+    }
+    sqlite3_free(errmsg);
+    printf("%12s %12s %12s %6s  %s\n","offset","size","rows","cols","name");
+    for (ix=0; ix<toc->count; ix++) {
+        s3bd_toc_entry_t const *entry=&toc->entries[ix];
+
+        printf("%12llu %12llu %12llu %6u  %s\n",
+               (unsigned long long)entry->offset,
+               (unsigned long long)entry->size,
+               (unsigned long long)entry->rows,
+               entry->colcnt,entry->name);
+    }
+    s3bd_free_toc(toc);
+    return 0;
+}
+
 int main(
     int argc,
     char **argv)
@@ -28,13 +70,21 @@ int main(
     char *errmsg=NULL;
     char *inpath=NULL;
     unsigned int flags=0;
+    s3bd_load_params_t params;
+    s3bd_load_stats_t stats;
+    int verbose=0;
+    int list=0;
+    int map=1;
     char const * const *overrides;
     FILE *infile;
 
+    memset(&params,0,sizeof params);
+    memset(&stats,0,sizeof stats);
+    params.stats=&stats;
     for (;;) {
         int c;
 
-        c=getopt(argc,argv,"si:");
+        c=getopt(argc,argv,"si:urlj:pvb:M:");
         if (c==-1)
             break;
         switch (c) {
@@ -44,14 +94,42 @@ int main(
         case 's':
             flags|=S3BD_LOAD_SCHEMA_ONLY;
             break;
+        case 'u':
+            flags|=S3BD_LOAD_URING;
+            map=0;
+            break;
+        case 'r':
+            map=0;
+            break;
+        case 'l':
+            list=1;
+            break;
+        case 'j':
+            flags|=S3BD_LOAD_PARALLEL;
+            params.threads=atoi(optarg);
+            break;
+        case 'p':
+            flags|=S3BD_LOAD_PIPELINE;
+            break;
+        case 'v':
+            verbose=1;
+            break;
+        case 'b':
+            params.blob_store=optarg;
+            break;
+        case 'M':
+            params.mem_budget=strtoull(optarg,NULL,10);
+            break;
         default:
             usage();
         }
     }
     argc-=optind;
     argv+=optind;
-    if (argc<1)
+    if (argc<(list ? 0 : 1))
         usage();
+    if (map)
+        flags|=S3BD_LOAD_MMAP;
     if (inpath) {
         infile=fopen(inpath,"r");
         if (!infile) {
@@ -62,6 +140,8 @@ int main(
     } else {
         infile=stdin;
     }
+    if (list)
+        return list_toc(infile);
     if (argc>1) {
         overrides=(char const * const *)argv+1;
     } else {
@@ -83,7 +163,7 @@ int main(
         }
         return 1;
     }
-    status=s3bd_load(connection,infile,flags,overrides,&errmsg);
+    status=s3bd_load_ex(connection,infile,flags,&params,overrides,&errmsg);
     sqlite3_close(connection);
     if (status!=SQLITE_OK) {
         if (errmsg) {
@@ -94,6 +174,17 @@ int main(
         }
         return 1;
     }
+    if (verbose) {
+        fprintf(stderr,"rows: %llu\n",(unsigned long long)stats.rows);
+        if (flags & (S3BD_LOAD_PIPELINE | S3BD_LOAD_PARALLEL))
+            fprintf(stderr,
+                    "reader waited for inserter: %llu times, %.3f s\n"
+                    "inserter waited for reader: %llu times, %.3f s\n",
+                    (unsigned long long)stats.full_waits,
+                    stats.full_wait_ns/1e9,
+                    (unsigned long long)stats.empty_waits,
+                    stats.empty_wait_ns/1e9);
+    }
     return 0;
 }
 
@@ -12,6 +12,22 @@ static void usage(void)
         "  options:\n"
         "    -o outfile  # default is stdout\n"
         "    -s          # schema only\n"
+        "    -j threads  # extract tables in parallel, spooling to $TMPDIR\n"
+        "    -O          # with -j, keep tables in catalog order\n"
+        "    -p          # pipeline row extraction and output\n"
+        "    -v          # report row count and pipeline stalls\n"
+        "    -u          # write through io_uring\n"
+        "    -t          # append a table of contents\n"
+        "    -c          # columnar blocks\n"
+        "    -y          # code text with per-table symbol tables\n"
+        "    -d          # store repeated blobs only once\n"
+        "    -T          # declare column types of STRICT tables\n"
+        "    -b dir      # put big blobs in a blob store\n"
+        "    -B bytes    # with -b, blob size from which to (default 65536)\n"
+        "    -S bytes    # blob size from which to stream (default 16777216)\n"
+        "    -M bytes    # memory budget\n"
+        "    -z          # compress (zstd if available, else lz4)\n"
+        "    -Z codec[:level]  # compress with zstd or lz4\n"
         "  overrides:\n"
         "    name=value  # replace\n"
         "    name        # delete\n",
@@ -19,6 +35,33 @@ static void usage(void)
     exit(1);
 }
 
+#if defined S3BD_ZSTD
+static unsigned int const default_codec=S3BD_CODEC_ZSTD;
+#else
+static unsigned int const default_codec=S3BD_CODEC_LZ4;
+#endif
+
+static int parse_codec(
+    char const *arg,
+    s3bd_store_params_t *params)
+{
+    char const *colon;
+    size_t len;
+
+    colon=strchr(arg,':');
+    len=colon ? (size_t)(colon-arg) : strlen(arg);
+    if (len==4 && !memcmp(arg,"zstd",4)) {
+        params->codec=S3BD_CODEC_ZSTD;
+    } else if (len==3 && !memcmp(arg,"lz4",3)) {
+        params->codec=S3BD_CODEC_LZ4;
+    } else {
+        return -1;
+    }
+    if (colon)
+        params->level=atoi(colon+1);
+    return 0;
+}
+
 int main(
     int argc,
     char **argv)
@@ -28,13 +71,19 @@ int main(
     char *errmsg=NULL;
     char *outpath=NULL;
     unsigned int flags=0;
+    s3bd_store_params_t params;
+    s3bd_store_stats_t stats;
+    int verbose=0;
     char const * const *overrides;
     FILE *outfile;
 
+    memset(&params,0,sizeof params);
+    memset(&stats,0,sizeof stats);
+    params.stats=&stats;
     for (;;) {
         int c;
 
-        c=getopt(argc,argv,"so:");
+        c=getopt(argc,argv,"so:j:OpvutcydTb:B:S:M:zZ:");
         if (c==-1)
             break;
         switch (c) {
@@ -44,6 +93,56 @@ int main(
         case 's':
             flags|=S3BD_STORE_SCHEMA_ONLY;
             break;
+        case 'j':
+            flags|=S3BD_STORE_PARALLEL;
+            params.threads=atoi(optarg);
+            break;
+        case 'O':
+            flags|=S3BD_STORE_ORDERED;
+            break;
+        case 'p':
+            flags|=S3BD_STORE_PIPELINE;
+            break;
+        case 'v':
+            verbose=1;
+            break;
+        case 'u':
+            flags|=S3BD_STORE_URING;
+            break;
+        case 't':
+            flags|=S3BD_STORE_TOC;
+            break;
+        case 'c':
+            flags|=S3BD_STORE_COLUMNAR;
+            break;
+        case 'y':
+            flags|=S3BD_STORE_SYMBOLS;
+            break;
+        case 'd':
+            flags|=S3BD_STORE_DEDUP;
+            break;
+        case 'T':
+            flags|=S3BD_STORE_TYPED;
+            break;
+        case 'b':
+            params.blob_store=optarg;
+            break;
+        case 'B':
+            params.blob_store_min=strtoull(optarg,NULL,10);
+            break;
+        case 'S':
+            params.stream_min=strtoull(optarg,NULL,10);
+            break;
+        case 'M':
+            params.mem_budget=strtoull(optarg,NULL,10);
+            break;
+        case 'z':
+            params.codec=default_codec;
+            break;
+        case 'Z':
+            if (parse_codec(optarg,&params))
+                usage();
+            break;
         default:
             usage();
         }
@@ -85,7 +184,8 @@ int main(
         }
         return 1;
     }
-    status=s3bd_store(connection,outfile,flags,overrides,&errmsg);
+    status=s3bd_store_ex(
+        connection,outfile,flags,&params,overrides,&errmsg);
     sqlite3_close(connection);
     if (status!=SQLITE_OK) {
         if (errmsg) {
@@ -96,6 +196,17 @@ int main(
         }
         return 1;
     }
+    if (verbose) {
+        fprintf(stderr,"rows: %llu\n",(unsigned long long)stats.rows);
+        if (flags & S3BD_STORE_PIPELINE)
+            fprintf(stderr,
+                    "stepper waited for writer: %llu times, %.3f s\n"
+                    "writer waited for stepper: %llu times, %.3f s\n",
+                    (unsigned long long)stats.full_waits,
+                    stats.full_wait_ns/1e9,
+                    (unsigned long long)stats.empty_waits,
+                    stats.empty_wait_ns/1e9);
+    }
     if (fclose(outfile)) {
         fprintf(stderr,"%s: fclose: %s\n",
                 outpath,strerror(errno));
@@ -0,0 +1,163 @@
+/*
+  SHA-256 (FIPS 180-4), which names the blobs in a blob store.
+  A plain implementation; blob store I/O costs more than hashing.
+*/
+
+#define SHA256_SIZE	32
+
+static unsigned int const sha256_k[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define SHA256_ROR(x,n)	((x)>>(n) | (x)<<(32-(n)))
+
+static void sha256_block(
+    unsigned int state[8],
+    unsigned char const *block)
+{
+    unsigned int w[64];
+    unsigned int a,b,c,d,e,f,g,h,t1,t2;
+    int ix;
+
+    for (ix=0; ix<16; ix++) {
+        w[ix]=get_u32(block+4*ix);
+    }
+    for (ix=16; ix<64; ix++) {
+        unsigned int s0,s1;
+
+        s0=SHA256_ROR(w[ix-15],7)^SHA256_ROR(w[ix-15],18)^w[ix-15]>>3;
+        s1=SHA256_ROR(w[ix-2],17)^SHA256_ROR(w[ix-2],19)^w[ix-2]>>10;
+        w[ix]=w[ix-16]+s0+w[ix-7]+s1;
+    }
+    a=state[0];
+    b=state[1];
+    c=state[2];
+    d=state[3];
+    e=state[4];
+    f=state[5];
+    g=state[6];
+    h=state[7];
+    for (ix=0; ix<64; ix++) {
+        t1=h+(SHA256_ROR(e,6)^SHA256_ROR(e,11)^SHA256_ROR(e,25))
+            +((e&f)^(~e&g))+sha256_k[ix]+w[ix];
+        t2=(SHA256_ROR(a,2)^SHA256_ROR(a,13)^SHA256_ROR(a,22))
+            +((a&b)^(a&c)^(b&c));
+        h=g;
+        g=f;
+        f=e;
+        e=d+t1;
+        d=c;
+        c=b;
+        b=a;
+        a=t1+t2;
+    }
+    state[0]+=a;
+    state[1]+=b;
+    state[2]+=c;
+    state[3]+=d;
+    state[4]+=e;
+    state[5]+=f;
+    state[6]+=g;
+    state[7]+=h;
+}
+
+/*
+  Incremental hashing, for data that doesn't come in one piece.  size
+  counts the bytes so far; those of an incomplete block wait in buf.
+*/
+
+typedef struct sha256_t {
+    unsigned int state[8];
+    unsigned char buf[64];
+    sqlite3_uint64 size;
+} sha256_t;
+
+static void sha256_init(
+    sha256_t *sha)
+{
+    static unsigned int const init[8] =
+    {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+
+    memcpy(sha->state,init,sizeof sha->state);
+    sha->size=0;
+}
+
+static void sha256_update(
+    sha256_t *sha,
+    void const *data,
+    size_t size)
+{
+    unsigned char const *src=data;
+    size_t fill=sha->size%64;
+
+    sha->size+=size;
+    if (fill>0) {
+        size_t part=64-fill<size ? 64-fill : size;
+
+        memcpy(sha->buf+fill,src,part);
+        src+=part;
+        size-=part;
+        if (fill+part<64)
+            return;
+        sha256_block(sha->state,sha->buf);
+    }
+    for (; size>=64; size-=64, src+=64) {
+        sha256_block(sha->state,src);
+    }
+    if (size>0)
+        memcpy(sha->buf,src,size);
+}
+
+static void sha256_final(
+    sha256_t *sha,
+    unsigned char hash[SHA256_SIZE])
+{
+    unsigned char tail[128];
+    size_t rest=sha->size%64;
+    size_t tailsize;
+    int ix;
+
+    /* The rest, a 1 bit, 0 bits and the size in bits fill one or two blocks. */
+    memset(tail,0,sizeof tail);
+    memcpy(tail,sha->buf,rest);
+    tail[rest]=0x80;
+    tailsize=rest<56 ? 64 : 128;
+    put_u64(tail+tailsize-8,sha->size*8);
+    sha256_block(sha->state,tail);
+    if (tailsize>64)
+        sha256_block(sha->state,tail+64);
+    for (ix=0; ix<8; ix++) {
+        put_u32(hash+4*ix,sha->state[ix]);
+    }
+}
+
+static void sha256(
+    void const *data,
+    size_t size,
+    unsigned char hash[SHA256_SIZE])
+{
+    sha256_t sha;
+
+    sha256_init(&sha);
+    sha256_update(&sha,data,size);
+    sha256_final(&sha,hash);
+}
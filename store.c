@@ -27,698 +27,4112 @@ typedef struct store_vt {
         store_context_t *context,
         void const *text,
         size_t size);
+    void const *(*dump_text)(
+        store_context_t *context,
+        void const *text,
+        size_t size);
     conststr_t pragmas_id;
     conststr_t schema_id;
 } store_vt;
 
 /*
   Extend the common context with store-specific parts.
+
+  Output goes through a large buffer that values are encoded straight
+  into.  Whole buffers are written with write(2) on the file descriptor
+  underneath outfile (or with fwrite if there isn't one); values too big
+  to be worth copying go out together with the buffer in one writev(2).
+  With an io_uring ring, the buffer is one of the ring's and is handed
+  to the kernel when full, and big values are copied like any other.
+  With caller-supplied I/O, the pieces go to its write callback instead.
+  When storing to memory, the buffer simply grows and becomes the result.
+  When compressing, the buffer is a raw block of the compressor's, and
+  the compressed blocks go where the buffer contents would have gone
+  (into a separate result buffer when storing to memory).
+
+  Rows are encoded into a separate block buffer, which is swapped in
+  for the output buffer while a block is being built.  Finished blocks
+  go to the output like any other data once the header can be written.
+
+  outdone counts what has left the output buffer (before compression),
+  so that the dump offsets for the table of contents are known.
+
+  For a columnar rowset, the values of a block are collected in the
+  group instead (text and blob bytes in groupdata) and only encoded,
+  column by column, when the block is finished.
+
+  Blobs big enough to be streamed never come out of the statement at all
+  (see table_select_sql); they are read in chunks into streambuf.
 */
 
+typedef struct store_val_t {
+    int type;
+    unsigned int dict;
+    unsigned int coded;
+    unsigned char shared;
+    size_t size;
+    union {
+        sqlite3_int64 i;
+        double f;
+        size_t offset;
+    } u;
+} store_val_t;
+
+typedef struct dict_entry_t {
+    size_t offset;
+    size_t size;
+    unsigned int slot;
+} dict_entry_t;
+
+typedef struct shared_entry_t {
+    unsigned char *data;
+    size_t size;
+    sqlite3_uint64 num;
+    unsigned int hash;
+    unsigned int next;
+} shared_entry_t;
+
+typedef struct toc_entry_t {
+    void *name;
+    size_t namesize;
+    sqlite3_uint64 offset;
+    sqlite3_uint64 rows;
+    sqlite3_uint64 size;
+    int colcnt;
+} toc_entry_t;
+
 struct store_context_t {
     context_t c;
     FILE *outfile;
+    int outfd;
+    s3bd_store_io_t const *io;
+    unsigned char outmem;
+    unsigned char *outbuf;
+    size_t outfill;
+    size_t outcap;
+    sqlite3_uint64 outdone;
+    uring_t *ring;
+    zpool_t *zpool;
+    unsigned char *zmem;
+    size_t zmemfill;
+    size_t zmemcap;
+    unsigned char inblock;
+    unsigned char *blockbuf;
+    size_t blockcap;
+    size_t blockrows;
+    unsigned char *outerbuf;
+    size_t outerfill;
+    size_t outercap;
+    unsigned char columnar;
+    size_t groupcols;
+    store_val_t *group;
+    size_t groupfill;
+    sqlite3_uint64 *groupints;
+    unsigned char *groupdata;
+    size_t groupdatasize;
+    size_t groupdatacap;
+    unsigned char inrow;
+    unsigned char usemap;
+    unsigned char typeuse;
+    unsigned char *types;
+    size_t typecap;
+    size_t rowhead;
+    unsigned int rowcode;
+    size_t rowcols;
+    size_t rowcol;
+    size_t rownulls;
+    unsigned char *nullmap;
+    size_t *prevoff;
+    size_t *prevsize;
+    unsigned char *prevcode;
+    size_t prevcap;
+    unsigned char dictuse;
+    dict_entry_t *dict;
+    size_t dictcnt;
+    size_t dictdone;
+    unsigned int *dictslots;
+    unsigned char *dictdata;
+    size_t dictdatasize;
+    size_t dictdatacap;
+    unsigned int *dictadds;
+    size_t dictaddcap;
+    unsigned char symuse;
+    unsigned char symready;
+    unsigned char sympending;
+    symtab_t *symtab;
+    unsigned char *symsample;
+    size_t symsamplesize;
+    unsigned char *symbuf;
+    size_t streamcnt;
+    size_t *streamat;
+    size_t streamcap;
+    char *streamtable;
+    unsigned char *streambuf;
+    unsigned char streamcolumnar;
+    unsigned char shareuse;
+    shared_entry_t *shared;
+    unsigned int *sharedslots;
+    sqlite3_uint64 sharedcnt;
+    sqlite3_uint64 sharedold;
+    sqlite3_uint64 sharedbase;
+    size_t sharedbytes;
+    sqlite3_uint64 setstart;
+    sqlite3_uint64 setrows;
+    toc_entry_t *toc;
+    size_t toccnt;
+    size_t toccap;
     store_vt const *vt;
+    unsigned int flags;
+    s3bd_store_params_t params;
+    s3bd_store_stats_t stats;
+    budget_t budget;
     unsigned char have_pragmas;
     unsigned char have_schema;
 };
 
-static int wd(
+#define OUTBUF_SIZE	262144
+#define OUTBUF_DIRECT	65536
+#define BLOCK_TARGET	262144
+
+static int out_writev(
+    store_context_t *context,
+    struct iovec *iov,
+    int iovcnt)
+{
+    if (context->io) {
+        for (; iovcnt>0; iov++, iovcnt--) {
+            int status;
+
+            if (!iov->iov_len)
+                continue;
+            status=(*context->io->write)(
+                context->io->arg,iov->iov_base,iov->iov_len);
+            if (status!=SQLITE_OK) {
+                errf(
+                    &context->c,status,
+                    "Write error: %s",sqlite3_errstr(status));
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (context->outfd<0) {
+        for (; iovcnt>0; iov++, iovcnt--) {
+            if (iov->iov_len>0
+                    && !fwrite(iov->iov_base,iov->iov_len,1,context->outfile))
+                goto failed;
+        }
+        return 0;
+    }
+    while (iovcnt>0) {
+        ssize_t done;
+
+        done=writev(context->outfd,iov,iovcnt);
+        if (done<0) {
+            if (errno==EINTR)
+                continue;
+            goto failed;
+        }
+        while (iovcnt>0 && (size_t)done>=iov->iov_len) {
+            done-=iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt>0) {
+            iov->iov_base=(char *)iov->iov_base+done;
+            iov->iov_len-=done;
+        }
+    }
+    return 0;
+
+failed:
+    errf(
+        &context->c,SQLITE_IOERR_WRITE,
+        "Write error: %s",strerror(errno));
+    return -1;
+}
+
+/*
+  Make room for at least size more bytes in a memory dump.
+*/
+
+static int out_grow(
     store_context_t *context,
-    void const *data,
     size_t size)
 {
-    if (size>0 && !fwrite(data,size,1,context->outfile)) {
-        errf(
-            &context->c,SQLITE_IOERR_WRITE,
-            "Write error: %s",strerror(errno));
+    unsigned char *grown;
+    size_t cap;
+
+    cap=context->outcap*2;
+    if (cap-context->outfill<size)
+        cap=context->outfill+size;
+    grown=sqlite3_realloc64(context->outbuf,cap);
+    if (!grown) {
+        context->c.status=SQLITE_NOMEM;
         return -1;
     }
+    context->outbuf=grown;
+    context->outcap=cap;
     return 0;
 }
 
-static int wc(
+static int out_flush(
+    store_context_t *context)
+{
+    struct iovec iov;
+
+    if (context->inblock)
+        return out_grow(context,OUTBUF_DIRECT);
+    if (context->zpool) {
+        if (zpool_put(context->zpool,context->outfill))
+            return -1;
+        context->outdone+=context->outfill;
+        context->outfill=0;
+        context->outbuf=zpool_buf(context->zpool);
+        return context->outbuf ? 0 : -1;
+    }
+    if (context->outmem)
+        return out_grow(context,OUTBUF_DIRECT);
+    if (!context->outfill)
+        return 0;
+    if (context->ring) {
+        size_t keep,len;
+        unsigned char *next;
+
+        /* Leftovers that would break the alignment go first next time. */
+        keep=context->outfill%uring_align(context->ring);
+        len=context->outfill-keep;
+        if (uring_write(&context->c,context->ring,len))
+            return -1;
+        context->outdone+=len;
+        next=uring_wbuf(&context->c,context->ring);
+        if (!next)
+            return -1;
+        memcpy(next,context->outbuf+len,keep);
+        context->outbuf=next;
+        context->outfill=keep;
+        return 0;
+    }
+    iov.iov_base=context->outbuf;
+    iov.iov_len=context->outfill;
+    context->outdone+=context->outfill;
+    context->outfill=0;
+    return out_writev(context,&iov,1);
+}
+
+/*
+  Start writing to a (new) output file.  Anything the caller left
+  in the stdio buffer must go out before we start bypassing it.
+*/
+
+static int out_alloc(
+    store_context_t *context)
+{
+    if (!context->outbuf) {
+        context->outbuf=cmalloc(&context->c,OUTBUF_SIZE);
+        if (!context->outbuf)
+            return -1;
+        context->outcap=OUTBUF_SIZE;
+    }
+    context->outfill=0;
+    context->outdone=0;
+    return 0;
+}
+
+static int out_attach(
     store_context_t *context,
-    int c)
+    FILE *outfile)
 {
-    if (putc(c,context->outfile)==EOF) {
+    if (out_alloc(context))
+        return -1;
+    if (fflush(outfile)) {
         errf(
             &context->c,SQLITE_IOERR_WRITE,
             "Write error: %s",strerror(errno));
         return -1;
     }
+    context->outfile=outfile;
+    context->outfd=fileno(outfile);
+    context->io=NULL;
     return 0;
 }
 
-static int write_text16(
+static int out_attach_io(
     store_context_t *context,
-    void const *text,
+    s3bd_store_io_t const *io)
+{
+    if (out_alloc(context))
+        return -1;
+    context->outfile=NULL;
+    context->outfd=-1;
+    context->io=io;
+    return 0;
+}
+
+static int out_attach_mem(
+    store_context_t *context)
+{
+    if (out_alloc(context))
+        return -1;
+    context->outfile=NULL;
+    context->outfd=-1;
+    context->io=NULL;
+    context->outmem=1;
+    return 0;
+}
+
+/*
+  Switch the output over to io_uring, if it's usable for the file.
+*/
+
+static int out_uring(
+    store_context_t *context)
+{
+    if (context->outfd<0)
+        return 0;
+    if (uring_open(&context->c,&context->ring,context->outfd,1))
+        return -1;
+    if (!context->ring)
+        return 0;
+    sqlite3_free(context->outbuf);
+    context->outbuf=uring_wbuf(&context->c,context->ring);
+    context->outcap=URING_BUFSIZE;
+    context->outfill=0;
+    return 0;
+}
+
+/*
+  Where compressed blocks go.
+*/
+
+static int out_emit(
+    void *arg,
+    void const *data,
     size_t size)
 {
-    if (context->c.db_enc==context->c.native_enc) {
-        return wd(context,text,size);
-    } else {
-        FILE *outfile=context->outfile;
-        unsigned char const *src=text;
+    store_context_t *context=arg;
+    struct iovec iov;
 
-        while (size>=2) {
-            unsigned int c0,c1;
+    if (context->outmem) {
+        if (context->zmemcap-context->zmemfill<size) {
+            unsigned char *grown;
+            size_t cap;
 
-            c0=src[0];
-            c1=src[1];
-            if (putc(c1,outfile)==EOF || putc(c0,outfile)==EOF) {
-                errf(
-                    &context->c,SQLITE_IOERR_WRITE,
-                    "Write error: %s",strerror(errno));
+            cap=context->zmemcap ? context->zmemcap*2 : OUTBUF_SIZE;
+            if (cap-context->zmemfill<size)
+                cap=context->zmemfill+size;
+            grown=sqlite3_realloc64(context->zmem,cap);
+            if (!grown) {
+                context->c.status=SQLITE_NOMEM;
                 return -1;
             }
-            src+=2;
-            size-=2;
+            context->zmem=grown;
+            context->zmemcap=cap;
         }
+        memcpy(context->zmem+context->zmemfill,data,size);
+        context->zmemfill+=size;
+        return 0;
     }
-    return 0;
+    iov.iov_base=(void *)data;
+    iov.iov_len=size;
+    return out_writev(context,&iov,1);
 }
 
-static store_vt store_vt8 =
-{
-    prepare8,
-    column_text8,
-    str8app_7,
-    str8app_id,
-    wd,
-    CONSTSTR(s3bd_id8_pragmas),
-    CONSTSTR(s3bd_id8_schema)
-};
+/*
+  Switch the output over to a compressed container.
+  Must be done before anything is written.
+*/
 
-static store_vt store_vt16 =
+static int out_compress(
+    store_context_t *context)
 {
-    prepare16,
-    column_text16,
-    str16app_7,
-    str16app_id,
-    write_text16,
-    CONSTSTR(s3bd_id16_pragmas),
-    CONSTSTR(s3bd_id16_schema)
-};
+    s3bd_zheader_t header;
+    unsigned int threads=context->params.zthreads;
 
-static unsigned int encode_uint(
-    unsigned char *buf,
-    sqlite3_uint64 u)
-{
-    unsigned int width,ix;
+    if (!threads) {
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
 
-    for (width=0; width<8 && u>=s3bd_uint_bias[width+1]; width++)
-        ;
-    u-=s3bd_uint_bias[width];
-    for (ix=1; ix<=width; ix++) {
-        buf[width-ix]=u;
-        u>>=8;
+        threads=cpus>0 ? cpus : 1;
     }
-    return width;
+    context->zpool=zpool_open(
+        &context->c,context->params.codec,context->params.level,threads,
+        out_emit,context);
+    if (!context->zpool)
+        return -1;
+    memcpy(header.magic,s3bd_zheader_magic,sizeof header.magic);
+    header.ver_major=ZCURVER_MAJOR;
+    header.ver_minor=ZCURVER_MINOR;
+    header.codec=context->params.codec;
+    if (out_emit(context,&header,sizeof header))
+        return -1;
+    sqlite3_free(context->outbuf);
+    context->outbuf=zpool_buf(context->zpool);
+    context->outcap=ZBLOCK_SIZE;
+    context->outfill=0;
+    return 0;
 }
 
-static unsigned int encode_sint(
-    unsigned char *buf,
-    sqlite3_int64 i)
-{
-    sqlite3_uint64 u;
-    unsigned int flip;
-    unsigned int width,ix;
+/*
+  Write out everything buffered, including a final unaligned piece
+  or the end of a compressed container.
+*/
 
-    if (i<0) {
-        u=-i;
-        flip=0xFF;
-    } else {
-        u=i;
-        flip=0x00;
-    }
-    for (width=0; width<8 && u>=s3bd_sint_bias[width+1]; width++)
-        ;
-    u-=s3bd_sint_bias[width];
-    for (ix=1; ix<=width; ix++) {
-        buf[width-ix]=u^flip;
-        u>>=8;
+static int out_sync(
+    store_context_t *context)
+{
+    if (context->zpool) {
+        if (zpool_put(context->zpool,context->outfill))
+            return -1;
+        context->outdone+=context->outfill;
+        context->outfill=0;
+        if (zpool_finish(context->zpool))
+            return -1;
+        context->outbuf=zpool_buf(context->zpool);
+        return context->outbuf ? 0 : -1;
     }
-    return width;
+    if (context->outmem)
+        return 0;
+    if (!context->ring)
+        return out_flush(context);
+    if (uring_write(&context->c,context->ring,context->outfill))
+        return -1;
+    context->outdone+=context->outfill;
+    context->outfill=0;
+    if (uring_sync(&context->c,context->ring))
+        return -1;
+    context->outbuf=uring_wbuf(&context->c,context->ring);
+    return context->outbuf ? 0 : -1;
 }
 
-static int store_intcol(
-    store_context_t *context,
-    sqlite3_int64 i)
+static void out_block_leave(
+    store_context_t *context);
+
+static void toc_clear(
+    store_context_t *context)
 {
-    unsigned char buf[9];
-    unsigned int width;
+    size_t ix;
 
-    width=encode_sint(buf+1,i);
-    buf[0]=INTCOL(width);
-    return wd(context,buf,1+width);
+    for (ix=0; ix<context->toccnt; ix++) {
+        sqlite3_free(context->toc[ix].name);
+    }
+    context->toccnt=0;
 }
 
-static unsigned int encode_float(
-    unsigned char *buf,
-    double f,
-    int endian)
+static void out_free(
+    store_context_t *context)
 {
-    union {
-        double f;
-        unsigned char c[sizeof (double)];
-    } convert;
-    int ix,step,end;
-    unsigned int width;
-
-    convert.f=f;
-    if (endian==2) {
-        ix=0;
-        step=1;
-        end=8;
-    } else {
-        ix=7;
-        step=-1;
-        end=-1;
+    if (context->inblock)
+        out_block_leave(context);
+    sqlite3_free(context->blockbuf);
+    context->blockbuf=NULL;
+    context->blockcap=0;
+    sqlite3_free(context->group);
+    context->group=NULL;
+    sqlite3_free(context->groupints);
+    context->groupints=NULL;
+    sqlite3_free(context->groupdata);
+    context->groupdata=NULL;
+    context->groupdatacap=0;
+    context->groupfill=0;
+    context->groupdatasize=0;
+    context->columnar=0;
+    sqlite3_free(context->nullmap);
+    context->nullmap=NULL;
+    sqlite3_free(context->prevoff);
+    context->prevoff=NULL;
+    sqlite3_free(context->prevsize);
+    context->prevsize=NULL;
+    sqlite3_free(context->prevcode);
+    context->prevcode=NULL;
+    context->prevcap=0;
+    context->rownulls=0;
+    context->inrow=0;
+    sqlite3_free(context->types);
+    context->types=NULL;
+    context->typecap=0;
+    context->typeuse=0;
+    sqlite3_free(context->dict);
+    context->dict=NULL;
+    sqlite3_free(context->dictslots);
+    context->dictslots=NULL;
+    sqlite3_free(context->dictdata);
+    context->dictdata=NULL;
+    context->dictdatacap=0;
+    sqlite3_free(context->dictadds);
+    context->dictadds=NULL;
+    context->dictaddcap=0;
+    context->dictcnt=0;
+    context->dictdone=0;
+    context->dictuse=0;
+    sqlite3_free(context->symtab);
+    context->symtab=NULL;
+    sqlite3_free(context->symsample);
+    context->symsample=NULL;
+    sqlite3_free(context->symbuf);
+    context->symbuf=NULL;
+    context->symuse=0;
+    if (context->shared) {
+        for (; context->sharedold<context->sharedcnt; context->sharedold++) {
+            sqlite3_free(
+                context->shared[context->sharedold%SHARED_ENTRIES].data);
+        }
+        sqlite3_free(context->shared);
+        context->shared=NULL;
+        context->sharedbytes=0;
     }
-    while (end!=ix && !convert.c[end-step])
-        end-=step;
-    width=0;
-    while (ix!=end) {
-        buf[width]=convert.c[ix];
-        ix+=step;
-        width++;
+    sqlite3_free(context->sharedslots);
+    context->sharedslots=NULL;
+    context->shareuse=0;
+    sqlite3_free(context->streamat);
+    context->streamat=NULL;
+    context->streamcap=0;
+    context->streamcnt=0;
+    sqlite3_free(context->streamtable);
+    context->streamtable=NULL;
+    sqlite3_free(context->streambuf);
+    context->streambuf=NULL;
+    toc_clear(context);
+    sqlite3_free(context->toc);
+    context->toc=NULL;
+    context->toccap=0;
+    if (context->zpool) {
+        zpool_close(context->zpool);
+        context->zpool=NULL;
+        context->outbuf=NULL;
     }
-    return width;
+    if (context->zmem) {
+        sqlite3_free(context->zmem);
+        context->zmem=NULL;
+    }
+    context->zmemfill=0;
+    context->zmemcap=0;
+    if (context->ring) {
+        uring_close(context->ring);
+        context->ring=NULL;
+        context->outbuf=NULL;
+    }
+    if (context->outbuf) {
+        sqlite3_free(context->outbuf);
+        context->outbuf=NULL;
+    }
+    context->outfill=0;
+    context->outcap=0;
 }
 
-static int store_floatcol(
+/*
+  Get a pointer to at least size bytes of free buffer space.
+  The caller advances outfill by however much it actually uses.
+  Size must not exceed OUTBUF_DIRECT.
+*/
+
+static unsigned char *out_reserve(
     store_context_t *context,
-    double f)
+    size_t size)
 {
-    unsigned char buf[9];
-    unsigned int width;
-
-    width=encode_float(buf+1,f,context->c.double_end);
-    buf[0]=FLOATCOL(width);
-    return wd(context,buf,1+width);
+    if (context->outcap-context->outfill<size && out_flush(context))
+        return NULL;
+    return context->outbuf+context->outfill;
 }
 
-static int store_textcol(
+static int wd(
     store_context_t *context,
-    void const *text,
+    void const *data,
     size_t size)
 {
-    unsigned char buf[9];
-    unsigned int width;
+    if (context->inblock || (context->outmem && !context->zpool)) {
+        if (context->outcap-context->outfill<size && out_grow(context,size))
+            return -1;
+    } else if (size>=OUTBUF_DIRECT && !context->ring && !context->zpool) {
+        struct iovec iov[2];
 
-    width=encode_uint(buf+1,size);
-    buf[0]=TEXTCOL(width);
-    if (wd(context,buf,1+width))
-        return -1;
-    if ((*context->vt->write_text)(context,text,size))
-        return -1;
+        iov[0].iov_base=context->outbuf;
+        iov[0].iov_len=context->outfill;
+        iov[1].iov_base=(void *)data;
+        iov[1].iov_len=size;
+        context->outdone+=context->outfill+size;
+        context->outfill=0;
+        return out_writev(context,iov,2);
+    }
+    while (context->outcap-context->outfill<size) {
+        size_t chunk=context->outcap-context->outfill;
+
+        memcpy(context->outbuf+context->outfill,data,chunk);
+        context->outfill+=chunk;
+        data=(unsigned char const *)data+chunk;
+        size-=chunk;
+        if (out_flush(context))
+            return -1;
+    }
+    memcpy(context->outbuf+context->outfill,data,size);
+    context->outfill+=size;
     return 0;
 }
 
-static int store_blobcol(
+static int wc(
     store_context_t *context,
-    void const *data,
-    size_t size)
+    int c)
 {
-    unsigned char buf[9];
-    unsigned int width;
-
-    width=encode_uint(buf+1,size);
-    buf[0]=BLOBCOL(width);
-    if (wd(context,buf,1+width))
-        return -1;
-    if (wd(context,data,size))
+    if (context->outfill>=context->outcap && out_flush(context))
         return -1;
+    context->outbuf[context->outfill++]=c;
     return 0;
 }
 
-static int store_rowset(
+/*
+  Start encoding rows into the block buffer.
+*/
+
+static int out_block_enter(
+    store_context_t *context)
+{
+    if (!context->blockbuf) {
+        context->blockbuf=cmalloc(&context->c,BLOCK_TARGET+OUTBUF_DIRECT);
+        if (!context->blockbuf)
+            return -1;
+        context->blockcap=BLOCK_TARGET+OUTBUF_DIRECT;
+    }
+    context->outerbuf=context->outbuf;
+    context->outerfill=context->outfill;
+    context->outercap=context->outcap;
+    context->outbuf=context->blockbuf;
+    context->outfill=0;
+    context->outcap=context->blockcap;
+    context->blockrows=0;
+    context->inblock=1;
+    return 0;
+}
+
+static void out_block_leave(
+    store_context_t *context)
+{
+    context->blockbuf=context->outbuf;
+    context->blockcap=context->outcap;
+    context->outbuf=context->outerbuf;
+    context->outfill=context->outerfill;
+    context->outcap=context->outercap;
+    context->inblock=0;
+}
+
+static int store_group(
+    store_context_t *context);
+
+static int store_dict(
+    store_context_t *context);
+
+static int symtab_ready(
+    store_context_t *context);
+
+static int store_symtab(
+    store_context_t *context);
+
+/*
+  Write out the block built so far, if it has any rows in it,
+  and go back to the output buffer.
+*/
+
+static int out_block_finish(
+    store_context_t *context)
+{
+    unsigned char head[1+BLOCK_HEADER_SIZE];
+    size_t size,rows;
+
+    rows=context->blockrows;
+    if (rows && context->symuse && !context->symready
+            && symtab_ready(context))
+        return -1;
+    if (context->columnar && store_group(context))
+        return -1;
+    size=context->outfill;
+    out_block_leave(context);
+    if (!rows)
+        return 0;
+    context->setrows+=rows;
+    if (context->dictdone<context->dictcnt && store_dict(context))
+        return -1;
+    if (context->sympending && store_symtab(context))
+        return -1;
+    head[0]=context->columnar ? COLBLOCK() : BLOCK();
+    put_u32(head+1,size);
+    put_u32(head+5,rows);
+    put_u32(head+9,crc32c(context->blockbuf,size));
+    if (wd(context,head,sizeof head))
+        return -1;
+    return wd(context,context->blockbuf,size);
+}
+
+/*
+  Count a finished row, and cut the block there if it's big enough.
+*/
+
+static int out_block_row(
+    store_context_t *context)
+{
+    if (context->rownulls) {
+        memset(context->nullmap,0,(context->rowcols+7)/8);
+        context->rownulls=0;
+    }
+    context->inrow=0;
+    context->usemap=0;
+    context->blockrows++;
+    if (context->columnar) {
+        if (context->groupfill+context->groupcols<=COLBLOCK_VALUES
+                && context->groupdatasize<BLOCK_TARGET)
+            return 0;
+    } else if (context->outfill<BLOCK_TARGET) {
+        return 0;
+    }
+    if (out_block_finish(context))
+        return -1;
+    return out_block_enter(context);
+}
+
+/*
+  Rows in row-wise blocks leave out what the row before them already
+  said: a value whose encoding is the same as in the previous row of
+  the block becomes a SAMECOL, and a row with enough NULLs starts with
+  a NULLMAP and has no NULLCOLs.  Encodings are compared in the block
+  buffer, where the previous row still is.  The caller marks the NULLs
+  of a row with row_null before it calls store_row_start.
+
+  Typed rows (see COLUMN TYPES in format.txt) start with a header of
+  codes instead, which store_row_start leaves room for, with the NULLs
+  already filled in, and row_col_done fills in the rest of.  A value
+  of its column's type is encoded as usual, and row_typed then takes
+  its marker back out and makes its width the code.
+*/
+
+static int row_alloc(
     store_context_t *context,
-    conststr_t ident,
-    sqlite3_stmt *stmt)
+    size_t colcnt)
+{
+    size_t mapsize=(colcnt+7)/8;
+
+    context->rowcols=colcnt;
+    if (colcnt<=context->prevcap)
+        return 0;
+    sqlite3_free(context->nullmap);
+    sqlite3_free(context->prevoff);
+    sqlite3_free(context->prevsize);
+    sqlite3_free(context->prevcode);
+    context->prevcap=0;
+    context->nullmap=cmalloc(&context->c,mapsize);
+    context->prevoff=cmalloc(&context->c,colcnt*sizeof *context->prevoff);
+    context->prevsize=cmalloc(&context->c,colcnt*sizeof *context->prevsize);
+    context->prevcode=cmalloc(&context->c,colcnt);
+    if (!context->nullmap || !context->prevoff || !context->prevsize
+            || !context->prevcode)
+        return -1;
+    memset(context->nullmap,0,mapsize);
+    context->prevcap=colcnt;
+    return 0;
+}
+
+static void row_null(
+    store_context_t *context,
+    size_t colix)
+{
+    context->nullmap[colix>>3]|=1<<(colix&7);
+    context->rownulls++;
+}
+
+static int store_row_start(
+    store_context_t *context)
+{
+    size_t mapsize=(context->rowcols+7)/8;
+
+    context->inrow=1;
+    context->rowcol=0;
+    if (context->typeuse) {
+        size_t headsize=(context->rowcols+1)/2;
+        unsigned char *head;
+        size_t colix;
+
+        if (context->outcap-context->outfill<headsize
+                && out_grow(context,headsize))
+            return -1;
+        head=context->outbuf+context->outfill;
+        memset(head,0,headsize);
+        if (context->rownulls) {
+            for (colix=0; colix<context->rowcols; colix++) {
+                if (context->nullmap[colix>>3]>>(colix&7) & 1)
+                    head[colix>>1]|=TYPED_NULL<<(colix&1)*4;
+            }
+        }
+        context->rowhead=context->outfill;
+        context->outfill+=headsize;
+        context->rowcode=TYPED_COLUMN;
+        context->usemap=1;
+        return 0;
+    }
+    context->usemap=context->rownulls>1+mapsize;
+    if (!context->usemap)
+        return 0;
+    if (wc(context,NULLMAP()))
+        return -1;
+    return wd(context,context->nullmap,mapsize);
+}
+
+/*
+  The value of the next column of the row was encoded from start on.
+*/
+
+static void row_col_done(
+    store_context_t *context,
+    size_t start)
+{
+    size_t colix=context->rowcol++;
+    size_t size=context->outfill-start;
+
+    if (context->typeuse) {
+        unsigned int code=context->rowcode;
+
+        context->rowcode=TYPED_COLUMN;
+        if (context->blockrows && size && size==context->prevsize[colix]
+                && code==context->prevcode[colix]
+                && !memcmp(
+                    context->outbuf+start,
+                    context->outbuf+context->prevoff[colix],size)) {
+            context->outfill=start;
+            code=TYPED_SAME;
+        } else {
+            context->prevoff[colix]=start;
+            context->prevsize[colix]=size;
+            context->prevcode[colix]=code;
+        }
+        context->outbuf[context->rowhead+(colix>>1)]|=code<<(colix&1)*4;
+        return;
+    }
+    if (context->blockrows && size==context->prevsize[colix]
+            && !memcmp(
+                context->outbuf+start,
+                context->outbuf+context->prevoff[colix],size)) {
+        context->outbuf[start]=SAMECOL();
+        context->outfill=start+1;
+        return;
+    }
+    context->prevoff[colix]=start;
+    context->prevsize[colix]=size;
+}
+
+/*
+  A value of the given type whose marker and width (or size width) have
+  just been encoded at buf, in a row.  Returns how many of those bytes
+  to keep.
+*/
+
+static unsigned int row_typed(
+    store_context_t *context,
+    unsigned char *buf,
+    int type,
+    unsigned int width)
+{
+    if (!context->typeuse || !context->inrow
+            || context->types[context->rowcol]!=type)
+        return 1+width;
+    memmove(buf,buf+1,width);
+    context->rowcode=width;
+    return width;
+}
+
+static int write_text16(
+    store_context_t *context,
+    void const *text,
+    size_t size)
+{
+    if (context->c.db_enc==context->c.native_enc) {
+        return wd(context,text,size);
+    } else {
+        unsigned char const *src=text;
+
+        size&=~(size_t)1;
+        while (size>0) {
+            unsigned char *dst;
+            size_t chunk,ix;
+
+            chunk=size<OUTBUF_DIRECT ? size : OUTBUF_DIRECT;
+            dst=out_reserve(context,chunk);
+            if (!dst)
+                return -1;
+            for (ix=0; ix<chunk; ix+=2) {
+                dst[ix]=src[ix+1];
+                dst[ix+1]=src[ix];
+            }
+            context->outfill+=chunk;
+            src+=chunk;
+            size-=chunk;
+        }
+    }
+    return 0;
+}
+
+/*
+  Text in the byte order of the dump, for coding it with a symbol table.
+  A copy, if one is needed, goes at the start of symbuf, which the caller
+  has made big enough.
+*/
+
+static void const *dump_text8(
+    store_context_t *context,
+    void const *text,
+    size_t size)
+{
+    (void)context;
+    (void)size;
+    return text;
+}
+
+static void const *dump_text16(
+    store_context_t *context,
+    void const *text,
+    size_t size)
+{
+    unsigned char const *src=text;
+    unsigned char *dst=context->symbuf;
+    size_t ix;
+
+    if (context->c.db_enc==context->c.native_enc)
+        return text;
+    for (ix=0; ix+1<size; ix+=2) {
+        dst[ix]=src[ix+1];
+        dst[ix+1]=src[ix];
+    }
+    if (ix<size)
+        dst[ix]=src[ix];
+    return dst;
+}
+
+static store_vt store_vt8 =
+{
+    prepare8,
+    column_text8,
+    str8app_7,
+    str8app_id,
+    wd,
+    dump_text8,
+    CONSTSTR(s3bd_id8_pragmas),
+    CONSTSTR(s3bd_id8_schema)
+};
+
+static store_vt store_vt16 =
+{
+    prepare16,
+    column_text16,
+    str16app_7,
+    str16app_id,
+    write_text16,
+    dump_text16,
+    CONSTSTR(s3bd_id16_pragmas),
+    CONSTSTR(s3bd_id16_schema)
+};
+
+/*
+  The width of a biased value is one of two candidates given by the number
+  of significant bytes, so one comparison settles it.
+*/
+
+static unsigned int encode_uint(
+    unsigned char *buf,
+    sqlite3_uint64 u)
+{
+    unsigned int width,ix;
+
+    if (!u)
+        return 0;
+    width=(71-__builtin_clzll(u))>>3;
+    if (u<s3bd_uint_bias[width])
+        width--;
+    u-=s3bd_uint_bias[width];
+    for (ix=1; ix<=width; ix++) {
+        buf[width-ix]=u;
+        u>>=8;
+    }
+    return width;
+}
+
+static unsigned int encode_sint(
+    unsigned char *buf,
+    sqlite3_int64 i)
+{
+    sqlite3_uint64 u;
+    unsigned int flip;
+    unsigned int width,ix;
+
+    if (i<0) {
+        u=-(sqlite3_uint64)i;
+        flip=0xFF;
+    } else {
+        u=i;
+        flip=0x00;
+    }
+    if (!u)
+        return 0;
+    width=(71-__builtin_clzll(u))>>3;
+    if (width<8 && u>=s3bd_sint_bias[width+1])
+        width++;
+    u-=s3bd_sint_bias[width];
+    for (ix=1; ix<=width; ix++) {
+        buf[width-ix]=u^flip;
+        u>>=8;
+    }
+    return width;
+}
+
+/*
+  Add a value to the group of a columnar block.  The group holds
+  at most COLBLOCK_VALUES values, and out_block_row makes sure
+  that every row fits.
+*/
+
+static store_val_t *group_val(
+    store_context_t *context,
+    int type)
+{
+    store_val_t *val;
+
+    if (!context->group) {
+        context->group=cmalloc(
+            &context->c,COLBLOCK_VALUES*sizeof *context->group);
+        context->groupints=cmalloc(
+            &context->c,COLBLOCK_VALUES*sizeof *context->groupints);
+        if (!context->group || !context->groupints)
+            return NULL;
+    }
+    val=&context->group[context->groupfill++];
+    val->type=type;
+    val->dict=0;
+    val->coded=0;
+    val->shared=0;
+    return val;
+}
+
+static int group_data(
+    store_context_t *context,
+    int type,
+    void const *data,
+    size_t size)
+{
+    store_val_t *val;
+
+    val=group_val(context,type);
+    if (!val)
+        return -1;
+    if (context->groupdatacap-context->groupdatasize<size) {
+        size_t cap=context->groupdatacap;
+        unsigned char *grown;
+
+        cap=cap ? 2*cap : BLOCK_TARGET;
+        if (cap-context->groupdatasize<size)
+            cap=context->groupdatasize+size;
+        grown=crealloc(&context->c,context->groupdata,cap);
+        if (!grown)
+            return -1;
+        context->groupdata=grown;
+        context->groupdatacap=cap;
+    }
+    val->u.offset=context->groupdatasize;
+    val->size=size;
+    if (size>0)
+        memcpy(context->groupdata+context->groupdatasize,data,size);
+    context->groupdatasize+=size;
+    return 0;
+}
+
+/*
+  The dictionary of a rowset (see DICTIONARY in format.txt).  Short text
+  values go in as they come, until their column has added
+  DICT_COLUMN_ADDS of them or has a longer value; then the column is
+  done with the dictionary, so high-cardinality columns neither fill it
+  up nor keep paying for lookups.  New entries are written out ahead
+  of the block that first refers to them.
+*/
+
+#define DICT_TEXT_MAX		64
+#define DICT_COLUMN_ADDS	256
+#define DICT_SLOTS		(2*DICT_ENTRIES)
+#define DICT_CLOSED		((unsigned int)-1)
+
+static int dict_reset(
+    store_context_t *context,
+    size_t colcnt)
+{
+    size_t ix;
+
+    for (ix=0; ix<context->dictcnt; ix++) {
+        context->dictslots[context->dict[ix].slot]=0;
+    }
+    context->dictcnt=0;
+    context->dictdone=0;
+    context->dictdatasize=0;
+    if (context->dictaddcap<colcnt) {
+        sqlite3_free(context->dictadds);
+        context->dictadds=cmalloc(&context->c,colcnt*sizeof *context->dictadds);
+        if (!context->dictadds) {
+            context->dictaddcap=0;
+            return -1;
+        }
+        context->dictaddcap=colcnt;
+    }
+    memset(context->dictadds,0,colcnt*sizeof *context->dictadds);
+    context->dictuse=1;
+    return 0;
+}
+
+static unsigned int dict_hash(
+    void const *text,
+    size_t size)
+{
+    unsigned char const *src=text;
+    unsigned int hash=2166136261u;
+    size_t ix;
+
+    for (ix=0; ix<size; ix++) {
+        hash=(hash^src[ix])*16777619u;
+    }
+    return hash;
+}
+
+/*
+  Find the entry for a text value of column colix, adding it if the
+  column may.  Returns 1 if *entry is set, 0 if the value goes without,
+  and -1 on errors.
+*/
+
+static int dict_lookup(
+    store_context_t *context,
+    size_t colix,
+    void const *text,
+    size_t size,
+    size_t *entry)
+{
+    unsigned int *adds=&context->dictadds[colix];
+    dict_entry_t *found;
+    unsigned int slot,ix;
+
+    if (*adds==DICT_CLOSED)
+        return 0;
+    if (size>DICT_TEXT_MAX) {
+        *adds=DICT_CLOSED;
+        return 0;
+    }
+    if (!context->dictslots) {
+        context->dict=cmalloc(
+            &context->c,DICT_ENTRIES*sizeof *context->dict);
+        context->dictslots=cmalloc(
+            &context->c,DICT_SLOTS*sizeof *context->dictslots);
+        if (!context->dict || !context->dictslots)
+            return -1;
+        memset(context->dictslots,0,DICT_SLOTS*sizeof *context->dictslots);
+    }
+    for (slot=dict_hash(text,size)&(DICT_SLOTS-1);
+            (ix=context->dictslots[slot])!=0;
+            slot=(slot+1)&(DICT_SLOTS-1)) {
+        found=&context->dict[ix-1];
+        if (found->size==size && (size==0
+                || !memcmp(context->dictdata+found->offset,text,size))) {
+            *entry=ix-1;
+            return 1;
+        }
+    }
+    if (*adds>=DICT_COLUMN_ADDS || context->dictcnt>=DICT_ENTRIES) {
+        *adds=DICT_CLOSED;
+        return 0;
+    }
+    if (context->dictdatacap-context->dictdatasize<size) {
+        size_t cap=context->dictdatacap ? context->dictdatacap*2 : 4096;
+        unsigned char *grown;
+
+        grown=crealloc(&context->c,context->dictdata,cap);
+        if (!grown)
+            return -1;
+        context->dictdata=grown;
+        context->dictdatacap=cap;
+    }
+    found=&context->dict[context->dictcnt];
+    found->offset=context->dictdatasize;
+    found->size=size;
+    found->slot=slot;
+    if (size>0)
+        memcpy(context->dictdata+context->dictdatasize,text,size);
+    context->dictdatasize+=size;
+    context->dictslots[slot]=++context->dictcnt;
+    (*adds)++;
+    *entry=context->dictcnt-1;
+    return 1;
+}
+
+/*
+  Write out the entries added since the last time.
+*/
+
+static int store_dict(
+    store_context_t *context)
+{
+    unsigned char buf[10];
+    unsigned int width;
+    size_t ix;
+
+    width=encode_uint(buf+1,context->dictcnt-context->dictdone-1);
+    buf[0]=DICT(width);
+    if (wd(context,buf,1+width))
+        return -1;
+    for (ix=context->dictdone; ix<context->dictcnt; ix++) {
+        dict_entry_t const *entry=&context->dict[ix];
+
+        width=encode_uint(buf+1,entry->size);
+        buf[0]=TEXTCOL(width);
+        if (wd(context,buf,1+width))
+            return -1;
+        if (entry->size>0 && (*context->vt->write_text)(
+                context,context->dictdata+entry->offset,entry->size))
+            return -1;
+    }
+    context->dictdone=context->dictcnt;
+    return 0;
+}
+
+/*
+  The symbol table of a rowset (see SYMBOL TABLE in format.txt).  It is
+  learned from the first SYMTAB_SAMPLE bytes of text values that don't go
+  in the dictionary, or from what there is of them when the first block
+  is done, and only then used; it is written out ahead of the block
+  it's built in.  Values that don't come out shorter stay plain.
+*/
+
+#define SYMTAB_SAMPLE		16384
+#define SYMTAB_TEXT_MIN		4
+#define SYMTAB_TEXT_MAX		65536
+
+static void symtab_reset(
+    store_context_t *context)
+{
+    context->symuse=(context->flags & S3BD_STORE_SYMBOLS)!=0;
+    context->symready=0;
+    context->sympending=0;
+    context->symsamplesize=0;
+}
+
+static int symtab_ready(
+    store_context_t *context)
+{
+    if (!context->symtab) {
+        context->symtab=cmalloc(&context->c,sizeof *context->symtab);
+        if (!context->symtab)
+            return -1;
+    }
+    if (symtab_build(
+            &context->c,context->symtab,
+            context->symsample,context->symsamplesize))
+        return -1;
+    context->symready=1;
+    if (context->symtab->cnt)
+        context->sympending=1;
+    else
+        context->symuse=0;
+    return 0;
+}
+
+static int store_symtab(
+    store_context_t *context)
+{
+    symtab_t const *symtab=context->symtab;
+    unsigned char buf[9];
+    unsigned int code;
+
+    buf[0]=SYMTAB();
+    buf[1]=symtab->cnt;
+    if (wd(context,buf,2))
+        return -1;
+    for (code=0; code<symtab->cnt; code++) {
+        buf[0]=symtab->len[code];
+        put_u64le(buf+1,symtab->sym[code]);
+        if (wd(context,buf,1+buf[0]))
+            return -1;
+    }
+    context->sympending=0;
+    return 0;
+}
+
+/*
+  Store a text value coded with the symbol table, sampling it first
+  if the table isn't there yet.  Returns 1 if the value is stored,
+  0 if it's left to the caller, and -1 on errors.
+*/
+
+static int symtab_text(
+    store_context_t *context,
+    void const *text,
+    size_t size)
+{
+    unsigned char const *src;
+    unsigned char *buf,*coded;
+    size_t codedsize,start;
+    unsigned int width;
+
+    if (!context->symbuf) {
+        context->symbuf=cmalloc(&context->c,3*SYMTAB_TEXT_MAX);
+        if (!context->symbuf)
+            return -1;
+    }
+    src=(*context->vt->dump_text)(context,text,size);
+    if (!context->symready) {
+        size_t take=SYMTAB_SAMPLE-context->symsamplesize;
+
+        if (!context->symsample) {
+            context->symsample=cmalloc(&context->c,SYMTAB_SAMPLE);
+            if (!context->symsample)
+                return -1;
+        }
+        if (take>size)
+            take=size;
+        memcpy(context->symsample+context->symsamplesize,src,take);
+        context->symsamplesize+=take;
+        if (context->symsamplesize<SYMTAB_SAMPLE)
+            return 0;
+        if (symtab_ready(context))
+            return -1;
+        if (!context->symuse)
+            return 0;
+    }
+    coded=context->symbuf+size;
+    codedsize=symtab_encode(context->symtab,src,size,coded);
+    if (codedsize>=size)
+        return 0;
+    if (context->columnar) {
+        store_val_t *val;
+
+        if (group_data(context,SQLITE_TEXT,coded,codedsize))
+            return -1;
+        val=&context->group[context->groupfill-1];
+        val->coded=codedsize;
+        val->size=size;
+        return 1;
+    }
+    start=context->outfill;
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=SYMCOL(width);
+    context->outfill+=1+width;
+    if (wd(context,coded,codedsize))
+        return -1;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 1;
+}
+
+/*
+  Shared blobs (see SHARED BLOBS in format.txt).  Blobs of at least
+  SHARED_BLOB_MIN bytes are kept, copied, for as long as references may
+  reach them, in a ring in the order they were stored, and found by
+  their CRC-32C: each of sharedslots chains the entries whose hash falls
+  in it, newest first, through their next fields (ring positions plus
+  one, 0 ending the chain).  The oldest entry, which goes first, is
+  always at the end of its chain.
+
+  The rowsets of a parallel store end up in the dump in whatever order
+  they are done, so each of them starts out with nothing to refer to.
+*/
+
+#define SHARED_BLOB_MIN		256
+#define SHARED_BLOB_MAX		(SHARED_WINDOW/4)
+#define SHARED_SLOTS		(2*SHARED_ENTRIES)
+#define SHARE_NEW		1
+#define SHARE_REF		2
+
+static void dedup_drop(
+    store_context_t *context)
+{
+    unsigned int pos=context->sharedold%SHARED_ENTRIES;
+    shared_entry_t *entry=&context->shared[pos];
+    unsigned int *link=&context->sharedslots[entry->hash%SHARED_SLOTS];
+
+    while (*link!=pos+1)
+        link=&context->shared[*link-1].next;
+    *link=0;
+    context->sharedbytes-=entry->size;
+    sqlite3_free(entry->data);
+    entry->data=NULL;
+    context->sharedold++;
+}
+
+static void dedup_clear(
+    store_context_t *context)
+{
+    while (context->sharedold<context->sharedcnt)
+        dedup_drop(context);
+}
+
+static void dedup_reset(
+    store_context_t *context)
+{
+    context->shareuse=(context->flags & S3BD_STORE_DEDUP)!=0;
+    if (context->shared && (context->flags & S3BD_STORE_PARALLEL))
+        dedup_clear(context);
+    context->sharedbase=context->sharedcnt;
+}
+
+/*
+  Store a blob as a reference if it was stored before, or else as a new
+  shared blob.  Returns 0 or -1.
+*/
+
+static int dedup_blob(
+    store_context_t *context,
+    void const *data,
+    size_t size)
+{
+    size_t start=context->outfill;
+    shared_entry_t *entry=NULL;
+    unsigned char *buf,*copy;
+    unsigned int hash,slot,pos,width;
+
+    if (!context->shared) {
+        context->shared=cmalloc(
+            &context->c,SHARED_ENTRIES*sizeof *context->shared);
+        context->sharedslots=cmalloc(
+            &context->c,SHARED_SLOTS*sizeof *context->sharedslots);
+        if (!context->shared || !context->sharedslots)
+            return -1;
+        memset(
+            context->sharedslots,0,SHARED_SLOTS*sizeof *context->sharedslots);
+    }
+    hash=crc32c(data,size);
+    slot=hash%SHARED_SLOTS;
+    for (pos=context->sharedslots[slot]; pos; pos=entry->next) {
+        entry=&context->shared[pos-1];
+        if (entry->hash==hash && entry->size==size
+                && !memcmp(entry->data,data,size))
+            break;
+    }
+    if (pos) {
+        sqlite3_int64 ref=entry->num-context->sharedbase;
+
+        if (context->columnar) {
+            store_val_t *val=group_val(context,SQLITE_BLOB);
+
+            if (!val)
+                return -1;
+            val->shared=SHARE_REF;
+            val->size=0;
+            val->u.i=ref;
+            return 0;
+        }
+        buf=out_reserve(context,9);
+        if (!buf)
+            return -1;
+        width=encode_sint(buf+1,ref);
+        buf[0]=BLOBREF(width);
+        context->outfill+=1+width;
+        if (context->inrow)
+            row_col_done(context,start);
+        return 0;
+    }
+
+    copy=cmalloc(&context->c,size);
+    if (!copy)
+        return -1;
+    memcpy(copy,data,size);
+    while (context->sharedcnt-context->sharedold>=SHARED_ENTRIES
+            || context->sharedbytes+size>SHARED_WINDOW)
+        dedup_drop(context);
+    pos=context->sharedcnt%SHARED_ENTRIES;
+    entry=&context->shared[pos];
+    entry->data=copy;
+    entry->size=size;
+    entry->num=context->sharedcnt++;
+    entry->hash=hash;
+    entry->next=context->sharedslots[slot];
+    context->sharedslots[slot]=pos+1;
+    context->sharedbytes+=size;
+
+    if (context->columnar) {
+        if (group_data(context,SQLITE_BLOB,data,size))
+            return -1;
+        context->group[context->groupfill-1].shared=SHARE_NEW;
+        return 0;
+    }
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=SHARECOL(width);
+    context->outfill+=1+width;
+    if (wd(context,data,size))
+        return -1;
+    if (context->inrow) {
+        /* A SAMECOL wouldn't count as a shared blob. */
+        context->prevsize[context->rowcol]=0;
+        row_col_done(context,start);
+    }
+    return 0;
+}
+
+/*
+  Store the size and hash of a blob that is in the blob store.  In a
+  group, the hash stands in for the data, with coded set to its size
+  as for coded text.
+*/
+
+static int store_hash(
+    store_context_t *context,
+    unsigned char const hash[SHA256_SIZE],
+    size_t size)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    if (context->columnar) {
+        store_val_t *val;
+
+        if (group_data(context,SQLITE_BLOB,hash,SHA256_SIZE))
+            return -1;
+        val=&context->group[context->groupfill-1];
+        val->coded=SHA256_SIZE;
+        val->size=size;
+        return 0;
+    }
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=HASHCOL(width);
+    context->outfill+=1+width;
+    if (wd(context,hash,SHA256_SIZE))
+        return -1;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+/*
+  Put a blob in the blob store, and only its size and hash in the dump.
+*/
+
+static int store_hashcol(
+    store_context_t *context,
+    void const *data,
+    size_t size)
+{
+    unsigned char hash[SHA256_SIZE];
+
+    sha256(data,size,hash);
+    if (blobstore_put(&context->c,context->params.blob_store,data,size,hash))
+        return -1;
+    return store_hash(context,hash,size);
+}
+
+static int store_nullcol(
+    store_context_t *context)
+{
+    size_t start=context->outfill;
+    size_t colix=context->rowcol;
+
+    if (context->columnar)
+        return group_val(context,SQLITE_NULL) ? 0 : -1;
+    if (context->usemap && (context->nullmap[colix>>3]>>(colix&7) & 1)) {
+        context->prevsize[colix]=0;
+        context->rowcol++;
+        return 0;
+    }
+    if (wc(context,NULLCOL()))
+        return -1;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+static int store_intcol(
+    store_context_t *context,
+    sqlite3_int64 i)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    if (context->columnar) {
+        store_val_t *val=group_val(context,SQLITE_INTEGER);
+
+        if (!val)
+            return -1;
+        val->u.i=i;
+        return 0;
+    }
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_sint(buf+1,i);
+    buf[0]=INTCOL(width);
+    context->outfill+=row_typed(context,buf,SQLITE_INTEGER,width);
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+static unsigned int encode_float(
+    unsigned char *buf,
+    double f,
+    int endian)
+{
+    union {
+        double f;
+        unsigned char c[sizeof (double)];
+    } convert;
+    int ix,step,end;
+    unsigned int width;
+
+    convert.f=f;
+    if (endian==2) {
+        ix=0;
+        step=1;
+        end=8;
+    } else {
+        ix=7;
+        step=-1;
+        end=-1;
+    }
+    while (end!=ix && !convert.c[end-step])
+        end-=step;
+    width=0;
+    while (ix!=end) {
+        buf[width]=convert.c[ix];
+        ix+=step;
+        width++;
+    }
+    return width;
+}
+
+static int store_floatcol(
+    store_context_t *context,
+    double f)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    if (context->columnar) {
+        store_val_t *val=group_val(context,SQLITE_FLOAT);
+
+        if (!val)
+            return -1;
+        val->u.f=f;
+        return 0;
+    }
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_float(buf+1,f,context->c.double_end);
+    buf[0]=FLOATCOL(width);
+    context->outfill+=row_typed(context,buf,SQLITE_FLOAT,width);
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+static int store_textcol(
+    store_context_t *context,
+    void const *text,
+    size_t size)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    if (context->dictuse) {
+        size_t colix,entry;
+
+        colix=context->columnar
+            ? context->groupfill%context->groupcols
+            : context->rowcol;
+        switch (dict_lookup(context,colix,text,size,&entry)) {
+        case -1:
+            return -1;
+        case 1:
+            if (context->columnar) {
+                store_val_t *val=group_val(context,SQLITE_TEXT);
+
+                if (!val)
+                    return -1;
+                val->dict=entry+1;
+                val->size=size;
+                return 0;
+            }
+            buf=out_reserve(context,9);
+            if (!buf)
+                return -1;
+            width=encode_uint(buf+1,entry);
+            buf[0]=DICTREF(width);
+            context->outfill+=1+width;
+            if (context->inrow)
+                row_col_done(context,start);
+            return 0;
+        }
+    }
+    if (context->symuse
+            && size>=SYMTAB_TEXT_MIN && size<=SYMTAB_TEXT_MAX) {
+        switch (symtab_text(context,text,size)) {
+        case -1:
+            return -1;
+        case 1:
+            return 0;
+        }
+    }
+    if (context->columnar)
+        return group_data(context,SQLITE_TEXT,text,size);
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=TEXTCOL(width);
+    context->outfill+=row_typed(context,buf,SQLITE_TEXT,width);
+    if ((*context->vt->write_text)(context,text,size))
+        return -1;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+static int store_blobcol(
+    store_context_t *context,
+    void const *data,
+    size_t size)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    if (context->params.blob_store && size>=context->params.blob_store_min)
+        return store_hashcol(context,data,size);
+    if (context->shareuse
+            && size>=SHARED_BLOB_MIN && size<=SHARED_BLOB_MAX)
+        return dedup_blob(context,data,size);
+    if (context->columnar)
+        return group_data(context,SQLITE_BLOB,data,size);
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=BLOBCOL(width);
+    context->outfill+=row_typed(context,buf,SQLITE_BLOB,width);
+    if (size>0 && wd(context,data,size))
+        return -1;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+/*
+  Streamed blobs (see STREAMED BLOBS in format.txt).  The statement
+  leaves out blobs of stream_min bytes or more in the columns that
+  table_select_sql picked, and has the rowid and their sizes in extra
+  columns after the real ones instead, so SQLite never reads them whole.
+  streamat maps each column to its size column, counting from the rowid
+  column, or to 0.  A row with streamed values goes in a row-wise block
+  of its own and ends it; the values are then read with sqlite3_blob_read
+  and written after the block STREAM_CHUNK bytes at a time.
+
+  Values that go in the blob store are read the same way, but into it,
+  before their row is stored; the row then only has their hashes and
+  needs no block of its own.  Streaming takes precedence over
+  deduplication: streamed values are never shared.
+*/
+
+#define STREAM_MIN	16777216
+#define STREAM_CHUNK	1048576
+#define STREAMED	6
+#define HASHED		7
+
+static int stream_extra(
+    store_context_t *context)
+{
+    return context->streamcnt ? 1+context->streamcnt : 0;
+}
+
+/*
+  Whether a streamed value of that size goes in the blob store.
+*/
+
+static int stream_stored(
+    store_context_t *context,
+    size_t size)
+{
+    return context->params.blob_store
+        && size>=context->params.blob_store_min;
+}
+
+/*
+  The size of a column's value in the current row if it's streamed,
+  or 0.
+*/
+
+static size_t stream_size(
+    store_context_t *context,
+    sqlite3_stmt *stmt,
+    int colcnt,
+    int colix)
+{
+    size_t at;
+
+    if (!context->streamcnt)
+        return 0;
+    at=context->streamat[colix];
+    if (!at || sqlite3_column_type(stmt,colcnt+at)==SQLITE_NULL)
+        return 0;
+    return sqlite3_column_int64(stmt,colcnt+at);
+}
+
+/*
+  Whether the current row has values to stream into the dump.
+*/
+
+static int stream_row(
+    store_context_t *context,
+    sqlite3_stmt *stmt,
+    int colcnt)
+{
+    size_t at;
+
+    for (at=1; at<=context->streamcnt; at++) {
+        if (sqlite3_column_type(stmt,colcnt+at)!=SQLITE_NULL
+                && !stream_stored(
+                    context,sqlite3_column_int64(stmt,colcnt+at)))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+  Get ready for a row with streamed values, which needs a row-wise
+  block even in a columnar rowset.
+*/
+
+static int stream_row_start(
+    store_context_t *context)
+{
+    if (!context->columnar)
+        return 0;
+    if (out_block_finish(context) || out_block_enter(context))
+        return -1;
+    context->columnar=0;
+    context->streamcolumnar=1;
+    return 0;
+}
+
+/*
+  End the block after a row with streamed values, so that their
+  stream records can follow.
+*/
+
+static int stream_row_end(
+    store_context_t *context)
+{
+    if (out_block_finish(context))
+        return -1;
+    context->columnar=context->streamcolumnar;
+    context->streamcolumnar=0;
+    return 0;
+}
+
+static int store_streamcol(
+    store_context_t *context,
+    size_t size)
+{
+    size_t start=context->outfill;
+    unsigned char *buf;
+    unsigned int width;
+
+    buf=out_reserve(context,9);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,size);
+    buf[0]=STREAMCOL(width);
+    context->outfill+=1+width;
+    if (context->inrow)
+        row_col_done(context,start);
+    return 0;
+}
+
+static int store_stream(
+    store_context_t *context,
+    void const *data,
+    size_t size)
+{
+    unsigned char buf[9];
+    unsigned int width;
+
+    width=encode_uint(buf+1,size);
+    buf[0]=STREAM(width);
+    if (wd(context,buf,1+width) || wd(context,data,size))
+        return -1;
+    put_u32(buf,crc32c(data,size));
+    return wd(context,buf,4);
+}
+
+/*
+  Open the streamed value of a column of the current row of stmt.
+*/
+
+static int stream_open(
+    context_t *err,
+    char const *table,
+    sqlite3_stmt *stmt,
+    int colcnt,
+    int colix,
+    size_t size,
+    sqlite3_blob **blob)
+{
+    sqlite3 *db=sqlite3_db_handle(stmt);
+    char const *column;
+    int status;
+
+    column=sqlite3_column_name(stmt,colix);
+    if (!column) {
+        err->status=SQLITE_NOMEM;
+        return -1;
+    }
+    status=sqlite3_blob_open(
+        db,"main",table,column,sqlite3_column_int64(stmt,colcnt),0,blob);
+    if (status!=SQLITE_OK) {
+        errf(
+            err,status,
+            "While extracting rows: sqlite3_blob_open: %s",
+            sqlite3_errmsg(db));
+        return -1;
+    }
+    if ((size_t)sqlite3_blob_bytes(*blob)!=size) {
+        errf(
+            err,SQLITE_ERROR,
+            "While extracting rows: Blob changed size");
+        return -1;
+    }
+    return 0;
+}
+
+static int stream_read(
+    context_t *err,
+    sqlite3_blob *blob,
+    void *data,
+    size_t size,
+    size_t offset)
+{
+    int status;
+
+    status=sqlite3_blob_read(blob,data,size,offset);
+    if (status!=SQLITE_OK) {
+        errf(
+            err,status,
+            "While extracting rows: sqlite3_blob_read: %s",
+            sqlite3_errstr(status));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Read the streamed value of a column of the current row of stmt into
+  the blob store, and get its hash.
+*/
+
+static int stream_store(
+    context_t *err,
+    store_context_t *context,
+    sqlite3_stmt *stmt,
+    int colcnt,
+    int colix,
+    size_t size,
+    unsigned char hash[SHA256_SIZE])
+{
+    size_t bufsize=size<STREAM_CHUNK ? size : STREAM_CHUNK;
+    char const *dir=context->params.blob_store;
+    blobstore_file_t file;
+    sqlite3_blob *blob=NULL;
+    unsigned char *buf;
+    size_t done,chunk;
+    sha256_t sha;
+
+    buf=cmalloc(err,bufsize);
+    if (!buf)
+        return -1;
+    if (stream_open(err,context->streamtable,stmt,colcnt,colix,size,&blob)
+            || blobstore_begin(err,dir,&file))
+        goto cleanup;
+    sha256_init(&sha);
+    for (done=0; done<size; done+=chunk) {
+        chunk=size-done<bufsize ? size-done : bufsize;
+        if (stream_read(err,blob,buf,chunk,done)
+                || blobstore_write(err,&file,buf,chunk)) {
+            blobstore_abort(&file);
+            goto cleanup;
+        }
+        sha256_update(&sha,buf,chunk);
+    }
+    sha256_final(&sha,hash);
+    sqlite3_blob_close(blob);
+    sqlite3_free(buf);
+    return blobstore_end(err,dir,&file,hash,size);
+
+cleanup:
+    if (blob)
+        sqlite3_blob_close(blob);
+    sqlite3_free(buf);
+    return -1;
+}
+
+/*
+  Write out the streamed values of the current row of stmt, whose block
+  is finished, and start the next block.
+*/
+
+static int store_streams(
+    store_context_t *context,
+    sqlite3_stmt *stmt,
+    int colcnt)
+{
+    sqlite3_blob *blob=NULL;
+    size_t size,done,chunk;
+    int colix;
+
+    if (!context->streambuf) {
+        context->streambuf=cmalloc(&context->c,STREAM_CHUNK);
+        if (!context->streambuf)
+            goto cleanup;
+    }
+    for (colix=0; colix<colcnt; colix++) {
+        size=stream_size(context,stmt,colcnt,colix);
+        if (!size || stream_stored(context,size))
+            continue;
+        if (stream_open(
+                &context->c,context->streamtable,stmt,colcnt,colix,size,
+                &blob))
+            goto cleanup;
+        for (done=0; done<size; done+=chunk) {
+            chunk=size-done<STREAM_CHUNK ? size-done : STREAM_CHUNK;
+            if (stream_read(&context->c,blob,context->streambuf,chunk,done)
+                    || store_stream(context,context->streambuf,chunk))
+                goto cleanup;
+        }
+        sqlite3_blob_close(blob);
+        blob=NULL;
+    }
+    return out_block_enter(context);
+
+cleanup:
+    if (blob)
+        sqlite3_blob_close(blob);
+    return -1;
+}
+
+/*
+  Columnar encoding (see COLUMNAR BLOCK in format.txt).  Integer
+  sequences are encoded whichever way of frame of reference and delta
+  comes out smaller; both bit-pack the differences.  They are worked on
+  in place in groupints, as unsigned so that the arithmetic wraps.
+*/
+
+static unsigned int encode_sized_sint(
+    unsigned char *buf,
+    sqlite3_int64 i)
+{
+    unsigned int width;
+
+    width=encode_sint(buf+1,i);
+    buf[0]=width;
+    return 1+width;
+}
+
+static unsigned int bits_needed(
+    sqlite3_uint64 range)
+{
+    return range ? 64-__builtin_clzll(range) : 0;
+}
+
+/*
+  A writer of LSB-first bit fields.  The caller reserves room for
+  every byte plus 8, since whole words are stored.
+*/
+
+typedef struct bitout_t {
+    unsigned char *dst;
+    sqlite3_uint64 acc;
+    unsigned int have;
+} bitout_t;
+
+static void bits_put(
+    bitout_t *out,
+    sqlite3_uint64 u,
+    unsigned int bits)
+{
+    out->acc|=u<<out->have;
+    if (out->have+bits>=64) {
+        put_u64le(out->dst,out->acc);
+        out->dst+=8;
+        out->acc=out->have ? u>>(64-out->have) : 0;
+        out->have=out->have+bits-64;
+    } else {
+        out->have+=bits;
+    }
+}
+
+static unsigned char *bits_end(
+    bitout_t *out)
+{
+    for (; out->have>0; out->have=out->have>8 ? out->have-8 : 0) {
+        *out->dst++=out->acc;
+        out->acc>>=8;
+    }
+    return out->dst;
+}
+
+static int store_packed(
+    store_context_t *context,
+    sqlite3_uint64 const *vals,
+    size_t count,
+    unsigned int bits)
+{
+    size_t size=(count*bits+7)/8;
+    bitout_t out;
+    size_t ix;
+
+    if (!size)
+        return 0;
+    if (context->outcap-context->outfill<size+8 && out_grow(context,size+8))
+        return -1;
+    out.dst=context->outbuf+context->outfill;
+    out.acc=0;
+    out.have=0;
+    for (ix=0; ix<count; ix++) {
+        bits_put(&out,vals[ix],bits);
+    }
+    bits_end(&out);
+    context->outfill+=size;
+    return 0;
+}
+
+static int store_ints(
+    store_context_t *context,
+    sqlite3_uint64 *vals,
+    size_t count)
+{
+    unsigned char *buf;
+    sqlite3_int64 lo,hi,dlo,dhi;
+    unsigned int bits,dbits;
+    size_t ix,len;
+
+    lo=hi=vals[0];
+    dlo=dhi=0;
+    for (ix=1; ix<count; ix++) {
+        sqlite3_int64 v=vals[ix];
+        sqlite3_int64 d=vals[ix]-vals[ix-1];
+
+        if (v<lo)
+            lo=v;
+        if (v>hi)
+            hi=v;
+        if (ix==1 || d<dlo)
+            dlo=d;
+        if (ix==1 || d>dhi)
+            dhi=d;
+    }
+    bits=bits_needed((sqlite3_uint64)hi-(sqlite3_uint64)lo);
+    dbits=bits_needed((sqlite3_uint64)dhi-(sqlite3_uint64)dlo);
+    buf=out_reserve(context,21);
+    if (!buf)
+        return -1;
+    if (count>1 && 9+((count-1)*dbits+7)/8<(count*bits+7)/8) {
+        buf[0]=INTSEQ_DELTA;
+        len=1;
+        len+=encode_sized_sint(buf+len,vals[0]);
+        len+=encode_sized_sint(buf+len,dlo);
+        buf[len++]=dbits;
+        context->outfill+=len;
+        for (ix=count-1; ix>0; ix--) {
+            vals[ix]-=vals[ix-1]+dlo;
+        }
+        return store_packed(context,vals+1,count-1,dbits);
+    }
+    buf[0]=INTSEQ_FOR;
+    len=1;
+    len+=encode_sized_sint(buf+len,lo);
+    buf[len++]=bits;
+    context->outfill+=len;
+    for (ix=0; ix<count; ix++) {
+        vals[ix]-=lo;
+    }
+    return store_packed(context,vals,count,bits);
+}
+
+/*
+  A float run is XORed value by value in the manner of Gorilla, unless
+  that comes out bigger than plain floats.  Each XOR is a 0 bit when
+  the value repeats, or a 1 bit and then either a 0 bit and the
+  meaningful bits in the window of the previous XOR, or a 1 bit, six
+  bits of leading zeros, six bits of length less one and that many
+  meaningful bits.  The first value is all 64 bits.
+*/
+
+static int store_floats(
+    store_context_t *context,
+    store_val_t const *vals,
+    size_t stride,
+    size_t count)
+{
+    int endian=context->c.double_end;
+    sqlite3_uint64 prev,u,xor;
+    unsigned int lead,trail,wlead=0,wlen=0;
+    size_t plain=0,start,ix;
+    unsigned char *buf;
+    bitout_t out;
+
+    for (ix=0; ix<count; ix++) {
+        u=double_bits(vals[ix*stride].u.f,endian);
+        plain+=1+(u ? 8-__builtin_ctzll(u)/8 : 0);
+    }
+    if (context->outcap-context->outfill<count*10+16
+            && out_grow(context,count*10+16))
+        return -1;
+    start=context->outfill;
+    out.dst=context->outbuf+start+1;
+    out.acc=0;
+    out.have=0;
+    prev=double_bits(vals->u.f,endian);
+    bits_put(&out,prev,64);
+    for (ix=1; ix<count; ix++) {
+        u=double_bits(vals[ix*stride].u.f,endian);
+        xor=u^prev;
+        prev=u;
+        if (!xor) {
+            bits_put(&out,0,1);
+            continue;
+        }
+        lead=__builtin_clzll(xor);
+        trail=__builtin_ctzll(xor);
+        if (wlen && lead>=wlead && trail>=64-wlead-wlen) {
+            bits_put(&out,1,2);
+        } else {
+            wlead=lead;
+            wlen=64-lead-trail;
+            bits_put(&out,3,2);
+            bits_put(&out,wlead,6);
+            bits_put(&out,wlen-1,6);
+        }
+        bits_put(&out,xor>>(64-wlead-wlen),wlen);
+    }
+    if ((size_t)(bits_end(&out)-context->outbuf)-start<1+plain) {
+        context->outbuf[start]=FLOATRUN_XOR;
+        context->outfill=out.dst-context->outbuf;
+        return 0;
+    }
+    context->outbuf[start]=FLOATRUN_PLAIN;
+    context->outfill=start+1;
+    for (ix=0; ix<count; ix++) {
+        buf=out_reserve(context,9);
+        if (!buf)
+            return -1;
+        buf[0]=encode_float(buf+1,vals[ix*stride].u.f,endian);
+        context->outfill+=1+buf[0];
+    }
+    return 0;
+}
+
+/*
+  Encode count values of the same type, stride values apart.
+*/
+
+static int store_run(
+    store_context_t *context,
+    store_val_t const *vals,
+    size_t stride,
+    size_t count)
+{
+    sqlite3_uint64 *ints=context->groupints;
+    unsigned char *buf;
+    unsigned int width;
+    size_t ix;
+
+    buf=out_reserve(context,10);
+    if (!buf)
+        return -1;
+    width=encode_uint(buf+1,count-1);
+    switch (vals->type) {
+    case SQLITE_NULL:
+        buf[0]=NULLRUN(width);
+        context->outfill+=1+width;
+        return 0;
+    case SQLITE_INTEGER:
+        buf[0]=INTRUN(width);
+        context->outfill+=1+width;
+        for (ix=0; ix<count; ix++) {
+            ints[ix]=vals[ix*stride].u.i;
+        }
+        return store_ints(context,ints,count);
+    case SQLITE_FLOAT:
+        buf[0]=FLOATRUN(width);
+        context->outfill+=1+width;
+        return store_floats(context,vals,stride,count);
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+        if (vals->dict) {
+            buf[0]=TEXTRUN(width);
+            buf[1+width]=TEXTRUN_DICT;
+            context->outfill+=2+width;
+            for (ix=0; ix<count; ix++) {
+                ints[ix]=vals[ix*stride].dict-1;
+            }
+            return store_ints(context,ints,count);
+        }
+        if (vals->shared==SHARE_REF) {
+            buf[0]=BLOBRUN(width);
+            buf[1+width]=BLOBRUN_REF;
+            context->outfill+=2+width;
+            for (ix=0; ix<count; ix++) {
+                ints[ix]=vals[ix*stride].u.i;
+            }
+            return store_ints(context,ints,count);
+        }
+        if (vals->type==SQLITE_TEXT) {
+            buf[0]=TEXTRUN(width);
+            buf[1+width]=vals->coded ? TEXTRUN_SYMBOLS : TEXTRUN_PLAIN;
+        } else {
+            buf[0]=BLOBRUN(width);
+            buf[1+width]=vals->coded ? BLOBRUN_HASH
+                : vals->shared ? BLOBRUN_SHARED : BLOBRUN_PLAIN;
+        }
+        context->outfill+=2+width;
+        for (ix=0; ix<count; ix++) {
+            ints[ix]=vals[ix*stride].size;
+        }
+        if (store_ints(context,ints,count))
+            return -1;
+        for (ix=0; ix<count; ix++) {
+            store_val_t const *val=&vals[ix*stride];
+            void const *data=context->groupdata+val->u.offset;
+
+            if (val->coded) {
+                if (wd(context,data,val->coded))
+                    return -1;
+            } else if (val->type==SQLITE_TEXT) {
+                if ((*context->vt->write_text)(context,data,val->size))
+                    return -1;
+            } else {
+                if (wd(context,data,val->size))
+                    return -1;
+            }
+        }
+        return 0;
+    }
+    errf(
+        &context->c,SQLITE_INTERNAL,
+        "Internal error: column group value type %d",vals->type);
+    return -1;
+}
+
+/*
+  Encode the group into the block buffer, one column after another,
+  each as runs of values of the same type.
+*/
+
+static int store_group(
+    store_context_t *context)
+{
+    size_t colcnt=context->groupcols;
+    size_t rows=context->groupfill/colcnt;
+    size_t colix,start,end;
+
+    for (colix=0; colix<colcnt; colix++) {
+        store_val_t const *vals=context->group+colix;
+
+        for (start=0; start<rows; start=end) {
+            int type=vals[start*colcnt].type;
+
+            for (end=start+1;
+                    end<rows && vals[end*colcnt].type==type
+                        && !vals[end*colcnt].dict==!vals[start*colcnt].dict
+                        && !vals[end*colcnt].coded==!vals[start*colcnt].coded
+                        && vals[end*colcnt].shared==vals[start*colcnt].shared;
+                    end++)
+                ;
+            if (store_run(context,vals+start*colcnt,colcnt,end-start))
+                return -1;
+        }
+    }
+    context->groupfill=0;
+    context->groupdatasize=0;
+    return 0;
+}
+
+/*
+  The current position in the dump; not valid while building a block.
+*/
+
+static sqlite3_uint64 out_tell(
+    store_context_t *context)
+{
+    return context->outdone+context->outfill;
+}
+
+static int toc_add(
+    store_context_t *context,
+    conststr_t ident,
+    int colcnt,
+    sqlite3_uint64 offset,
+    sqlite3_uint64 rows,
+    sqlite3_uint64 size)
+{
+    toc_entry_t *entry;
+
+    if (context->toccnt>=context->toccap) {
+        size_t cap=context->toccap ? context->toccap*2 : 64;
+        toc_entry_t *grown;
+
+        grown=crealloc(&context->c,context->toc,cap*sizeof *grown);
+        if (!grown)
+            return -1;
+        context->toc=grown;
+        context->toccap=cap;
+    }
+    entry=&context->toc[context->toccnt];
+    entry->name=cmalloc(&context->c,ident.size ? ident.size : 1);
+    if (!entry->name)
+        return -1;
+    memcpy(entry->name,ident.text,ident.size);
+    entry->namesize=ident.size;
+    entry->offset=offset;
+    entry->rows=rows;
+    entry->size=size;
+    entry->colcnt=colcnt;
+    context->toccnt++;
+    return 0;
+}
+
+static int store_rowset_head(
+    store_context_t *context,
+    conststr_t ident,
+    int colcnt)
+{
+    unsigned char buf[17];
+    unsigned int namewidth,colswidth;
+
+    context->setstart=out_tell(context);
+    context->setrows=0;
+    context->columnar=(context->flags & S3BD_STORE_COLUMNAR)
+        && colcnt<=COLBLOCK_VALUES;
+    context->groupcols=colcnt;
+    if (context->columnar)
+        context->typeuse=0;
+    if ((!context->columnar || context->streamcnt)
+            && row_alloc(context,colcnt))
+        return -1;
+    if (dict_reset(context,colcnt))
+        return -1;
+    symtab_reset(context);
+    dedup_reset(context);
+
+    colswidth=encode_uint(buf+1,colcnt-1);
+    namewidth=encode_uint(buf+1+colswidth,ident.size);
+    buf[0]=ROWSET(colswidth,namewidth);
+    if (wd(context,buf,1+colswidth+namewidth))
+        return -1;
+    if ((*context->vt->write_text)(context,ident.text,ident.size))
+        return -1;
+    if (!context->typeuse)
+        return 0;
+    buf[0]=TYPES(colswidth);
+    if (wd(context,buf,1+colswidth))
+        return -1;
+    return wd(context,context->types,colcnt);
+}
+
+/*
+  Finish the rowset, and remember it for the table of contents.
+*/
+
+static int store_rowset_tail(
+    store_context_t *context,
+    conststr_t ident,
+    int colcnt)
+{
+    if (context->inblock && out_block_finish(context))
+        return -1;
+    context->columnar=0;
+    context->typeuse=0;
+    context->streamcnt=0;
+    context->dictuse=0;
+    context->symuse=0;
+    context->shareuse=0;
+    if (wc(context,ENDSET()))
+        return -1;
+    if (!(context->flags & S3BD_STORE_TOC))
+        return 0;
+    return toc_add(
+        context,ident,colcnt,context->setstart,context->setrows,
+        out_tell(context)-context->setstart);
+}
+
+static int store_rowset(
+    store_context_t *context,
+    conststr_t ident,
+    sqlite3_stmt *stmt)
+{
+    store_vt const *vt=context->vt;
+    int status;
+    int colcnt,colix;
+    int streamed;
+
+    colcnt=sqlite3_column_count(stmt)-stream_extra(context);
+    if (colcnt<=0)
+        return 0;
+    if (store_rowset_head(context,ident,colcnt))
+        return -1;
+    if (out_block_enter(context))
+        return -1;
+    for (;;) {
+        status=sqlite3_step(stmt);
+        if (status!=SQLITE_ROW)
+            break;
+        context->stats.rows++;
+        if (colcnt+stream_extra(context)!=sqlite3_data_count(stmt)) {
+            errf(
+                &context->c,SQLITE_ERROR,
+                "While extracting rows: Column count mismatch");
+            return -1;
+        }
+        streamed=context->streamcnt && stream_row(context,stmt,colcnt);
+        if (streamed && stream_row_start(context))
+            return -1;
+        if (!context->columnar) {
+            for (colix=0; colix<colcnt; colix++) {
+                if (sqlite3_column_type(stmt,colix)==SQLITE_NULL
+                        && !stream_size(context,stmt,colcnt,colix))
+                    row_null(context,colix);
+            }
+            if (store_row_start(context))
+                return -1;
+        }
+        for (colix=0; colix<colcnt; colix++) {
+            int type;
+            conststr_t text;
+            void const *blob;
+            unsigned char hash[SHA256_SIZE];
+            size_t size;
+
+            type=sqlite3_column_type(stmt,colix);
+            switch (type) {
+            case SQLITE_NULL:
+                size=stream_size(context,stmt,colcnt,colix);
+                if (!size) {
+                    if (store_nullcol(context))
+                        return -1;
+                } else if (stream_stored(context,size)) {
+                    if (stream_store(
+                            &context->c,context,stmt,colcnt,colix,size,hash)
+                            || store_hash(context,hash,size))
+                        return -1;
+                } else if (store_streamcol(context,size)) {
+                    return -1;
+                }
+                break;
+            case SQLITE_INTEGER:
+                if (store_intcol(context,sqlite3_column_int64(stmt,colix)))
+                    return -1;
+                break;
+            case SQLITE_FLOAT:
+                if (store_floatcol(context,sqlite3_column_double(stmt,colix)))
+                    return -1;
+                break;
+            case SQLITE_TEXT:
+                if ((*vt->column_text)(&context->c,stmt,colix,&text))
+                    return -1;
+                if (store_textcol(context,text.text,text.size))
+                    return -1;
+                break;
+            case SQLITE_BLOB:
+                size=sqlite3_column_bytes(stmt,colix);
+                if (size>0) {
+                    blob=sqlite3_column_blob(stmt,colix);
+                    if (!blob) {
+                        context->c.status=SQLITE_NOMEM;
+                        return -1;
+                    }
+                } else {
+                    blob=NULL;
+                }
+                if (store_blobcol(context,blob,size))
+                    return -1;
+                break;
+            default:
+                errf(
+                    &context->c,SQLITE_ERROR,
+                    "While extracting rows: Unknown column type %d",type);
+                return -1;
+            }
+        }
+        if (out_block_row(context))
+            return -1;
+        if (streamed && (stream_row_end(context)
+                || store_streams(context,stmt,colcnt)))
+            return -1;
+    }
+    if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While extracting rows: sqlite3_step: %s",
+            sqlite3_errmsg(context->c.connection));
+        return -1;
+    }
+    return store_rowset_tail(context,ident,colcnt);
+}
+
+/*
+  Pipelined variant of store_rowset.  The calling thread only steps
+  the statement and copies the column values into row batches; a writer
+  thread encodes the batches and does the output.  A small ring of batches
+  between them absorbs hiccups on either side, and the time each side
+  spends waiting for the other shows which one is the bottleneck.
+
+  While the writer runs, it owns the context (output buffer and error
+  state), so the stepping side reports its own errors to a private
+  context_t that is merged once the writer is done.
+
+  A row with streamed values ends its batch.  The stepping side then
+  reads the values and passes them on in batches of one chunk each,
+  which the writer turns into stream records.
+*/
+
+#define PIPE_BATCHES	4
+#define PIPE_ROWS	1024
+#define PIPE_BYTES	1048576
+
+typedef struct pipe_batch_t {
+    store_val_t *vals;
+    unsigned char *data;
+    size_t datasize;
+    size_t datacap;
+    size_t rows;
+    unsigned char streamed;
+    unsigned char chunk;
+} pipe_batch_t;
+
+typedef struct store_ring_t {
+    store_context_t *context;
+    int colcnt;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pipe_batch_t batches[PIPE_BATCHES];
+    unsigned int head;
+    unsigned int full;
+    unsigned char eos;
+    unsigned char abort;
+} store_ring_t;
+
+static void add_stats(
+    s3bd_store_stats_t *stats,
+    s3bd_store_stats_t const *more)
+{
+    stats->rows+=more->rows;
+    stats->full_waits+=more->full_waits;
+    stats->full_wait_ns+=more->full_wait_ns;
+    stats->empty_waits+=more->empty_waits;
+    stats->empty_wait_ns+=more->empty_wait_ns;
+}
+
+static sqlite3_uint64 pipe_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (sqlite3_uint64)now.tv_sec*1000000000+now.tv_nsec;
+}
+
+static int pipe_write_batch(
+    store_context_t *context,
+    int colcnt,
+    pipe_batch_t const *batch)
+{
+    store_val_t const *val=batch->vals;
+    size_t rowix;
+    int colix;
+    int streamed;
+
+    if (batch->chunk)
+        return store_stream(context,batch->data,batch->datasize);
+    if (!context->inblock && out_block_enter(context))
+        return -1;
+    for (rowix=0; rowix<batch->rows; rowix++) {
+        streamed=batch->streamed && rowix==batch->rows-1;
+        if (streamed && stream_row_start(context))
+            return -1;
+        if (!context->columnar) {
+            for (colix=0; colix<colcnt; colix++) {
+                if (val[colix].type==SQLITE_NULL)
+                    row_null(context,colix);
+            }
+            if (store_row_start(context))
+                return -1;
+        }
+        for (colix=0; colix<colcnt; colix++, val++) {
+            switch (val->type) {
+            case SQLITE_NULL:
+                if (store_nullcol(context))
+                    return -1;
+                break;
+            case SQLITE_INTEGER:
+                if (store_intcol(context,val->u.i))
+                    return -1;
+                break;
+            case SQLITE_FLOAT:
+                if (store_floatcol(context,val->u.f))
+                    return -1;
+                break;
+            case SQLITE_TEXT:
+                if (store_textcol(
+                        context,batch->data+val->u.offset,val->size))
+                    return -1;
+                break;
+            case SQLITE_BLOB:
+                if (store_blobcol(
+                        context,batch->data+val->u.offset,val->size))
+                    return -1;
+                break;
+            case STREAMED:
+                if (store_streamcol(context,val->size))
+                    return -1;
+                break;
+            case HASHED:
+                if (store_hash(
+                        context,batch->data+val->u.offset,val->size))
+                    return -1;
+                break;
+            }
+        }
+        if (out_block_row(context))
+            return -1;
+        if (streamed && stream_row_end(context))
+            return -1;
+    }
+    return 0;
+}
+
+static void *pipe_writer(
+    void *arg)
+{
+    store_ring_t *ring=arg;
+    store_context_t *context=ring->context;
+    sqlite3_uint64 waited;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        pipe_batch_t *batch;
+
+        if (!ring->full && !ring->eos && !ring->abort) {
+            context->stats.empty_waits++;
+            waited=pipe_clock();
+            do {
+                pthread_cond_wait(&ring->changed,&ring->lock);
+            } while (!ring->full && !ring->eos && !ring->abort);
+            context->stats.empty_wait_ns+=pipe_clock()-waited;
+        }
+        if (ring->abort || !ring->full)
+            break;
+        batch=&ring->batches[(ring->head+PIPE_BATCHES-ring->full)%PIPE_BATCHES];
+        pthread_mutex_unlock(&ring->lock);
+        if (pipe_write_batch(context,ring->colcnt,batch)) {
+            pthread_mutex_lock(&ring->lock);
+            ring->abort=1;
+            pthread_cond_broadcast(&ring->changed);
+            break;
+        }
+        pthread_mutex_lock(&ring->lock);
+        ring->full--;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+static int pipe_copy(
+    context_t *err,
+    pipe_batch_t *batch,
+    store_val_t *val,
+    void const *data,
+    size_t size)
+{
+    if (batch->datacap-batch->datasize<size) {
+        size_t cap=batch->datacap ? batch->datacap*2 : PIPE_BYTES;
+        unsigned char *grown;
+
+        if (cap-batch->datasize<size)
+            cap=batch->datasize+size;
+        grown=crealloc(err,batch->data,cap);
+        if (!grown)
+            return -1;
+        batch->data=grown;
+        batch->datacap=cap;
+    }
+    val->u.offset=batch->datasize;
+    val->size=size;
+    if (size>0)
+        memcpy(batch->data+batch->datasize,data,size);
+    batch->datasize+=size;
+    return 0;
+}
+
+static int pipe_fill_batch(
+    store_context_t *context,
+    context_t *err,
+    sqlite3_stmt *stmt,
+    int colcnt,
+    pipe_batch_t *batch)
+{
+    store_val_t *val;
+    int status=SQLITE_DONE;
+    int colix;
+
+    if (!batch->vals) {
+        batch->vals=cmalloc(err,PIPE_ROWS*colcnt*sizeof *batch->vals);
+        if (!batch->vals)
+            return -1;
+    }
+    batch->rows=0;
+    batch->datasize=0;
+    batch->streamed=0;
+    batch->chunk=0;
+    val=batch->vals;
+    while (batch->rows<PIPE_ROWS && batch->datasize<PIPE_BYTES
+            && !batch->streamed) {
+        status=sqlite3_step(stmt);
+        if (status!=SQLITE_ROW)
+            break;
+        if (colcnt+stream_extra(context)!=sqlite3_data_count(stmt)) {
+            errf(
+                err,SQLITE_ERROR,
+                "While extracting rows: Column count mismatch");
+            return -1;
+        }
+        batch->streamed=context->streamcnt
+            && stream_row(context,stmt,colcnt);
+        for (colix=0; colix<colcnt; colix++, val++) {
+            conststr_t text;
+            void const *blob;
+            unsigned char hash[SHA256_SIZE];
+            size_t size;
+
+            val->type=sqlite3_column_type(stmt,colix);
+            switch (val->type) {
+            case SQLITE_NULL:
+                size=stream_size(context,stmt,colcnt,colix);
+                if (!size)
+                    break;
+                if (stream_stored(context,size)) {
+                    if (stream_store(err,context,stmt,colcnt,colix,size,hash)
+                            || pipe_copy(err,batch,val,hash,SHA256_SIZE))
+                        return -1;
+                    val->type=HASHED;
+                } else {
+                    val->type=STREAMED;
+                }
+                val->size=size;
+                break;
+            case SQLITE_INTEGER:
+                val->u.i=sqlite3_column_int64(stmt,colix);
+                break;
+            case SQLITE_FLOAT:
+                val->u.f=sqlite3_column_double(stmt,colix);
+                break;
+            case SQLITE_TEXT:
+                if ((*context->vt->column_text)(err,stmt,colix,&text))
+                    return -1;
+                if (pipe_copy(err,batch,val,text.text,text.size))
+                    return -1;
+                break;
+            case SQLITE_BLOB:
+                size=sqlite3_column_bytes(stmt,colix);
+                if (size>0) {
+                    blob=sqlite3_column_blob(stmt,colix);
+                    if (!blob) {
+                        err->status=SQLITE_NOMEM;
+                        return -1;
+                    }
+                } else {
+                    blob=NULL;
+                }
+                if (pipe_copy(err,batch,val,blob,size))
+                    return -1;
+                break;
+            default:
+                errf(
+                    err,SQLITE_ERROR,
+                    "While extracting rows: Unknown column type %d",
+                    val->type);
+                return -1;
+            }
+        }
+        batch->rows++;
+    }
+    if (status!=SQLITE_ROW && status!=SQLITE_DONE) {
+        errf(
+            err,status,
+            "While extracting rows: sqlite3_step: %s",
+            sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        return -1;
+    }
+    return status==SQLITE_DONE;
+}
+
+/*
+  Wait for a free batch, or return NULL if the writer gave up.
+*/
+
+static pipe_batch_t *pipe_free_batch(
+    store_ring_t *ring,
+    s3bd_store_stats_t *stats)
+{
+    pipe_batch_t *batch=NULL;
+    sqlite3_uint64 started;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->full>=PIPE_BATCHES && !ring->abort) {
+        stats->full_waits++;
+        started=pipe_clock();
+        do {
+            pthread_cond_wait(&ring->changed,&ring->lock);
+        } while (ring->full>=PIPE_BATCHES && !ring->abort);
+        stats->full_wait_ns+=pipe_clock()-started;
+    }
+    if (!ring->abort)
+        batch=&ring->batches[ring->head];
+    pthread_mutex_unlock(&ring->lock);
+    return batch;
+}
+
+static void pipe_push_batch(
+    store_ring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->head=(ring->head+1)%PIPE_BATCHES;
+    ring->full++;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+  Pass on the streamed values of the current row of stmt in chunks.
+*/
+
+static int pipe_streams(
+    store_ring_t *ring,
+    context_t *err,
+    sqlite3_stmt *stmt,
+    s3bd_store_stats_t *stats)
+{
+    store_context_t *context=ring->context;
+    int colcnt=ring->colcnt;
+    sqlite3_blob *blob=NULL;
+    pipe_batch_t *batch;
+    size_t size,done,chunk;
+    int colix;
+
+    for (colix=0; colix<colcnt; colix++) {
+        size=stream_size(context,stmt,colcnt,colix);
+        if (!size || stream_stored(context,size))
+            continue;
+        if (stream_open(
+                err,context->streamtable,stmt,colcnt,colix,size,&blob))
+            goto cleanup;
+        for (done=0; done<size; done+=chunk) {
+            chunk=size-done<STREAM_CHUNK ? size-done : STREAM_CHUNK;
+            batch=pipe_free_batch(ring,stats);
+            if (!batch)
+                goto cleanup;
+            if (batch->datacap<STREAM_CHUNK) {
+                sqlite3_free(batch->data);
+                batch->datacap=0;
+                batch->data=cmalloc(err,STREAM_CHUNK);
+                if (!batch->data)
+                    goto cleanup;
+                batch->datacap=STREAM_CHUNK;
+            }
+            if (stream_read(err,blob,batch->data,chunk,done))
+                goto cleanup;
+            batch->datasize=chunk;
+            batch->rows=0;
+            batch->streamed=0;
+            batch->chunk=1;
+            pipe_push_batch(ring);
+        }
+        sqlite3_blob_close(blob);
+        blob=NULL;
+    }
+    return 0;
+
+cleanup:
+    if (blob)
+        sqlite3_blob_close(blob);
+    return -1;
+}
+
+static int pipe_step(
+    store_ring_t *ring,
+    context_t *err,
+    sqlite3_stmt *stmt,
+    s3bd_store_stats_t *stats)
+{
+    int done=0;
+
+    while (!done) {
+        pipe_batch_t *batch;
+        int streamed;
+
+        batch=pipe_free_batch(ring,stats);
+        if (!batch)
+            break;
+        done=pipe_fill_batch(ring->context,err,stmt,ring->colcnt,batch);
+        if (done<0)
+            break;
+        stats->rows+=batch->rows;
+        streamed=batch->streamed;
+        if (batch->rows>0)
+            pipe_push_batch(ring);
+        if (streamed && pipe_streams(ring,err,stmt,stats)) {
+            done=-1;
+            break;
+        }
+    }
+    pthread_mutex_lock(&ring->lock);
+    if (done>0)
+        ring->eos=1;
+    else
+        ring->abort=1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    return done>0 ? 0 : -1;
+}
+
+static int store_rowset_piped(
+    store_context_t *context,
+    conststr_t ident,
+    sqlite3_stmt *stmt)
+{
+    store_ring_t ring;
+    s3bd_store_stats_t stats;
+    context_t err;
+    pthread_t writer;
+    unsigned int ix;
+    int colcnt;
+    int result;
+
+    colcnt=sqlite3_column_count(stmt)-stream_extra(context);
+    if (colcnt<=0)
+        return 0;
+    if (store_rowset_head(context,ident,colcnt))
+        return -1;
+    if (out_block_enter(context))
+        return -1;
+    memset(&ring,0,sizeof ring);
+    memset(&stats,0,sizeof stats);
+    memset(&err,0,sizeof err);
+    ring.context=context;
+    ring.colcnt=colcnt;
+    pthread_mutex_init(&ring.lock,NULL);
+    pthread_cond_init(&ring.changed,NULL);
+    if (pthread_create(&writer,NULL,pipe_writer,&ring)) {
+        pthread_cond_destroy(&ring.changed);
+        pthread_mutex_destroy(&ring.lock);
+        errf(
+            &context->c,SQLITE_ERROR,
+            "While extracting rows: Failed to start writer thread");
+        return -1;
+    }
+    result=pipe_step(&ring,&err,stmt,&stats);
+    pthread_join(writer,NULL);
+    pthread_cond_destroy(&ring.changed);
+    pthread_mutex_destroy(&ring.lock);
+    for (ix=0; ix<PIPE_BATCHES; ix++) {
+        sqlite3_free(ring.batches[ix].vals);
+        sqlite3_free(ring.batches[ix].data);
+    }
+    add_stats(&context->stats,&stats);
+    if (result) {
+        move_error(&context->c,&err);
+        sqlite3_free(err.errmsg);
+        return -1;
+    }
+    if (ring.abort)
+        return -1;
+    return store_rowset_tail(context,ident,colcnt);
+}
+
+static char const getenc_sql[] =
+    "pragma encoding";
+
+static int store_header(
+    store_context_t *context)
+{
+    int status;
+    sqlite3_stmt *get=NULL;
+    int encoding=-1;
+    s3bd_header_t header;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        getenc_sql,sizeof getenc_sql,
+        &get,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While getting database encoding: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    for (;;) {
+        conststr_t encname;
+        int encix;
+
+        status=sqlite3_step(get);
+        if (status!=SQLITE_ROW)
+            break;
+        if (column_text8(&context->c,get,0,&encname))
+            goto cleanup;
+        for (encix=1; encix<=3; encix++) {
+            if (conststr_eq(encname,encoding_names[encix])) {
+                encoding=encix;
+                break;
+            }
+        }
+    }
+    if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While getting database encoding: sqlite3_step: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    sqlite3_finalize(get);
+    get=NULL;
+    if (encoding<1) {
+        errf(
+            &context->c,SQLITE_ERROR,
+            "Failed to determine database text encoding");
+        goto cleanup;
+    }
+
+    memcpy(header.magic,s3bd_header_magic,sizeof header.magic);
+    header.ver_major=CURVER_MAJOR;
+    header.ver_minor=CURVER_MINOR;
+    header.encoding=encoding;
+    if (wd(context,&header,sizeof header))
+        goto cleanup;
+    context->c.db_enc=encoding;
+    if (encoding>SQLITE_UTF8) {
+        context->vt=&store_vt16;
+        context->c.native_enc=endian_short();
+        if (!context->c.native_enc) {
+            errf(
+                &context->c,SQLITE_ERROR,
+                "Failed to determine short integer endianness");
+            goto cleanup;
+        }
+    } else {
+        context->vt=&store_vt8;
+        context->c.native_enc=encoding;
+    }
+    context->c.double_end=endian_double();
+    if (!context->c.double_end) {
+        errf(
+            &context->c,SQLITE_ERROR,
+            "Unsupported floating-point format");
+        goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    if (get)
+        sqlite3_finalize(get);
+    return -1;
+}
+
+typedef struct pragma_def_t {
+    int phase;
+    conststr_t name;
+} pragma_def_t;
+
+static pragma_def_t const pragma_defs[] =
+{
+    {PRAGMA_PHASE_PRE_TRANSACTION,	CONSTSTR0("page_size")},
+    {PRAGMA_PHASE_PRE_TRANSACTION,	CONSTSTR0("auto_vacuum")},
+
+    {PRAGMA_PHASE_IN_TRANSACTION,	CONSTSTR0("application_id")},
+    {PRAGMA_PHASE_IN_TRANSACTION,	CONSTSTR0("user_version")},
+
+    {PRAGMA_PHASE_POST_TRANSACTION,	CONSTSTR0("journal_mode")},
+
+    {0, {NULL, 0}}
+};
+
+static char const pragmas_select_sql[] =
+    "select * from temp.pragmas";
+
+static char const pragma_sql_1[] =
+    "pragma ";
+
+static int extract_pragmas(
+    store_context_t *context)
+{
+    int status;
+    char *errmsg=NULL;
+    sqlite3_stmt *remember=NULL;
+    sqlite3_stmt *extract=NULL;
+    str_t sql;
+    pragma_def_t const *def;
+
+    str_init(&sql,&context->c);
+    status=sqlite3_exec(
+        context->c.connection,pragmas_create_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Failed to create temporary pragmas table: %s",errmsg);
+        goto cleanup;
+    }
+    context->have_pragmas=1;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        pragmas_insert_sql,sizeof pragmas_insert_sql,
+        &remember,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While getting pragma values: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    for (def=pragma_defs; def->name.text; def++) {
+        status=sqlite3_bind_int(remember,1,def->phase);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While getting pragma %s value: sqlite3_bind: %s",
+                def->name.text,sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+        status=sqlite3_bind_text(
+            remember,
+            2,
+            def->name.text,def->name.size,
+            SQLITE_STATIC);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While getting pragma %s value: sqlite3_bind: %s",
+                def->name.size,sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+        if (str8app_7(&sql,pragma_sql_1,sizeof pragma_sql_1-1))
+            goto cleanup;
+        if (str8app_id(&sql,def->name.text,def->name.size))
+            goto cleanup;
+        status=sqlite3_prepare_v2(
+            context->c.connection,
+            sql.text,sql.size,
+            &extract,
+            NULL);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While getting pragma %s value: sqlite3_prepare: %s",
+                def->name.text,sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+        str_free(&sql);
+        for (;;) {
+            sqlite3_value *value;
+
+            status=sqlite3_step(extract);
+            if (status!=SQLITE_ROW)
+                break;
+            value=sqlite3_column_value(extract,0);
+            if (!value) {
+                context->c.status=SQLITE_NOMEM;
+                goto cleanup;
+            }
+            status=sqlite3_bind_value(remember,3,value);
+            if (status!=SQLITE_OK) {
+                errf(
+                    &context->c,status,
+                    "While getting pragma %s value: sqlite3_bind: %s",
+                    def->name.text,sqlite3_errmsg(context->c.connection));
+                goto cleanup;
+            }
+            status=sqlite3_step(remember);
+            if (status!=SQLITE_DONE) {
+                errf(
+                    &context->c,status,
+                    "While getting pragma %s value: sqlite3_step: %s",
+                    def->name.text,sqlite3_errmsg(context->c.connection));
+                goto cleanup;
+            }
+            sqlite3_reset(remember);
+            sqlite3_bind_null(remember,2);
+        }
+        if (status!=SQLITE_DONE) {
+            errf(
+                &context->c,status,
+                "While getting pragma %s value: sqlite3_step: %s",
+                def->name.text,sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+        sqlite3_finalize(extract);
+        extract=NULL;
+    }
+    sqlite3_finalize(remember);
+    remember=NULL;
+    return 0;
+
+cleanup:
+    if (errmsg)
+        sqlite3_free(errmsg);
+    str_free(&sql);
+    if (remember)
+        sqlite3_finalize(remember);
+    if (extract)
+        sqlite3_finalize(extract);
+    return -1;
+}
+
+static int store_pragmas(
+    store_context_t *context)
+{
+    int status;
+    sqlite3_stmt *get_rows;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        pragmas_select_sql,sizeof pragmas_select_sql,
+        &get_rows,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While getting pragma values: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    if (store_rowset(context,context->vt->pragmas_id,get_rows))
+        goto cleanup;
+    sqlite3_finalize(get_rows);
+    get_rows=NULL;
+    return 0;
+
+cleanup:
+    if (get_rows)
+        sqlite3_finalize(get_rows);
+    return -1;
+}
+
+static void store_done_pragmas(
+    store_context_t *context)
+{
+    if (context->have_pragmas) {
+        sqlite3_exec(context->c.connection,pragmas_drop_sql,0,NULL,NULL);
+        context->have_pragmas=0;
+    }
+}
+
+#define __(x) #x
+#define _(x) __(x)
+
+static char const schema_extract_sql[] =
+    "create table temp.schema as "
+    "select "
+    "  case type "
+    "  when 'table' then "
+    "    case "
+    "    when rootpage>0 then "
+    "      " _(SCHEMA_PHASE_TABLE) " "
+    "    else "
+    "      " _(SCHEMA_PHASE_VIRTUAL_TABLE) " "
+    "    end "
+    "  when 'index' then "
+    "    " _(SCHEMA_PHASE_INDEX) " "
+    "  when 'view' then "
+    "    " _(SCHEMA_PHASE_VIEW) " "
+    "  when 'trigger' then "
+    "    " _(SCHEMA_PHASE_TRIGGER) " "
+    "  end as phase, "
+    "  name, "
+    "  sql "
+    "from sqlite_schema "
+    "  where sql is not null";
+
+static char const schema_select_sql[] =
+    "select * from temp.schema";
+
+static char const table_names_sql[] =
+    "select name,name='sqlite_sequence' from temp.schema "
+    "  where phase=" _(SCHEMA_PHASE_TABLE) " "
+    "  order by 2";
+
+static char const get_rows_sql_1[] =
+    "select ";
+static char const get_rows_sql_2[] =
+    " from ";
+
+static int store_schema(
+    store_context_t *context)
 {
     store_vt const *vt=context->vt;
-    unsigned char buf[17];
-    unsigned int namewidth,colswidth;
+    char *errmsg=NULL;
+    sqlite3_stmt *get_rows=NULL;
     int status;
-    int colcnt,colix;
 
-    colcnt=sqlite3_column_count(stmt);
-    if (!colcnt)
+    status=sqlite3_exec(
+        context->c.connection,schema_extract_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "Failed to extract schema: %s",errmsg);
+        goto cleanup;
+    }
+    context->have_schema=1;
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        schema_select_sql,sizeof schema_select_sql,
+        &get_rows,
+        NULL);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While extracting schema: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    if (store_rowset(context,vt->schema_id,get_rows))
+        goto cleanup;
+    sqlite3_finalize(get_rows);
+    get_rows=NULL;
+    return 0;
+
+cleanup:
+    if (errmsg)
+        sqlite3_free(errmsg);
+    if (get_rows)
+        sqlite3_finalize(get_rows);
+    return -1;
+}
+
+static void store_done_schema(
+    store_context_t *context)
+{
+    if (context->have_schema) {
+        sqlite3_exec(context->c.connection,schema_drop_sql,0,NULL,NULL);
+        context->have_schema=0;
+    }
+}
+
+/*
+  A range of rowids, used to split the extraction of a huge table
+  into several rowsets.  The rowid alias is one that isn't shadowed
+  by an actual column name.
+*/
+
+typedef struct store_range_t {
+    conststr_t rowid;
+    sqlite3_int64 first;
+    sqlite3_int64 last;
+} store_range_t;
+
+static char const get_rows_sql_3[] =
+    " where ";
+static char const get_rows_sql_4[] =
+    " between ?1 and ?2";
+
+static char const table_strict_sql[] =
+    "select strict from pragma_table_list(?1) where schema='main'";
+
+/*
+  Whether a table is STRICT (1 or 0), or -1 on errors.  An SQLite too old
+  for pragma table_list is too old for STRICT tables, too.
+*/
+
+static int table_strict(
+    store_context_t *context,
+    conststr_t tablename)
+{
+    sqlite3_stmt *stmt=NULL;
+    int status;
+    int strict=0;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        table_strict_sql,sizeof table_strict_sql,
+        &stmt,
+        NULL);
+    if (status==SQLITE_ERROR)
         return 0;
-    colswidth=encode_uint(buf+1,colcnt-1);
-    namewidth=encode_uint(buf+1+colswidth,ident.size);
-    buf[0]=ROWSET(colswidth,namewidth);
-    if (wd(context,buf,1+colswidth+namewidth))
-        return -1;
-    if ((*vt->write_text)(context,ident.text,ident.size))
-        return -1;
-    for (;;) {
+    if (status==SQLITE_OK)
+        status=sqlite3_bind_text64(
+            stmt,1,tablename.text,tablename.size,
+            SQLITE_STATIC,context->c.native_enc);
+    if (status==SQLITE_OK)
         status=sqlite3_step(stmt);
-        if (status!=SQLITE_ROW)
-            break;
-        if (colcnt!=sqlite3_data_count(stmt)) {
-            errf(
-                &context->c,SQLITE_ERROR,
-                "While extracting rows: Column count mismatch");
-            return -1;
-        }
-        for (colix=0; colix<colcnt; colix++) {
-            int type;
-            conststr_t text;
-            void const *blob;
-            size_t size;
+    if (status==SQLITE_ROW) {
+        strict=sqlite3_column_int(stmt,0)!=0;
+    } else if (status!=SQLITE_DONE) {
+        errf(
+            &context->c,status,
+            "While extracting tables: pragma table_list: %s",
+            sqlite3_errmsg(context->c.connection));
+        strict=-1;
+    }
+    sqlite3_finalize(stmt);
+    return strict;
+}
 
-            type=sqlite3_column_type(stmt,colix);
-            switch (type) {
-            case SQLITE_NULL:
-                if (wc(context,NULLCOL()))
-                    return -1;
-                break;
-            case SQLITE_INTEGER:
-                if (store_intcol(context,sqlite3_column_int64(stmt,colix)))
-                    return -1;
-                break;
-            case SQLITE_FLOAT:
-                if (store_floatcol(context,sqlite3_column_double(stmt,colix)))
-                    return -1;
-                break;
-            case SQLITE_TEXT:
-                if ((*vt->column_text)(&context->c,stmt,colix,&text))
-                    return -1;
-                if (store_textcol(context,text.text,text.size))
-                    return -1;
-                break;
-            case SQLITE_BLOB:
-                size=sqlite3_column_bytes(stmt,colix);
-                if (size>0) {
-                    blob=sqlite3_column_blob(stmt,colix);
-                    if (!blob) {
-                        context->c.status=SQLITE_NOMEM;
-                        return -1;
-                    }
-                } else {
-                    blob=NULL;
-                }
-                if (store_blobcol(context,blob,size))
-                    return -1;
-                break;
-            default:
-                errf(
-                    &context->c,SQLITE_ERROR,
-                    "While extracting rows: Unknown column type %d",type);
-                return -1;
+/*
+  The column type to declare for a column of a STRICT table,
+  given its declared type.
+*/
+
+static unsigned char strict_type(
+    char const *decl)
+{
+    if (!decl)
+        return 0;
+    if (!sqlite3_stricmp(decl,"INTEGER") || !sqlite3_stricmp(decl,"INT"))
+        return SQLITE_INTEGER;
+    if (!sqlite3_stricmp(decl,"REAL"))
+        return SQLITE_FLOAT;
+    if (!sqlite3_stricmp(decl,"TEXT"))
+        return SQLITE_TEXT;
+    if (!sqlite3_stricmp(decl,"BLOB"))
+        return SQLITE_BLOB;
+    return 0;
+}
+
+static conststr_t const rowid_aliases[3] =
+{
+    CONSTSTR0("rowid"),
+    CONSTSTR0("_rowid_"),
+    CONSTSTR0("oid")
+};
+
+static char const rowid_alias_sql[] =
+    "with alias(ix,name) as ( "
+    "  values (0,'rowid'),(1,'_rowid_'),(2,'oid') "
+    ") "
+    "select ix,list.name from alias,pragma_table_list(?1) as list "
+    "  where list.schema='main' and not list.wr "
+    "    and not exists ( "
+    "      select 1 from pragma_table_info(?1) as info "
+    "        where info.name=alias.name collate nocase "
+    "    ) "
+    "  order by ix limit 1";
+
+/*
+  Find a rowid alias of a table that isn't shadowed by an actual column
+  name, and if name isn't NULL, the table name in UTF-8 (to be freed).
+  Returns 1 if found, 0 for WITHOUT ROWID tables, tables with all
+  aliases shadowed, and with an SQLite too old for pragma table_list,
+  and -1 on errors.
+*/
+
+static int table_rowid(
+    store_context_t *context,
+    conststr_t tablename,
+    conststr_t *rowid,
+    char **name)
+{
+    sqlite3_stmt *get=NULL;
+    int status;
+    int aliasix=-1;
+
+    status=sqlite3_prepare_v2(
+        context->c.connection,
+        rowid_alias_sql,sizeof rowid_alias_sql,
+        &get,
+        NULL);
+    if (status==SQLITE_ERROR)
+        return 0;
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While extracting tables: sqlite3_prepare: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    status=sqlite3_bind_text64(
+        get,1,tablename.text,tablename.size,SQLITE_STATIC,
+        context->c.native_enc);
+    if (status!=SQLITE_OK) {
+        errf(
+            &context->c,status,
+            "While extracting tables: sqlite3_bind: %s",
+            sqlite3_errmsg(context->c.connection));
+        goto cleanup;
+    }
+    status=sqlite3_step(get);
+    if (status==SQLITE_ROW) {
+        aliasix=sqlite3_column_int(get,0);
+        if (name) {
+            char const *text=(char const *)sqlite3_column_text(get,1);
+            size_t size=sqlite3_column_bytes(get,1);
+
+            if (!text) {
+                context->c.status=SQLITE_NOMEM;
+                goto cleanup;
             }
+            *name=cmalloc(&context->c,size+1);
+            if (!*name)
+                goto cleanup;
+            memcpy(*name,text,size+1);
         }
-    }
-    if (status!=SQLITE_DONE) {
+    } else if (status!=SQLITE_DONE) {
         errf(
             &context->c,status,
-            "While extracting rows: sqlite3_step: %s",
+            "While extracting tables: sqlite3_step: %s",
             sqlite3_errmsg(context->c.connection));
-        return -1;
+        goto cleanup;
     }
-    return wc(context,ENDSET());
+    sqlite3_finalize(get);
+    if (aliasix<0 || aliasix>2)
+        return 0;
+    *rowid=rowid_aliases[aliasix];
+    return 1;
+
+cleanup:
+    if (get)
+        sqlite3_finalize(get);
+    return -1;
 }
 
-static char const getenc_sql[] =
-    "pragma encoding";
+static char const stream_indexed_sql[] =
+    "select 1 from pragma_index_list(?1) as list, "
+    "    pragma_index_info(list.name) as info "
+    "  where list.origin<>'c' and info.name=?2";
 
-static int store_header(
-    store_context_t *context)
+static char const stream_room_sql[] =
+    "select page_count*page_size, "
+    "    (select count(*) from pragma_table_info(?1)) "
+    "  from pragma_page_count, pragma_page_size";
+
+/*
+  Get ready to stream the big blobs of a table, if it has rowids and
+  the database is big enough to have any: look up its rowid alias and
+  UTF-8 name, prepare *indexed for stream_column, and work out in *room
+  how many size columns fit in a result set along with the table's
+  columns and rowid.
+*/
+
+static int stream_prepare(
+    store_context_t *context,
+    conststr_t tablename,
+    conststr_t *rowid,
+    sqlite3_stmt **indexed,
+    int *room)
 {
     int status;
-    sqlite3_stmt *get=NULL;
-    int encoding=-1;
-    s3bd_header_t header;
 
+    *room=0;
+    sqlite3_free(context->streamtable);
+    context->streamtable=NULL;
     status=sqlite3_prepare_v2(
         context->c.connection,
-        getenc_sql,sizeof getenc_sql,
-        &get,
+        stream_room_sql,sizeof stream_room_sql,
+        indexed,
         NULL);
-    if (status!=SQLITE_OK) {
-        errf(
-            &context->c,status,
-            "While getting database encoding: sqlite3_prepare: %s",
-            sqlite3_errmsg(context->c.connection));
-        goto cleanup;
+    if (status==SQLITE_OK)
+        status=sqlite3_bind_text64(
+            *indexed,1,tablename.text,tablename.size,
+            SQLITE_STATIC,context->c.native_enc);
+    if (status==SQLITE_OK)
+        status=sqlite3_step(*indexed);
+    if (status==SQLITE_ROW) {
+        if ((sqlite3_uint64)sqlite3_column_int64(*indexed,0)
+                >=context->params.stream_min)
+            *room=sqlite3_limit(
+                context->c.connection,SQLITE_LIMIT_COLUMN,-1)
+                -sqlite3_column_int(*indexed,1)-1;
+        status=sqlite3_finalize(*indexed);
+        *indexed=NULL;
     }
-    for (;;) {
-        conststr_t encname;
-        int encix;
-
-        status=sqlite3_step(get);
-        if (status!=SQLITE_ROW)
-            break;
-        if (column_text8(&context->c,get,0,&encname))
-            goto cleanup;
-        for (encix=1; encix<=3; encix++) {
-            if (conststr_eq(encname,encoding_names[encix])) {
-                encoding=encix;
-                break;
-            }
+    if (status==SQLITE_OK && *room<=0)
+        return 0;
+    if (status==SQLITE_OK) {
+        switch (table_rowid(
+                    context,tablename,rowid,&context->streamtable)) {
+        case -1:
+            return -1;
+        case 0:
+            return 0;
         }
+        status=sqlite3_prepare_v2(
+            context->c.connection,
+            stream_indexed_sql,sizeof stream_indexed_sql,
+            indexed,
+            NULL);
     }
-    if (status!=SQLITE_DONE) {
+    if (status==SQLITE_OK)
+        status=sqlite3_bind_text64(
+            *indexed,1,tablename.text,tablename.size,
+            SQLITE_STATIC,context->c.native_enc);
+    if (status!=SQLITE_OK) {
         errf(
             &context->c,status,
-            "While getting database encoding: sqlite3_step: %s",
+            "While extracting tables: sqlite3_prepare: %s",
             sqlite3_errmsg(context->c.connection));
-        goto cleanup;
-    }
-    sqlite3_finalize(get);
-    get=NULL;
-    if (encoding<1) {
-        errf(
-            &context->c,SQLITE_ERROR,
-            "Failed to determine database text encoding");
-        goto cleanup;
+        return -1;
     }
+    return 0;
+}
 
-    memcpy(header.magic,s3bd_header_magic,sizeof header.magic);
-    header.ver_major=CURVER_MAJOR;
-    header.ver_minor=CURVER_MINOR;
-    header.encoding=encoding;
-    if (wd(context,&header,sizeof header))
-        goto cleanup;
-    context->c.db_enc=encoding;
-    if (encoding>SQLITE_UTF8) {
-        context->vt=&store_vt16;
-        context->c.native_enc=endian_short();
-        if (!context->c.native_enc) {
-            errf(
-                &context->c,SQLITE_ERROR,
-                "Failed to determine short integer endianness");
-            goto cleanup;
-        }
+/*
+  Whether the values of the column that list_columns (pragma table_info)
+  is on may be streamed: it must be declared BLOB (or ANY in a STRICT
+  table), since only blobs are, and it must not be in an index that
+  comes with the table, since the loader couldn't write it with
+  sqlite3_blob_write.  Untyped columns are left alone, as the test
+  costs every value of them something.  Returns 1, 0, or -1 on errors.
+*/
+
+static int stream_column(
+    store_context_t *context,
+    sqlite3_stmt *indexed,
+    sqlite3_stmt *list_columns,
+    int strict)
+{
+    char const *decl=(char const *)sqlite3_column_text(list_columns,2);
+    int status;
+
+    if (strict) {
+        if (strict_type(decl) && strict_type(decl)!=SQLITE_BLOB)
+            return 0;
     } else {
-        context->vt=&store_vt8;
-        context->c.native_enc=encoding;
-    }
-    context->c.double_end=endian_double();
-    if (!context->c.double_end) {
-        errf(
-            &context->c,SQLITE_ERROR,
-            "Unsupported floating-point format");
-        goto cleanup;
+        if (!decl
+                || !sqlite3_strlike("%INT%",decl,0)
+                || !sqlite3_strlike("%CHAR%",decl,0)
+                || !sqlite3_strlike("%CLOB%",decl,0)
+                || !sqlite3_strlike("%TEXT%",decl,0)
+                || sqlite3_strlike("%BLOB%",decl,0))
+            return 0;
     }
-    return 0;
-
-cleanup:
-    if (get)
-        sqlite3_finalize(get);
+    status=sqlite3_bind_value(
+        indexed,2,sqlite3_column_value(list_columns,1));
+    if (status==SQLITE_OK)
+        status=sqlite3_step(indexed);
+    sqlite3_reset(indexed);
+    if (status==SQLITE_DONE)
+        return 1;
+    if (status==SQLITE_ROW)
+        return 0;
+    errf(
+        &context->c,status,
+        "While extracting tables: sqlite3_step: %s",
+        sqlite3_errmsg(context->c.connection));
     return -1;
 }
 
-typedef struct pragma_def_t {
-    int phase;
-    conststr_t name;
-} pragma_def_t;
+static char const stream_sql_1[] =
+    "case when typeof(";
+static char const stream_sql_2[] =
+    ")='blob' and length(";
+static char const stream_sql_3[] =
+    ")>=";
+static char const stream_sql_4[] =
+    " then ";
+static char const stream_sql_5[] =
+    "null else ";
+static char const stream_sql_6[] =
+    " end as ";
+static char const stream_sql_7[] =
+    "length(";
+static char const stream_sql_8[] =
+    ") end";
 
-static pragma_def_t const pragma_defs[] =
+/*
+  Append "case when <the value of column name is a blob to stream> then ".
+*/
+
+static int stream_test_sql(
+    store_context_t *context,
+    str_t *sql,
+    conststr_t name)
 {
-    {PRAGMA_PHASE_PRE_TRANSACTION,	CONSTSTR0("page_size")},
-    {PRAGMA_PHASE_PRE_TRANSACTION,	CONSTSTR0("auto_vacuum")},
+    store_vt const *vt=context->vt;
+    char min[24];
 
-    {PRAGMA_PHASE_IN_TRANSACTION,	CONSTSTR0("application_id")},
-    {PRAGMA_PHASE_IN_TRANSACTION,	CONSTSTR0("user_version")},
+    sqlite3_snprintf(
+        sizeof min,min,"%lld",(sqlite3_int64)context->params.stream_min);
+    return (*vt->str_app_7)(sql,stream_sql_1,sizeof stream_sql_1-1)
+        || (*vt->str_app_id)(sql,name.text,name.size)
+        || (*vt->str_app_7)(sql,stream_sql_2,sizeof stream_sql_2-1)
+        || (*vt->str_app_id)(sql,name.text,name.size)
+        || (*vt->str_app_7)(sql,stream_sql_3,sizeof stream_sql_3-1)
+        || (*vt->str_app_7)(sql,min,strlen(min))
+        || (*vt->str_app_7)(sql,stream_sql_4,sizeof stream_sql_4-1)
+        ? -1 : 0;
+}
 
-    {PRAGMA_PHASE_POST_TRANSACTION,	CONSTSTR0("journal_mode")},
+/*
+  Map a column to the column with the sizes of its streamed values,
+  if it has any.
+*/
 
-    {0, {NULL, 0}}
-};
+static int stream_map(
+    store_context_t *context,
+    size_t colix,
+    int stream)
+{
+    if (colix>=context->streamcap) {
+        size_t cap=context->streamcap ? context->streamcap*2 : 64;
+        size_t *grown;
 
-static char const pragmas_select_sql[] =
-    "select * from temp.pragmas";
+        grown=crealloc(&context->c,context->streamat,cap*sizeof *grown);
+        if (!grown)
+            return -1;
+        context->streamat=grown;
+        context->streamcap=cap;
+    }
+    context->streamat[colix]=stream ? ++context->streamcnt : 0;
+    return 0;
+}
 
-static char const pragma_sql_1[] =
-    "pragma ";
+/*
+  Append the expression for a column whose big blobs are streamed
+  to sql, and the one for their sizes to tail.
+*/
 
-static int extract_pragmas(
-    store_context_t *context)
+static int stream_column_sql(
+    store_context_t *context,
+    str_t *sql,
+    str_t *tail,
+    conststr_t name)
+{
+    store_vt const *vt=context->vt;
+
+    if (stream_test_sql(context,sql,name)
+            || (*vt->str_app_7)(sql,stream_sql_5,sizeof stream_sql_5-1)
+            || (*vt->str_app_id)(sql,name.text,name.size)
+            || (*vt->str_app_7)(sql,stream_sql_6,sizeof stream_sql_6-1)
+            || (*vt->str_app_id)(sql,name.text,name.size))
+        return -1;
+    if ((*vt->str_app_7)(tail,",",1)
+            || stream_test_sql(context,tail,name)
+            || (*vt->str_app_7)(tail,stream_sql_7,sizeof stream_sql_7-1)
+            || (*vt->str_app_id)(tail,name.text,name.size)
+            || (*vt->str_app_7)(tail,stream_sql_8,sizeof stream_sql_8-1))
+        return -1;
+    return 0;
+}
+
+/*
+  Build the statement text that extracts the contents of one table,
+  or of a rowid range of it.  The column list comes from pragma table_info
+  rather than "*" so that hidden columns are left out.  With
+  S3BD_STORE_TYPED, the column types of a STRICT table are collected
+  on the way for the rowset to declare.  Columns that may have blobs
+  to stream are wrapped, and their sizes added (see stream_extra).
+*/
+
+static int table_select_sql(
+    store_context_t *context,
+    conststr_t tablename,
+    store_range_t const *range,
+    str_t *sql)
 {
+    store_vt const *vt=context->vt;
+    sqlite3_stmt *list_columns=NULL;
+    sqlite3_stmt *indexed=NULL;
+    conststr_t rowid;
+    str_t tail;
     int status;
-    char *errmsg=NULL;
-    sqlite3_stmt *remember=NULL;
-    sqlite3_stmt *extract=NULL;
-    str_t sql;
-    pragma_def_t const *def;
+    int colcnt;
+    int strict;
+    int typed=0;
+    int room;
 
-    str_init(&sql,&context->c);
-    status=sqlite3_exec(
-        context->c.connection,pragmas_create_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        errf(
-            &context->c,status,
-            "Failed to create temporary pragmas table: %s",errmsg);
+    str_init(&tail,&context->c);
+    context->typeuse=0;
+    context->streamcnt=0;
+    strict=table_strict(context,tablename);
+    if (strict<0)
         goto cleanup;
-    }
-    context->have_pragmas=1;
-
-    status=sqlite3_prepare_v2(
-        context->c.connection,
-        pragmas_insert_sql,sizeof pragmas_insert_sql,
-        &remember,
-        NULL);
+    if (stream_prepare(context,tablename,&rowid,&indexed,&room))
+        goto cleanup;
+    if (indexed && (*vt->str_app_7)(&tail,",",1))
+        goto cleanup;
+    if (indexed && (*vt->str_app_7)(&tail,rowid.text,rowid.size))
+        goto cleanup;
+    sql->size=0;
+    if ((*vt->str_app_7)(sql,table_info_sql_1,sizeof table_info_sql_1-1))
+        goto cleanup;
+    if ((*vt->str_app_id)(sql,tablename.text,tablename.size))
+        goto cleanup;
+    status=(*vt->prepare)(&context->c,sql->text,sql->size,&list_columns);
     if (status!=SQLITE_OK) {
         errf(
             &context->c,status,
-            "While getting pragma values: sqlite3_prepare: %s",
+            "While extracting tables: sqlite3_prepare: %s",
             sqlite3_errmsg(context->c.connection));
         goto cleanup;
     }
-    for (def=pragma_defs; def->name.text; def++) {
-        status=sqlite3_bind_int(remember,1,def->phase);
-        if (status!=SQLITE_OK) {
-            errf(
-                &context->c,status,
-                "While getting pragma %s value: sqlite3_bind: %s",
-                def->name.text,sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        status=sqlite3_bind_text(
-            remember,
-            2,
-            def->name.text,def->name.size,
-            SQLITE_STATIC);
-        if (status!=SQLITE_OK) {
-            errf(
-                &context->c,status,
-                "While getting pragma %s value: sqlite3_bind: %s",
-                def->name.size,sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        if (str8app_7(&sql,pragma_sql_1,sizeof pragma_sql_1-1))
-            goto cleanup;
-        if (str8app_id(&sql,def->name.text,def->name.size))
-            goto cleanup;
-        status=sqlite3_prepare_v2(
-            context->c.connection,
-            sql.text,sql.size,
-            &extract,
-            NULL);
-        if (status!=SQLITE_OK) {
-            errf(
-                &context->c,status,
-                "While getting pragma %s value: sqlite3_prepare: %s",
-                def->name.text,sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        str_free(&sql);
-        for (;;) {
-            sqlite3_value *value;
+    sql->size=0;
+    if ((*vt->str_app_7)(sql,get_rows_sql_1,sizeof get_rows_sql_1-1))
+        goto cleanup;
+    colcnt=0;
+    for (;;) {
+        conststr_t colname;
+        int stream=0;
 
-            status=sqlite3_step(extract);
-            if (status!=SQLITE_ROW)
-                break;
-            value=sqlite3_column_value(extract,0);
-            if (!value) {
-                context->c.status=SQLITE_NOMEM;
-                goto cleanup;
-            }
-            status=sqlite3_bind_value(remember,3,value);
-            if (status!=SQLITE_OK) {
-                errf(
-                    &context->c,status,
-                    "While getting pragma %s value: sqlite3_bind: %s",
-                    def->name.text,sqlite3_errmsg(context->c.connection));
-                goto cleanup;
-            }
-            status=sqlite3_step(remember);
-            if (status!=SQLITE_DONE) {
-                errf(
-                    &context->c,status,
-                    "While getting pragma %s value: sqlite3_step: %s",
-                    def->name.text,sqlite3_errmsg(context->c.connection));
+        status=sqlite3_step(list_columns);
+        if (status!=SQLITE_ROW)
+            break;
+        if (indexed) {
+            if ((int)context->streamcnt<room)
+                stream=stream_column(context,indexed,list_columns,strict);
+            if (stream<0 || stream_map(context,colcnt,stream))
                 goto cleanup;
-            }
-            sqlite3_reset(remember);
-            sqlite3_bind_null(remember,2);
         }
-        if (status!=SQLITE_DONE) {
-            errf(
-                &context->c,status,
-                "While getting pragma %s value: sqlite3_step: %s",
-                def->name.text,sqlite3_errmsg(context->c.connection));
+        if ((*vt->column_text)(&context->c,list_columns,1,&colname))
             goto cleanup;
-        }
-        sqlite3_finalize(extract);
-        extract=NULL;
-    }
-    sqlite3_finalize(remember);
-    remember=NULL;
-    return 0;
-
-cleanup:
-    if (errmsg)
-        sqlite3_free(errmsg);
-    str_free(&sql);
-    if (remember)
-        sqlite3_finalize(remember);
-    if (extract)
-        sqlite3_finalize(extract);
-    return -1;
-}
-
-static int store_pragmas(
-    store_context_t *context)
-{
-    int status;
-    sqlite3_stmt *get_rows;
+        if (colcnt>0) {
+            if ((*vt->str_app_7)(sql,",",1))
+                goto cleanup;
+        }
+        if (stream) {
+            if (stream_column_sql(context,sql,&tail,colname))
+                goto cleanup;
+        } else {
+            if ((*vt->str_app_id)(sql,colname.text,colname.size))
+                goto cleanup;
+        }
+        if (strict && (context->flags & S3BD_STORE_TYPED)) {
+            if ((size_t)colcnt>=context->typecap) {
+                size_t cap=context->typecap ? context->typecap*2 : 64;
+                unsigned char *grown;
 
-    status=sqlite3_prepare_v2(
-        context->c.connection,
-        pragmas_select_sql,sizeof pragmas_select_sql,
-        &get_rows,
-        NULL);
-    if (status!=SQLITE_OK) {
+                grown=crealloc(&context->c,context->types,cap);
+                if (!grown)
+                    goto cleanup;
+                context->types=grown;
+                context->typecap=cap;
+            }
+            context->types[colcnt]=strict_type(
+                (char const *)sqlite3_column_text(list_columns,2));
+            if (context->types[colcnt])
+                typed=1;
+        }
+        colcnt++;
+    }
+    if (status!=SQLITE_DONE) {
         errf(
             &context->c,status,
-            "While getting pragma values: sqlite3_prepare: %s",
+            "While extracting tables: sqlite3_step: %s",
             sqlite3_errmsg(context->c.connection));
         goto cleanup;
     }
-    if (store_rowset(context,context->vt->pragmas_id,get_rows))
+    if (!colcnt) {
+        errf(
+            &context->c,SQLITE_ERROR,
+            "While extracting tables: pragma table_info returned no rows");
         goto cleanup;
-    sqlite3_finalize(get_rows);
-    get_rows=NULL;
+    }
+    sqlite3_finalize(list_columns);
+    list_columns=NULL;
+    if (indexed) {
+        sqlite3_finalize(indexed);
+        indexed=NULL;
+    }
+    if (context->streamcnt && str8app(sql,tail.text,tail.size))
+        goto cleanup;
+    str_free(&tail);
+    if ((*vt->str_app_7)(sql,get_rows_sql_2,sizeof get_rows_sql_2-1))
+        goto cleanup;
+    if ((*vt->str_app_id)(sql,tablename.text,tablename.size))
+        goto cleanup;
+    if (range) {
+        if ((*vt->str_app_7)(sql,get_rows_sql_3,sizeof get_rows_sql_3-1))
+            goto cleanup;
+        if ((*vt->str_app_7)(sql,range->rowid.text,range->rowid.size))
+            goto cleanup;
+        if ((*vt->str_app_7)(sql,get_rows_sql_4,sizeof get_rows_sql_4-1))
+            goto cleanup;
+    }
+    context->typeuse=typed;
     return 0;
 
 cleanup:
-    if (get_rows)
-        sqlite3_finalize(get_rows);
+    str_free(&tail);
+    if (list_columns)
+        sqlite3_finalize(list_columns);
+    if (indexed)
+        sqlite3_finalize(indexed);
+    context->streamcnt=0;
     return -1;
 }
 
-static void store_done_pragmas(
-    store_context_t *context)
-{
-    if (context->have_pragmas) {
-        sqlite3_exec(context->c.connection,pragmas_drop_sql,0,NULL,NULL);
-        context->have_pragmas=0;
-    }
-}
-
-#define __(x) #x
-#define _(x) __(x)
-
-static char const schema_extract_sql[] =
-    "create table temp.schema as "
-    "select "
-    "  case type "
-    "  when 'table' then "
-    "    case "
-    "    when rootpage>0 then "
-    "      " _(SCHEMA_PHASE_TABLE) " "
-    "    else "
-    "      " _(SCHEMA_PHASE_VIRTUAL_TABLE) " "
-    "    end "
-    "  when 'index' then "
-    "    " _(SCHEMA_PHASE_INDEX) " "
-    "  when 'view' then "
-    "    " _(SCHEMA_PHASE_VIEW) " "
-    "  when 'trigger' then "
-    "    " _(SCHEMA_PHASE_TRIGGER) " "
-    "  end as phase, "
-    "  name, "
-    "  sql "
-    "from sqlite_schema "
-    "  where sql is not null";
-
-static char const schema_select_sql[] =
-    "select * from temp.schema";
-
-static char const table_names_sql[] =
-    "select name from temp.schema "
-    "  where phase=" _(SCHEMA_PHASE_TABLE) " "
-    "  order by name='sqlite_sequence'";
-
-static char const get_rows_sql_1[] =
-    "select ";
-static char const get_rows_sql_2[] =
-    " from ";
-
-static int store_schema(
-    store_context_t *context)
+static int store_table(
+    store_context_t *context,
+    conststr_t tablename,
+    store_range_t const *range,
+    str_t *sql)
 {
-    store_vt const *vt=context->vt;
-    char *errmsg=NULL;
     sqlite3_stmt *get_rows=NULL;
     int status;
 
-    status=sqlite3_exec(
-        context->c.connection,schema_extract_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        errf(
-            &context->c,status,
-            "Failed to extract schema: %s",errmsg);
+    if (table_select_sql(context,tablename,range,sql))
         goto cleanup;
-    }
-    context->have_schema=1;
-    status=sqlite3_prepare_v2(
-        context->c.connection,
-        schema_select_sql,sizeof schema_select_sql,
-        &get_rows,
-        NULL);
+    status=(*context->vt->prepare)(&context->c,sql->text,sql->size,&get_rows);
     if (status!=SQLITE_OK) {
         errf(
             &context->c,status,
-            "While extracting schema: sqlite3_prepare: %s",
+            "While extracting tables: sqlite3_prepare: %s",
             sqlite3_errmsg(context->c.connection));
         goto cleanup;
     }
-    if (store_rowset(context,vt->schema_id,get_rows))
-        goto cleanup;
+    sql->size=0;
+    if (range) {
+        status=sqlite3_bind_int64(get_rows,1,range->first);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While extracting tables: sqlite3_bind: %s",
+                sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+        status=sqlite3_bind_int64(get_rows,2,range->last);
+        if (status!=SQLITE_OK) {
+            errf(
+                &context->c,status,
+                "While extracting tables: sqlite3_bind: %s",
+                sqlite3_errmsg(context->c.connection));
+            goto cleanup;
+        }
+    }
+    if (context->flags & S3BD_STORE_PIPELINE) {
+        if (store_rowset_piped(context,tablename,get_rows))
+            goto cleanup;
+    } else {
+        if (store_rowset(context,tablename,get_rows))
+            goto cleanup;
+    }
     sqlite3_finalize(get_rows);
     get_rows=NULL;
     return 0;
 
 cleanup:
-    if (errmsg)
-        sqlite3_free(errmsg);
     if (get_rows)
         sqlite3_finalize(get_rows);
     return -1;
 }
 
-static void store_done_schema(
-    store_context_t *context)
-{
-    if (context->have_schema) {
-        sqlite3_exec(context->c.connection,schema_drop_sql,0,NULL,NULL);
-        context->have_schema=0;
-    }
-}
-
 static int store_tables(
     store_context_t *context)
 {
     store_vt const *vt=context->vt;
     sqlite3_stmt *list_tables=NULL;
-    sqlite3_stmt *list_columns=NULL;
-    sqlite3_stmt *get_rows=NULL;
     str_t sql;
     int status;
 
@@ -737,78 +4151,14 @@ static int store_tables(
     }
     for (;;) {
         conststr_t tablename;
-        int colcnt;
 
         status=sqlite3_step(list_tables);
         if (status!=SQLITE_ROW)
             break;
         if ((*vt->column_text)(&context->c,list_tables,0,&tablename))
             goto cleanup;
-        if ((*vt->str_app_7)(&sql,table_info_sql_1,sizeof table_info_sql_1-1))
-            goto cleanup;
-        if ((*vt->str_app_id)(&sql,tablename.text,tablename.size))
-            goto cleanup;
-        status=(*vt->prepare)(&context->c,sql.text,sql.size,&list_columns);
-        if (status!=SQLITE_OK) {
-            errf(
-                &context->c,status,
-                "While extracting tables: sqlite3_prepare: %s",
-                sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        sql.size=0;
-        if ((*vt->str_app_7)(&sql,get_rows_sql_1,sizeof get_rows_sql_1-1))
-            goto cleanup;
-        colcnt=0;
-        for (;;) {
-            conststr_t colname;
-
-            status=sqlite3_step(list_columns);
-            if (status!=SQLITE_ROW)
-                break;
-            if ((*vt->column_text)(&context->c,list_columns,1,&colname))
-                goto cleanup;
-            if (colcnt>0) {
-                if ((*vt->str_app_7)(&sql,",",1))
-                    goto cleanup;
-            }
-            if ((*vt->str_app_id)(&sql,colname.text,colname.size))
-                goto cleanup;
-            colcnt++;
-        }
-        if (status!=SQLITE_DONE) {
-            errf(
-                &context->c,status,
-                "While extracting tables: sqlite3_step: %s",
-                sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        if (!colcnt) {
-            errf(
-                &context->c,SQLITE_ERROR,
-                "While extracting tables: pragma table_info returned no rows");
-            goto cleanup;
-        }
-        sqlite3_finalize(list_columns);
-        list_columns=NULL;
-        if ((*vt->str_app_7)(&sql,get_rows_sql_2,sizeof get_rows_sql_2-1))
-            goto cleanup;
-        if ((*vt->str_app_id)(&sql,tablename.text,tablename.size))
-            goto cleanup;
-        status=(*vt->prepare)(&context->c,sql.text,sql.size,&get_rows);
-        if (status!=SQLITE_OK) {
-            errf(
-                &context->c,status,
-                "While extracting tables: sqlite3_prepare: %s",
-                sqlite3_errmsg(context->c.connection));
-            goto cleanup;
-        }
-        sql.size=0;
-
-        if (store_rowset(context,tablename,get_rows))
+        if (store_table(context,tablename,NULL,&sql))
             goto cleanup;
-        sqlite3_finalize(get_rows);
-        get_rows=NULL;
     }
     if (status!=SQLITE_DONE) {
         errf(
@@ -825,10 +4175,6 @@ static int store_tables(
 cleanup:
     if (list_tables)
         sqlite3_finalize(list_tables);
-    if (list_columns)
-        sqlite3_finalize(list_columns);
-    if (get_rows)
-        sqlite3_finalize(get_rows);
     str_free(&sql);
     return -1;
 }
@@ -859,12 +4205,61 @@ cleanup:
     return -1;
 }
 
+/*
+  Write the table of contents.  Its entries are encoded like rows,
+  in the block buffer, so that the size is known up front.
+*/
+
+static int store_toc(
+    store_context_t *context)
+{
+    unsigned char head[5];
+    unsigned char foot[TOC_FOOTER_SIZE];
+    sqlite3_uint64 offset;
+    size_t size,ix;
+
+    offset=out_tell(context);
+    if (out_block_enter(context))
+        return -1;
+    for (ix=0; ix<context->toccnt; ix++) {
+        toc_entry_t const *entry=&context->toc[ix];
+
+        if (store_textcol(context,entry->name,entry->namesize))
+            return -1;
+        if (store_intcol(context,entry->offset))
+            return -1;
+        if (store_intcol(context,entry->rows))
+            return -1;
+        if (store_intcol(context,entry->size))
+            return -1;
+        if (store_intcol(context,entry->colcnt))
+            return -1;
+    }
+    size=context->outfill;
+    out_block_leave(context);
+    head[0]=TOC();
+    put_u32(head+1,size);
+    put_u64(foot,offset);
+    put_u32(foot+8,size);
+    put_u32(foot+12,crc32c(context->blockbuf,size));
+    memcpy(foot+16,s3bd_toc_magic,sizeof s3bd_toc_magic);
+    if (wd(context,head,sizeof head))
+        return -1;
+    if (wd(context,context->blockbuf,size))
+        return -1;
+    return wd(context,foot,sizeof foot);
+}
+
 static int store_end(
     store_context_t *context)
 {
+    if ((context->flags & S3BD_STORE_TOC) && store_toc(context))
+        return -1;
     if (wc(context,ENDDUMP()))
         return -1;
-    if (fflush(context->outfile)) {
+    if (out_sync(context))
+        return -1;
+    if (context->outfile && fflush(context->outfile)) {
         errf(
             &context->c,SQLITE_IOERR_WRITE,
             "Write error: %s",strerror(errno));
@@ -873,20 +4268,73 @@ static int store_end(
     return 0;
 }
 
-int s3bd_store(
+/* See parstore.c */
+
+static int store_tables_parallel(
+    store_context_t *context);
+
+/*
+  Where the public store functions want the dump to go:
+  to io if it isn't NULL, into memory if dump isn't NULL,
+  and to outfile otherwise.
+*/
+
+typedef struct store_target_t {
+    FILE *outfile;
+    s3bd_store_io_t const *io;
+    void **dump;
+    size_t *size;
+} store_target_t;
+
+static int store_main(
     sqlite3 *connection,
-    FILE *outfile,
+    store_target_t const *target,
     unsigned int flags,
+    s3bd_store_params_t const *params,
     char const * const *overrides,
     char **errmsg)
 {
     store_context_t context;
 
     memset(&context,0,sizeof context);
-    context.outfile=outfile;
+    context.flags=flags;
+    if (params)
+        context.params=*params;
+    if (!context.params.blob_store_min)
+        context.params.blob_store_min=BLOB_STORE_MIN;
+    if (!context.params.stream_min)
+        context.params.stream_min=STREAM_MIN;
+    /* Blobs this streams still go in a blob store (see stream_stored). */
+    if (context.params.mem_budget
+            && context.params.stream_min>context.params.mem_budget/16)
+        context.params.stream_min=context.params.mem_budget/16;
     if (context_init(&context.c,connection))
         goto cleanup;
+    if (budget_begin(&context.c,&context.budget,context.params.mem_budget))
+        goto cleanup;
+    if (target->io) {
+        if (out_attach_io(&context,target->io))
+            goto cleanup;
+    } else if (target->dump) {
+        if (out_attach_mem(&context))
+            goto cleanup;
+    } else {
+        if (out_attach(&context,target->outfile))
+            goto cleanup;
+        if ((flags & S3BD_STORE_URING) && !context.params.codec
+                && out_uring(&context))
+            goto cleanup;
+    }
+    if (context.params.codec && out_compress(&context))
+        goto cleanup;
 
+    if ((flags & S3BD_STORE_PARALLEL)
+            && (flags & S3BD_STORE_IN_TRANSACTION)) {
+        errf(
+            &context.c,SQLITE_MISUSE,
+            "Parallel store can't see changes made inside a transaction");
+        goto cleanup;
+    }
     if (!(flags & S3BD_STORE_IN_TRANSACTION)
             && store_begin_transaction(&context))
         goto cleanup;
@@ -904,13 +4352,31 @@ int s3bd_store(
     if (store_schema(&context))
         goto cleanup;
     if (!(flags & S3BD_STORE_SCHEMA_ONLY)) {
-        if (store_tables(&context))
-            goto cleanup;
+        if (flags & S3BD_STORE_PARALLEL) {
+            if (store_tables_parallel(&context))
+                goto cleanup;
+        } else {
+            if (store_tables(&context))
+                goto cleanup;
+        }
     }
     store_done_schema(&context);
     rollback_transaction(&context.c);
     if (store_end(&context))
         goto cleanup;
+    if (params && params->stats)
+        *params->stats=context.stats;
+    if (target->dump && context.zpool) {
+        *target->dump=context.zmem;
+        *target->size=context.zmemfill;
+        context.zmem=NULL;
+    } else if (target->dump) {
+        *target->dump=context.outbuf;
+        *target->size=context.outfill;
+        context.outbuf=NULL;
+    }
+    out_free(&context);
+    budget_end(&context.c,&context.budget);
     context_term(&context.c,errmsg);
     return SQLITE_OK;
 
@@ -918,6 +4384,68 @@ cleanup:
     store_done_pragmas(&context);
     store_done_schema(&context);
     rollback_transaction(&context.c);
+    if (params && params->stats)
+        *params->stats=context.stats;
+    out_free(&context);
+    budget_end(&context.c,&context.budget);
     return context_term(&context.c,errmsg);
 }
 
+int s3bd_store_io(
+    sqlite3 *connection,
+    s3bd_store_io_t const *io,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    store_target_t target;
+
+    memset(&target,0,sizeof target);
+    target.io=io;
+    return store_main(connection,&target,flags,params,overrides,errmsg);
+}
+
+int s3bd_store_mem(
+    sqlite3 *connection,
+    void **dump,
+    size_t *size,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    store_target_t target;
+
+    *dump=NULL;
+    *size=0;
+    memset(&target,0,sizeof target);
+    target.dump=dump;
+    target.size=size;
+    return store_main(connection,&target,flags,params,overrides,errmsg);
+}
+
+int s3bd_store_ex(
+    sqlite3 *connection,
+    FILE *outfile,
+    unsigned int flags,
+    s3bd_store_params_t const *params,
+    char const * const *overrides,
+    char **errmsg)
+{
+    store_target_t target;
+
+    memset(&target,0,sizeof target);
+    target.outfile=outfile;
+    return store_main(connection,&target,flags,params,overrides,errmsg);
+}
+
+int s3bd_store(
+    sqlite3 *connection,
+    FILE *outfile,
+    unsigned int flags,
+    char const * const *overrides,
+    char **errmsg)
+{
+    return s3bd_store_ex(connection,outfile,flags,NULL,overrides,errmsg);
+}
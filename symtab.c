@@ -0,0 +1,342 @@
+/*
+  Symbol tables for text values (see SYMBOL TABLE in format.txt), after
+  FSST ("fast static symbol table"): up to 255 symbols of 1 to 8 bytes,
+  each replaced by its one-byte code, with code 255 escaping a literal
+  byte.  Every value is coded on its own, so any one of them can be
+  decoded without the others, and decoding is little more than a table
+  lookup and an 8-byte store per code.
+
+  A table is learned from a sample of text in a few rounds: code the
+  sample with the table so far, count how often each symbol and each
+  pair of adjacent symbols occurs, and keep the 255 symbols (or pairs
+  merged into one) that cover the most bytes.
+
+  Symbols are kept as little-endian words, their first byte in the low
+  bits, so the bytes of a word match them as is.  For the encoder, first
+  and order index the symbols of two bytes or more by their first two
+  bytes, longest first, and single has the code of each one-byte symbol.
+*/
+
+#define SYMTAB_SYMBOLS	255
+#define SYMTAB_ESCAPE	255
+#define SYMTAB_ROUNDS	5
+
+typedef struct symtab_t {
+    sqlite3_uint64 sym[256];
+    unsigned char len[256];
+    unsigned int cnt;
+    unsigned short first[65537];
+    unsigned char order[SYMTAB_SYMBOLS];
+    short single[256];
+} symtab_t;
+
+static sqlite3_uint64 const symtab_mask[9] =
+{
+    0,
+    0xFF,
+    0xFFFF,
+    0xFFFFFF,
+    0xFFFFFFFF,
+    0xFFFFFFFFFF,
+    0xFFFFFFFFFFFF,
+    0xFFFFFFFFFFFFFF,
+    0xFFFFFFFFFFFFFFFF
+};
+
+static void symtab_index(
+    symtab_t *symtab)
+{
+    unsigned int code,len,key;
+
+    memset(symtab->first,0,sizeof symtab->first);
+    for (key=0; key<256; key++) {
+        symtab->single[key]=-1;
+    }
+    for (code=0; code<symtab->cnt; code++) {
+        if (symtab->len[code]>1)
+            symtab->first[(symtab->sym[code]&0xFFFF)+1]++;
+        else
+            symtab->single[symtab->sym[code]&0xFF]=code;
+    }
+    for (key=0; key<65536; key++) {
+        symtab->first[key+1]+=symtab->first[key];
+    }
+
+    /* Fill each bucket from its start, which ends up at the next one's. */
+    for (len=8; len>1; len--) {
+        for (code=0; code<symtab->cnt; code++) {
+            if (symtab->len[code]==len)
+                symtab->order[symtab->first[symtab->sym[code]&0xFFFF]++]=code;
+        }
+    }
+    memmove(symtab->first+1,symtab->first,65536*sizeof *symtab->first);
+    symtab->first[0]=0;
+}
+
+/*
+  The code of the longest symbol that src (avail bytes of it) starts
+  with, with its length in *len, or -1 if there is none.
+*/
+
+static int symtab_match(
+    symtab_t const *symtab,
+    unsigned char const *src,
+    size_t avail,
+    unsigned int *len)
+{
+    sqlite3_uint64 word;
+    unsigned int ix,end,code;
+
+    if (avail>=8) {
+        word=get_u64le(src);
+    } else {
+        unsigned char pad[8];
+
+        memset(pad,0,sizeof pad);
+        memcpy(pad,src,avail);
+        word=get_u64le(pad);
+    }
+    if (avail>=2) {
+        end=symtab->first[(word&0xFFFF)+1];
+        for (ix=symtab->first[word&0xFFFF]; ix<end; ix++) {
+            code=symtab->order[ix];
+            if (symtab->len[code]<=avail
+                    && (word & symtab_mask[symtab->len[code]])
+                        ==symtab->sym[code]) {
+                *len=symtab->len[code];
+                return code;
+            }
+        }
+    }
+    *len=1;
+    return symtab->single[*src];
+}
+
+/*
+  Code size bytes of src into dst, which has room for twice as many.
+  Returns the coded size.
+*/
+
+static size_t symtab_encode(
+    symtab_t const *symtab,
+    unsigned char const *src,
+    size_t size,
+    unsigned char *dst)
+{
+    unsigned char *out=dst;
+    unsigned int len;
+    size_t pos=0;
+    int code;
+
+    while (pos<size) {
+        code=symtab_match(symtab,src+pos,size-pos,&len);
+        if (code<0) {
+            *out++=SYMTAB_ESCAPE;
+            *out++=src[pos++];
+        } else {
+            *out++=code;
+            pos+=len;
+        }
+    }
+    return out-dst;
+}
+
+/*
+  Decode size bytes of text into dst, which must have room for 7 bytes
+  more, from at most avail coded bytes at src.  Returns the number
+  of coded bytes used, or (size_t)-1 if they don't decode to exactly
+  size bytes.
+*/
+
+static size_t symtab_decode(
+    symtab_t const *symtab,
+    unsigned char const *src,
+    size_t avail,
+    unsigned char *dst,
+    size_t size)
+{
+    unsigned char const *in=src;
+    unsigned char const *end=src+avail;
+    unsigned char *out=dst;
+    unsigned char *outend=dst+size;
+    unsigned int code;
+
+    while (out<outend) {
+        if (in>=end)
+            return (size_t)-1;
+        code=*in++;
+        if (code==SYMTAB_ESCAPE) {
+            if (in>=end)
+                return (size_t)-1;
+            *out++=*in++;
+        } else {
+            if (code>=symtab->cnt
+                    || symtab->len[code]>(size_t)(outend-out))
+                return (size_t)-1;
+            put_u64le(out,symtab->sym[code]);
+            out+=symtab->len[code];
+        }
+    }
+    return in-src;
+}
+
+/*
+  Table building.  Codes of the sample are numbered 0 to 254 for symbols
+  and 256 plus the byte for escaped bytes.
+*/
+
+typedef struct symtab_cand_t {
+    sqlite3_uint64 sym;
+    unsigned int len;
+    size_t gain;
+} symtab_cand_t;
+
+static int symtab_cmp_pair(
+    void const *a,
+    void const *b)
+{
+    unsigned int x=*(unsigned int const *)a;
+    unsigned int y=*(unsigned int const *)b;
+
+    return x<y ? -1 : x>y;
+}
+
+static int symtab_cmp_sym(
+    void const *a,
+    void const *b)
+{
+    symtab_cand_t const *x=a;
+    symtab_cand_t const *y=b;
+
+    if (x->len!=y->len)
+        return x->len<y->len ? -1 : 1;
+    return x->sym<y->sym ? -1 : x->sym>y->sym;
+}
+
+static int symtab_cmp_gain(
+    void const *a,
+    void const *b)
+{
+    symtab_cand_t const *x=a;
+    symtab_cand_t const *y=b;
+
+    if (x->gain!=y->gain)
+        return x->gain>y->gain ? -1 : 1;
+    return symtab_cmp_sym(a,b);
+}
+
+static void symtab_code_sym(
+    symtab_t const *symtab,
+    unsigned int code,
+    sqlite3_uint64 *sym,
+    unsigned int *len)
+{
+    if (code>=256) {
+        *sym=code-256;
+        *len=1;
+    } else {
+        *sym=symtab->sym[code];
+        *len=symtab->len[code];
+    }
+}
+
+/*
+  Learn a table from size bytes of sample.  The table may come out
+  empty if the sample is.
+*/
+
+static int symtab_build(
+    context_t *context,
+    symtab_t *symtab,
+    unsigned char const *sample,
+    size_t size)
+{
+    unsigned int *codes=NULL;
+    unsigned int *pairs=NULL;
+    symtab_cand_t *cands=NULL;
+    size_t counts[512];
+    size_t ncodes,npairs,ncands,pos,ix,run;
+    unsigned int round,len,len2;
+    sqlite3_uint64 sym,sym2;
+    int code,status=-1;
+
+    symtab->cnt=0;
+    symtab_index(symtab);
+    if (!size)
+        return 0;
+    codes=cmalloc(context,size*sizeof *codes);
+    pairs=cmalloc(context,size*sizeof *pairs);
+    cands=cmalloc(context,(512+size)*sizeof *cands);
+    if (!codes || !pairs || !cands)
+        goto cleanup;
+    for (round=0; round<SYMTAB_ROUNDS; round++) {
+        ncodes=0;
+        for (pos=0; pos<size; pos+=len) {
+            code=symtab_match(symtab,sample+pos,size-pos,&len);
+            if (code<0) {
+                codes[ncodes++]=256+sample[pos];
+                len=1;
+            } else {
+                codes[ncodes++]=code;
+            }
+        }
+        memset(counts,0,sizeof counts);
+        npairs=0;
+        for (ix=0; ix<ncodes; ix++) {
+            counts[codes[ix]]++;
+            if (ix==0)
+                continue;
+            symtab_code_sym(symtab,codes[ix-1],&sym,&len);
+            symtab_code_sym(symtab,codes[ix],&sym2,&len2);
+            if (len+len2<=8)
+                pairs[npairs++]=codes[ix-1]<<9 | codes[ix];
+        }
+        ncands=0;
+        for (ix=0; ix<512; ix++) {
+            if (!counts[ix])
+                continue;
+            symtab_code_sym(symtab,ix,&sym,&len);
+            cands[ncands].sym=sym;
+            cands[ncands].len=len;
+            cands[ncands].gain=counts[ix]*len;
+            ncands++;
+        }
+        qsort(pairs,npairs,sizeof *pairs,symtab_cmp_pair);
+        for (ix=0; ix<npairs; ix+=run) {
+            for (run=1; ix+run<npairs && pairs[ix+run]==pairs[ix]; run++)
+                ;
+            symtab_code_sym(symtab,pairs[ix]>>9,&sym,&len);
+            symtab_code_sym(symtab,pairs[ix]&511,&sym2,&len2);
+            cands[ncands].sym=sym | sym2<<len*8;
+            cands[ncands].len=len+len2;
+            cands[ncands].gain=run*(len+len2);
+            ncands++;
+        }
+
+        /* The same symbol may come from several pairs. */
+        qsort(cands,ncands,sizeof *cands,symtab_cmp_sym);
+        for (ix=0, pos=0; ix<ncands; ix++) {
+            if (pos && !symtab_cmp_sym(&cands[pos-1],&cands[ix]))
+                cands[pos-1].gain+=cands[ix].gain;
+            else
+                cands[pos++]=cands[ix];
+        }
+        ncands=pos;
+        qsort(cands,ncands,sizeof *cands,symtab_cmp_gain);
+        if (ncands>SYMTAB_SYMBOLS)
+            ncands=SYMTAB_SYMBOLS;
+        for (ix=0; ix<ncands; ix++) {
+            symtab->sym[ix]=cands[ix].sym;
+            symtab->len[ix]=cands[ix].len;
+        }
+        symtab->cnt=ncands;
+        symtab_index(symtab);
+    }
+    status=0;
+
+cleanup:
+    sqlite3_free(codes);
+    sqlite3_free(pairs);
+    sqlite3_free(cands);
+    return status;
+}
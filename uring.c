@@ -0,0 +1,614 @@
+/*
+  A small io_uring driver for dump I/O.  It talks to the kernel directly,
+  so there's no dependency on liburing.
+
+  A fixed set of large buffers cycles between the caller and the kernel.
+  When writing, the caller fills one buffer while the previous ones are
+  still being written; when reading, the caller consumes one buffer while
+  the following ones are being read ahead.  The buffers are registered
+  with the kernel when the memlock limit allows it.
+
+  Requests carry explicit file offsets, so only regular files and block
+  devices are handled.  For anything else, or when the kernel won't give
+  us a ring, uring_open declines and the caller does plain I/O instead.
+  File descriptors opened with O_DIRECT get aligned buffers and requests;
+  only the final write of a dump may have an unaligned length, and that
+  one is done synchronously with O_DIRECT switched off.
+*/
+
+#define URING_DEPTH	4
+#define URING_BUFSIZE	1048576
+#define URING_ALIGN	4096
+
+#ifdef S3BD_URING
+
+typedef struct uring_t {
+    int ringfd;
+    int fd;
+    int writing;
+    int direct;
+    int undirected;
+    int fixed;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_maplen;
+    void *cq_map;
+    size_t cq_maplen;
+    size_t sqes_maplen;
+    unsigned char *buf[URING_DEPTH];
+    size_t len[URING_DEPTH];
+    size_t got[URING_DEPTH];
+    off_t off[URING_DEPTH];
+    unsigned char busy[URING_DEPTH];
+    unsigned char ready[URING_DEPTH];
+    unsigned int cur;
+    int held;
+    off_t offset;
+    off_t tell;
+    int eof;
+} uring_t;
+
+static int uring_enter(
+    uring_t *ring,
+    unsigned int submit,
+    unsigned int wait)
+{
+    long result;
+
+    do {
+        result=syscall(
+            __NR_io_uring_enter,ring->ringfd,submit,wait,
+            wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    } while (result<0 && errno==EINTR);
+    return result<0 ? -1 : 0;
+}
+
+static void uring_unmap(
+    uring_t *ring)
+{
+    unsigned int ix;
+
+    if (ring->sqes)
+        munmap(ring->sqes,ring->sqes_maplen);
+    if (ring->cq_map && ring->cq_map!=ring->sq_map)
+        munmap(ring->cq_map,ring->cq_maplen);
+    if (ring->sq_map)
+        munmap(ring->sq_map,ring->sq_maplen);
+    if (ring->ringfd>=0)
+        close(ring->ringfd);
+    for (ix=0; ix<URING_DEPTH; ix++)
+        free(ring->buf[ix]);
+    if (ring->undirected)
+        fcntl(ring->fd,F_SETFL,fcntl(ring->fd,F_GETFL)|O_DIRECT);
+    sqlite3_free(ring);
+}
+
+/*
+  Queue a request for buffer ix and hand it to the kernel.
+  There are never more requests in flight than buffers,
+  so the submission queue can't overflow.
+*/
+
+static int uring_queue(
+    context_t *context,
+    uring_t *ring,
+    unsigned int ix,
+    size_t len)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail,slot;
+
+    tail=*ring->sq_tail;
+    slot=tail & *ring->sq_mask;
+    sqe=&ring->sqes[slot];
+    memset(sqe,0,sizeof *sqe);
+    if (ring->fixed) {
+        sqe->opcode=
+            ring->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index=ix;
+    } else {
+        sqe->opcode=ring->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd=ring->fd;
+    sqe->off=ring->offset;
+    sqe->addr=(unsigned long)ring->buf[ix];
+    sqe->len=len;
+    sqe->user_data=ix;
+    ring->sq_array[slot]=slot;
+    __atomic_store_n(ring->sq_tail,tail+1,__ATOMIC_RELEASE);
+    ring->len[ix]=len;
+    ring->off[ix]=ring->offset;
+    ring->busy[ix]=1;
+    ring->offset+=len;
+    if (uring_enter(ring,1,0)) {
+        ring->busy[ix]=0;
+        errf(
+            context,ring->writing ? SQLITE_IOERR_WRITE : SQLITE_IOERR_READ,
+            "io_uring_enter: %s",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Deal with a finished request.  Short transfers are rare enough
+  that the remainder is simply done synchronously.
+*/
+
+static int uring_complete(
+    context_t *context,
+    uring_t *ring,
+    unsigned int ix,
+    int result)
+{
+    size_t done;
+
+    if (result<0) {
+        errno=-result;
+        goto failed;
+    }
+    done=result;
+    while (done<ring->len[ix]) {
+        ssize_t more;
+
+        if (ring->writing) {
+            more=pwrite(
+                ring->fd,ring->buf[ix]+done,ring->len[ix]-done,
+                ring->off[ix]+done);
+        } else {
+            more=pread(
+                ring->fd,ring->buf[ix]+done,ring->len[ix]-done,
+                ring->off[ix]+done);
+        }
+        if (more<0) {
+            if (errno==EINTR)
+                continue;
+            goto failed;
+        }
+        if (!more)
+            break;
+        done+=more;
+    }
+    ring->got[ix]=done;
+    return 0;
+
+failed:
+    if (ring->writing) {
+        errf(
+            context,SQLITE_IOERR_WRITE,
+            "Write error: %s",strerror(errno));
+    } else {
+        errf(
+            context,SQLITE_IOERR_READ,
+            "Read error: %s",strerror(errno));
+    }
+    return -1;
+}
+
+/*
+  Wait until buffer ix is back from the kernel.
+*/
+
+static int uring_wait(
+    context_t *context,
+    uring_t *ring,
+    unsigned int ix)
+{
+    while (ring->busy[ix]) {
+        struct io_uring_cqe *cqe;
+        unsigned int head,done;
+        int result;
+
+        head=*ring->cq_head;
+        if (head==__atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE)) {
+            if (uring_enter(ring,0,1)) {
+                errf(
+                    context,
+                    ring->writing ? SQLITE_IOERR_WRITE : SQLITE_IOERR_READ,
+                    "io_uring_enter: %s",strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        cqe=&ring->cqes[head & *ring->cq_mask];
+        done=cqe->user_data;
+        result=cqe->res;
+        __atomic_store_n(ring->cq_head,head+1,__ATOMIC_RELEASE);
+        ring->busy[done]=0;
+        if (uring_complete(context,ring,done,result))
+            return -1;
+    }
+    return 0;
+}
+
+static int uring_drain(
+    context_t *context,
+    uring_t *ring)
+{
+    unsigned int ix;
+
+    for (ix=0; ix<URING_DEPTH; ix++) {
+        if (uring_wait(context,ring,ix))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+  Set up a ring for reading or writing fd, starting at its current
+  position.  Sets *ringp to NULL if io_uring isn't usable for this fd;
+  returns -1 only for actual errors.
+*/
+
+static int uring_open(
+    context_t *context,
+    uring_t **ringp,
+    int fd,
+    int writing)
+{
+    uring_t *ring;
+    struct io_uring_params params;
+    struct iovec iov[URING_DEPTH];
+    struct stat st;
+    unsigned int ix;
+    int flags;
+
+    *ringp=NULL;
+    if (fstat(fd,&st) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+        return 0;
+    flags=fcntl(fd,F_GETFL);
+    if (flags<0)
+        return 0;
+    ring=cmalloc(context,sizeof *ring);
+    if (!ring)
+        return -1;
+    memset(ring,0,sizeof *ring);
+    ring->ringfd=-1;
+    ring->fd=fd;
+    ring->writing=writing;
+    ring->held=-1;
+    ring->offset=lseek(fd,0,SEEK_CUR);
+    if (ring->offset<0)
+        goto declined;
+    ring->tell=ring->offset;
+    if (flags & O_DIRECT) {
+        if (ring->offset%URING_ALIGN) {
+            if (fcntl(fd,F_SETFL,flags & ~O_DIRECT))
+                goto declined;
+            ring->undirected=1;
+        } else {
+            ring->direct=1;
+        }
+    }
+    for (ix=0; ix<URING_DEPTH; ix++) {
+        void *buf;
+
+        if (posix_memalign(&buf,URING_ALIGN,URING_BUFSIZE)) {
+            context->status=SQLITE_NOMEM;
+            uring_unmap(ring);
+            return -1;
+        }
+        ring->buf[ix]=buf;
+        iov[ix].iov_base=buf;
+        iov[ix].iov_len=URING_BUFSIZE;
+    }
+
+    memset(&params,0,sizeof params);
+    ring->ringfd=syscall(__NR_io_uring_setup,URING_DEPTH,&params);
+    if (ring->ringfd<0)
+        goto declined;
+    ring->sq_maplen=params.sq_off.array+params.sq_entries*sizeof (unsigned int);
+    ring->cq_maplen=
+        params.cq_off.cqes+params.cq_entries*sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_maplen>ring->sq_maplen)
+            ring->sq_maplen=ring->cq_maplen;
+        ring->cq_maplen=ring->sq_maplen;
+    }
+    ring->sq_map=mmap(
+        NULL,ring->sq_maplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+        ring->ringfd,IORING_OFF_SQ_RING);
+    if (ring->sq_map==MAP_FAILED) {
+        ring->sq_map=NULL;
+        goto declined;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map=ring->sq_map;
+    } else {
+        ring->cq_map=mmap(
+            NULL,ring->cq_maplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+            ring->ringfd,IORING_OFF_CQ_RING);
+        if (ring->cq_map==MAP_FAILED) {
+            ring->cq_map=NULL;
+            goto declined;
+        }
+    }
+    ring->sqes_maplen=params.sq_entries*sizeof (struct io_uring_sqe);
+    ring->sqes=mmap(
+        NULL,ring->sqes_maplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+        ring->ringfd,IORING_OFF_SQES);
+    if (ring->sqes==MAP_FAILED) {
+        ring->sqes=NULL;
+        goto declined;
+    }
+    ring->sq_tail=(unsigned int *)((char *)ring->sq_map+params.sq_off.tail);
+    ring->sq_mask=
+        (unsigned int *)((char *)ring->sq_map+params.sq_off.ring_mask);
+    ring->sq_array=(unsigned int *)((char *)ring->sq_map+params.sq_off.array);
+    ring->cq_head=(unsigned int *)((char *)ring->cq_map+params.cq_off.head);
+    ring->cq_tail=(unsigned int *)((char *)ring->cq_map+params.cq_off.tail);
+    ring->cq_mask=
+        (unsigned int *)((char *)ring->cq_map+params.cq_off.ring_mask);
+    ring->cqes=
+        (struct io_uring_cqe *)((char *)ring->cq_map+params.cq_off.cqes);
+
+    /* Registration counts against RLIMIT_MEMLOCK; do without if it fails. */
+    ring->fixed=!syscall(
+        __NR_io_uring_register,ring->ringfd,IORING_REGISTER_BUFFERS,
+        iov,URING_DEPTH);
+
+    if (!writing) {
+        for (ix=0; ix<URING_DEPTH; ix++) {
+            if (uring_queue(context,ring,ix,URING_BUFSIZE)) {
+                uring_drain(context,ring);
+                uring_unmap(ring);
+                return -1;
+            }
+            ring->ready[ix]=1;
+        }
+    }
+    *ringp=ring;
+    return 0;
+
+declined:
+    uring_unmap(ring);
+    return 0;
+}
+
+/*
+  Writing: what the length of every write but the last must be
+  a multiple of.
+*/
+
+static size_t uring_align(
+    uring_t *ring)
+{
+    return ring->direct ? URING_ALIGN : 1;
+}
+
+/*
+  Writing: get the buffer to fill next.  Its size is URING_BUFSIZE.
+*/
+
+static unsigned char *uring_wbuf(
+    context_t *context,
+    uring_t *ring)
+{
+    if (uring_wait(context,ring,ring->cur))
+        return NULL;
+    return ring->buf[ring->cur];
+}
+
+/*
+  Writing: start writing the first len bytes of the buffer
+  last returned by uring_wbuf.
+*/
+
+static int uring_write(
+    context_t *context,
+    uring_t *ring,
+    size_t len)
+{
+    unsigned int ix=ring->cur;
+    size_t tail;
+
+    if (!len)
+        return 0;
+    tail=ring->direct ? len%URING_ALIGN : 0;
+    ring->cur=(ix+1)%URING_DEPTH;
+    if (len>tail && uring_queue(context,ring,ix,len-tail))
+        return -1;
+    if (tail) {
+        int flags;
+        ssize_t done;
+
+        if (uring_drain(context,ring))
+            return -1;
+        flags=fcntl(ring->fd,F_GETFL);
+        if (flags<0 || fcntl(ring->fd,F_SETFL,flags & ~O_DIRECT))
+            goto failed;
+        ring->direct=0;
+        ring->undirected=1;
+        do {
+            done=pwrite(ring->fd,ring->buf[ix]+len-tail,tail,ring->offset);
+        } while (done<0 && errno==EINTR);
+        if (done<0)
+            goto failed;
+        ring->len[ix]=tail;
+        ring->off[ix]=ring->offset;
+        ring->offset+=tail;
+        if (uring_complete(context,ring,ix,done))
+            return -1;
+    }
+    return 0;
+
+failed:
+    errf(
+        context,SQLITE_IOERR_WRITE,
+        "Write error: %s",strerror(errno));
+    return -1;
+}
+
+/*
+  Writing: wait for everything to land and leave the file position
+  just past the written data.
+*/
+
+static int uring_sync(
+    context_t *context,
+    uring_t *ring)
+{
+    if (uring_drain(context,ring))
+        return -1;
+    if (lseek(ring->fd,ring->offset,SEEK_SET)<0) {
+        errf(
+            context,SQLITE_IOERR_SEEK,
+            "Seek error: %s",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Reading: get the next buffer of file contents; *size is 0 at EOF.
+  The buffer stays valid until the next call.
+*/
+
+static int uring_read(
+    context_t *context,
+    uring_t *ring,
+    unsigned char **data,
+    size_t *size)
+{
+    unsigned int ix;
+
+    if (ring->held>=0) {
+        ix=ring->held;
+        ring->held=-1;
+        if (!ring->eof) {
+            if (uring_queue(context,ring,ix,URING_BUFSIZE))
+                return -1;
+            ring->ready[ix]=1;
+        }
+    }
+    ix=ring->cur;
+    *data=ring->buf[ix];
+    *size=0;
+    if (!ring->ready[ix])
+        return 0;
+    if (uring_wait(context,ring,ix))
+        return -1;
+    ring->ready[ix]=0;
+    ring->held=ix;
+    ring->tell=ring->off[ix];
+    ring->cur=(ix+1)%URING_DEPTH;
+    if (ring->got[ix]<URING_BUFSIZE)
+        ring->eof=1;
+    *size=ring->got[ix];
+    return 0;
+}
+
+/*
+  Reading: file offset of the start of the current buffer.
+*/
+
+static off_t uring_tell(
+    uring_t *ring)
+{
+    return ring->tell;
+}
+
+static void uring_close(
+    uring_t *ring)
+{
+    context_t dummy;
+    unsigned int tries;
+
+    /* Buffers the kernel is still using can't be freed under it. */
+    memset(&dummy,0,sizeof dummy);
+    for (tries=0; tries<=URING_DEPTH && uring_drain(&dummy,ring); tries++) {
+        sqlite3_free(dummy.errmsg);
+        dummy.errmsg=NULL;
+    }
+    uring_unmap(ring);
+}
+
+#else
+
+typedef struct uring_t {
+    int fd;
+} uring_t;
+
+static int uring_open(
+    context_t *context,
+    uring_t **ringp,
+    int fd,
+    int writing)
+{
+    (void)context;
+    (void)fd;
+    (void)writing;
+    *ringp=NULL;
+    return 0;
+}
+
+static size_t uring_align(
+    uring_t *ring)
+{
+    (void)ring;
+    return 1;
+}
+
+static unsigned char *uring_wbuf(
+    context_t *context,
+    uring_t *ring)
+{
+    (void)context;
+    (void)ring;
+    return NULL;
+}
+
+static int uring_write(
+    context_t *context,
+    uring_t *ring,
+    size_t len)
+{
+    (void)context;
+    (void)ring;
+    (void)len;
+    return -1;
+}
+
+static int uring_sync(
+    context_t *context,
+    uring_t *ring)
+{
+    (void)context;
+    (void)ring;
+    return -1;
+}
+
+static int uring_read(
+    context_t *context,
+    uring_t *ring,
+    unsigned char **data,
+    size_t *size)
+{
+    (void)context;
+    (void)ring;
+    *data=NULL;
+    *size=0;
+    return -1;
+}
+
+static off_t uring_tell(
+    uring_t *ring)
+{
+    (void)ring;
+    return 0;
+}
+
+static void uring_close(
+    uring_t *ring)
+{
+    (void)ring;
+}
+
+#endif